@@ -8,6 +8,10 @@
 */
 
 #include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <string>
 #include <vector>
 
 #include "mrmc.h"
@@ -16,6 +20,29 @@
 
 void AtA::collect(typedbytes_opaque& key, std::vector<double>& value) {
   add_row(value);
+  collect_local_row();
+}
+
+void AtA::read_local_row() {
+  if (!use_gram_kernel()) {
+    MatrixHandler::read_local_row();
+    return;
+  }
+  if (tile_.empty()) {
+    tile_.resize(GRAM_TILE_ROWS * num_cols_);
+  }
+  read_row(&tile_[tile_rows_ * num_cols_], 1);
+  ++tile_rows_;
+  ++num_total_rows_;
+}
+
+void AtA::collect_local_row() {
+  if (use_gram_kernel()) {
+    if (tile_rows_ == GRAM_TILE_ROWS) {
+      compress_tile();
+    }
+    return;
+  }
   if (num_local_rows_ >= num_rows_) {
     compress();
     hadoop_counter("compressions", 1);
@@ -23,6 +50,7 @@ void AtA::collect(typedbytes_opaque& key, std::vector<double>& value) {
 }
 
 void AtA::compress() {
+  transform_rows(&local_matrix_[0], num_rows_, num_local_rows_, false);
   double t0 = sf_time();
   if (local_AtA_ == NULL) {
     local_AtA_ = (double *) calloc(num_cols_ * num_cols_, sizeof(double));
@@ -37,13 +65,52 @@ void AtA::compress() {
   num_local_rows_ = 0;
 }
     
+void AtA::compress_tile() {
+  if (local_AtA_ == NULL) {
+    local_AtA_ = (double *) calloc(num_cols_ * num_cols_, sizeof(double));
+    assert(local_AtA_);
+  }
+  transform_rows(&tile_[0], num_cols_, tile_rows_, true);
+  if (kernels_ != NULL && kernels_->gram_update != NULL) {
+    kernels_->gram_update(&tile_[0], tile_rows_, local_AtA_);
+  } else {
+    gram_update(&tile_[0], tile_rows_, num_cols_, local_AtA_);
+  }
+  tile_rows_ = 0;
+}
+
+void AtA::compress_block(double *block, size_t nrows, size_t thread) {
+  // AtA runs with a single compute thread
+  assert(thread == 0);
+  // the rows left from first_row
+  if (num_local_rows_ > 0 || local_AtA_ == NULL) {
+    compress();
+  }
+  transform_rows(block, num_rows_, nrows, false);
+  double t0 = sf_time();
+  if (lapack_syrk(block, local_AtA_, num_rows_, num_cols_, nrows)) {
+    incr_lapack_time(sf_time() - t0);
+  } else {
+    hadoop_error("lapack error\n");
+  }
+  hadoop_counter("compressions", 1);
+}
+    
 void AtA::output() {
+  if (num_cols_ == 0) {
+    // no data was received on this task
+    return;
+  }
+  // the rows since the last compression
+  if (tile_rows_ > 0) {
+    compress_tile();
+  }
+  if (num_local_rows_ > 0 || local_AtA_ == NULL) {
+    compress();
+  }
   for (size_t i = 0; i < num_cols_; ++i) {
     out_.write_int(i);
-    out_.write_list_start();
-    for (size_t j = 0; j < num_cols_; ++j)
-      out_.write_double(local_AtA_[i + j * num_rows_]);
-    out_.write_list_end();
+    out_.write_double_list(&local_AtA_[i], num_cols_, num_cols_);
   }
 }
 
@@ -62,10 +129,10 @@ bool RowSum::read_key_val_pair(int *key, std::vector<double>& value) {
 void RowSum::mapper() {
   std::vector<double> row;
   first_row();
-  while (!feof(in_.get_stream())) {
+  while (!in_.eof()) {
     int key = -1;
     if (!read_key_val_pair(&key, row)) {
-      if (feof(in_.get_stream())) {
+      if (in_.eof()) {
 	break;
       } else {
 	hadoop_error("invalid key: row %i\n", num_total_rows_);
@@ -84,7 +151,6 @@ void RowSum::first_row() {
   num_cols_ = row.size();
   rows_.resize(num_cols_);
   used_.resize(num_cols_);
-  assert(row_index < (int) num_cols_);
   for (int i = 0; i < (int) num_cols_; ++i) {
     rows_[i] = (double *) calloc(num_cols_, sizeof(double));
     used_[i] = false;
@@ -95,10 +161,16 @@ void RowSum::first_row() {
     
 void RowSum::collect_int_key(int key, std::vector<double>& value) {
   assert(value.size() == num_cols_);
-  assert((size_t) key < num_cols_);
+  assert(key >= 0);
+  // the rows of a non-square sum, such as the W of Householder QR
+  while ((size_t) key >= rows_.size()) {
+    rows_.push_back((double *) calloc(num_cols_, sizeof(double)));
+    used_.push_back(false);
+  }
   used_[key] = true;
   double t0 = sf_time();
-  lapack_daxpy(num_cols_, rows_[key], &value[0]);
+  // rows_[key] += value
+  lapack_daxpy(num_cols_, &value[0], rows_[key]);
   incr_lapack_time(sf_time() - t0);
 }
 
@@ -107,36 +179,110 @@ void RowSum::output() {
     if (!used_[i])
       continue;
     out_.write_int(i);
-    out_.write_list_start();
-    for (size_t j = 0; j < num_cols_; ++j)
-      out_.write_double(rows_[i][j]);
-    out_.write_list_end();
+    out_.write_double_list(rows_[i], num_cols_);
   }
 }
 
-void Cholesky::output() {
+void Cholesky::factor(std::vector<double>& L) {
   // all data needs to be on this task
   for (size_t i = 0; i < used_.size(); ++i)
     assert(used_[i]);
-  double *mat = (double *) malloc(num_cols_ * num_cols_ * sizeof(double));
-  assert(mat);
+  L.resize(num_cols_ * num_cols_);
 
+  // row i holds the upper triangle of row i of A^T A, which is column i
+  // of the lower triangle
   for (size_t i = 0; i < num_cols_; ++i) {
     double *curr_row = rows_[i];
     for (size_t j = 0; j < num_cols_; ++j)
-      mat[i * num_cols_ + j] = curr_row[j];
+      L[i * num_cols_ + j] = curr_row[j];
   }
 
   // call Cholesky once
   double t0 = sf_time();
-  lapack_chol(mat, (int) num_cols_);
+  lapack_chol(&L[0], (int) num_cols_);
   incr_lapack_time(sf_time() - t0);
 
+  // clear the upper triangle, which dpotrf leaves alone
+  for (size_t i = 0; i < num_cols_; ++i) {
+    for (size_t j = 0; j < i; ++j)
+      L[i * num_cols_ + j] = 0.0;
+  }
+}
+
+void Cholesky::output() {
+  std::vector<double> L;
+  factor(L);
+  // row i of R is column i of L
   for (size_t i = 0; i < num_cols_; ++i) {
     out_.write_int(i);
-    out_.write_list_start();
-    for (size_t j = 0; j < num_cols_; ++j)
-      out_.write_double(j <=i ? mat[i * num_cols_ + j] : 0.0);
-    out_.write_list_end();
+    out_.write_double_list(&L[i * num_cols_], num_cols_);
+  }
+}
+
+void CholQR2Map::transform_rows(double *A, size_t lda, size_t urows,
+                                bool row_major) {
+  if (urows == 0) {
+    return;
+  }
+  if (R1_.size() != num_cols_ * num_cols_) {
+    hadoop_error("R1 is %zu entries, expected %zu columns\n", R1_.size(),
+                 num_cols_);
+  }
+  double t0 = sf_time();
+  if (row_major) {
+    lapack_row_major_trsm(A, urows, num_cols_, &R1_[0]);
+  } else {
+    lapack_trsm(A, lda, urows, num_cols_, &R1_[0]);
+  }
+  incr_lapack_time(sf_time() - t0);
+}
+
+void CholQR2Reduce::output() {
+  if (R1_.size() != num_cols_ * num_cols_) {
+    hadoop_error("R1 is %zu entries, expected %zu columns\n", R1_.size(),
+                 num_cols_);
   }
+  std::vector<double> L;
+  factor(L);
+  // R = R2 R1 = L^T R1
+  std::vector<double> R(R1_);
+  double t0 = sf_time();
+  lapack_chol_mult(&L[0], &R[0], num_cols_);
+  incr_lapack_time(sf_time() - t0);
+  for (size_t i = 0; i < num_cols_; ++i) {
+    out_.write_int(i);
+    out_.write_double_list(&R[i], num_cols_, num_cols_);
+  }
+}
+
+bool read_text_matrix(const std::string& path, size_t num_rows,
+                      size_t num_cols, std::vector<double>& A) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f) {
+    return false;
+  }
+  A.assign(num_rows * num_cols, 0.0);
+  char b[262144];
+  std::string key;
+  std::vector<double> row;
+  while (fgets(b, sizeof(b), f)) {
+    char *buf = b;
+    parse_text_dump_key(buf, key);
+    size_t i = atoi(key.c_str());
+    row.clear();
+    parse_text_dump_values(buf, row);
+    if (i >= num_rows || row.size() != num_cols) {
+      hadoop_error("invalid row %s of %s\n", key.c_str(), path.c_str());
+    }
+    for (size_t j = 0; j < num_cols; ++j) {
+      A[i + j * num_rows] = row[j];
+    }
+  }
+  fclose(f);
+  return true;
+}
+
+bool read_text_R(const std::string& path, size_t num_cols,
+                 std::vector<double>& R) {
+  return read_text_matrix(path, num_cols, num_cols, R);
 }
@@ -7,11 +7,46 @@
    http://opensource.org/licenses/BSD-2-Clause
 */
 
+#include <algorithm>
+#include <memory>
+#include <thread>
 #include <vector>
 
 #include "mrmc.h"
+#include "sparfun_util.h"
+#include "tsqr_util.h"
 #include "typedbytes.h"
 
+double *BlockRing::next_free() {
+  size_t head = head_.load(std::memory_order_relaxed);
+  while (head - tail_.load(std::memory_order_acquire) == blocks_.size()) {
+    std::this_thread::yield();
+  }
+  return &blocks_[head % blocks_.size()][0];
+}
+
+void BlockRing::push(size_t nrows) {
+  size_t head = head_.load(std::memory_order_relaxed);
+  block_rows_[head % blocks_.size()] = nrows;
+  head_.store(head + 1, std::memory_order_release);
+}
+
+double *BlockRing::next_full(size_t *nrows) {
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  while (head_.load(std::memory_order_acquire) == tail) {
+    if (done_.load(std::memory_order_acquire)) {
+      // check again, the last block may have been pushed before done_
+      if (head_.load(std::memory_order_acquire) == tail) {
+        return NULL;
+      }
+      break;
+    }
+    std::this_thread::yield();
+  }
+  *nrows = block_rows_[tail % blocks_.size()];
+  return &blocks_[tail % blocks_.size()][0];
+}
+
 void MatrixHandler::read_full_row(std::vector<double>& row) {
   row.clear();
   TypedBytesType code = in_.next_type();
@@ -60,6 +95,83 @@ void MatrixHandler::read_full_row(std::vector<double>& row) {
   }
 }
 
+void MatrixHandler::read_row(double *dst, size_t stride) {
+  size_t ncols = 0;
+  TypedBytesType code = in_.next_type();
+  typedbytes_length len;
+  TypedBytesType nexttype;
+  switch (code) {
+  case TypedBytesVector:
+    len = in_.read_typedbytes_sequence_length();
+    if ((size_t) len != num_cols_) {
+      hadoop_error("row %zi has %i columns, expected %zi\n",
+                   num_total_rows_, len, num_cols_);
+    }
+    while (ncols < num_cols_) {
+      ncols += in_.read_double_run(dst + ncols * stride, stride,
+                                   num_cols_ - ncols);
+      if (ncols == num_cols_) {
+        break;
+      }
+      nexttype = in_.next_type();
+      if (!in_.can_be_double(nexttype)) {
+        hadoop_error("row %zi, col %zi has a non-double-convertable type\n",
+                     num_total_rows_, ncols);
+      }
+      dst[ncols * stride] = in_.convert_double();
+      ++ncols;
+    }
+    break;
+  case TypedBytesList:
+    while (true) {
+      ncols += in_.read_double_run(dst + ncols * stride, stride,
+                                   num_cols_ - ncols);
+      nexttype = in_.next_type();
+      if (nexttype == TypedBytesListEnd) {
+        break;
+      }
+      if (ncols == num_cols_) {
+        hadoop_error("row %zi has more than %zi columns\n",
+                     num_total_rows_, num_cols_);
+      }
+      if (!in_.can_be_double(nexttype)) {
+        hadoop_error("row %zi, col %zi has a non-double-convertable type\n",
+                     num_total_rows_, ncols);
+      }
+      dst[ncols * stride] = in_.convert_double();
+      ++ncols;
+    }
+    if (ncols != num_cols_) {
+      hadoop_error("row %zi has %zi columns, expected %zi\n",
+                   num_total_rows_, ncols, num_cols_);
+    }
+    break;
+  case TypedBytesByteSequence:
+  case TypedBytesString:
+    if (code == TypedBytesString) {
+      len = in_.read_string_length();
+    } else {
+      len = in_.read_byte_sequence_length();
+    }
+    if ((size_t) len != num_cols_ * sizeof(double)) {
+      hadoop_error("row %zi has %i bytes, expected %zi\n",
+                   num_total_rows_, len, num_cols_ * sizeof(double));
+    }
+    in_.read_data_doubles(dst, num_cols_, stride);
+    break;
+  default:
+    hadoop_error("row %zi is an unknown type (code is: %d)\n",
+		 num_total_rows_, code);
+  }
+}
+
+void MatrixHandler::read_local_row() {
+  assert(num_local_rows_ < num_rows_);
+  read_row(&local_matrix_[num_local_rows_], num_rows_);
+  ++num_local_rows_;
+  ++num_total_rows_;
+}
+
 bool MatrixHandler::read_key_val_pair(typedbytes_opaque& key,
 				      std::vector<double>& value) {
   if (!in_.read_opaque(key)) {
@@ -72,10 +184,35 @@ bool MatrixHandler::read_key_val_pair(typedbytes_opaque& key,
 void MatrixHandler::mapper() {
   std::vector<double> row;
   first_row();
-  while (!feof(in_.get_stream())) {
-    typedbytes_opaque key;
+  kernels_ = small_kernels(num_cols_);
+  if (decode_in_place_ && rows_per_record_ == 1 && num_cols_ > 0 &&
+      (pipeline_depth_ >= 2 || num_threads_ > 1) &&
+      num_rows_ > pipeline_reserved_rows()) {
+    pipelined_mapper();
+    return;
+  }
+  if (decode_in_place_ && rows_per_record_ == 1 && num_cols_ > 0) {
+    while (!in_.eof()) {
+      if (!in_.skip_next()) {
+	if (in_.eof()) {
+	  break;
+	} else {
+	  hadoop_error("invalid key: row %i\n", num_total_rows_);
+	}
+      }
+      read_local_row();
+      collect_local_row();
+    }
+    hadoop_status("final output");
+    output();
+    return;
+  }
+  // reuse the key storage across rows
+  typedbytes_opaque key;
+  while (!in_.eof()) {
+    key.clear();
     if (!read_key_val_pair(key, row)) {
-      if (feof(in_.get_stream())) {
+      if (in_.eof()) {
 	break;
       } else {
 	hadoop_error("invalid key: row %i\n", num_total_rows_);
@@ -87,6 +224,105 @@ void MatrixHandler::mapper() {
   output();
 }
     
+void MatrixHandler::pipelined_mapper() {
+  size_t reserved = pipeline_reserved_rows();
+  size_t block_rows = num_rows_ - reserved;
+  size_t num_threads = std::max(num_threads_, (size_t) 1);
+  size_t depth = std::max(pipeline_depth_, (size_t) 2);
+  // one ring per compute thread, so that each stays single-consumer
+  std::vector<std::unique_ptr<BlockRing>> rings;
+  std::vector<std::thread> compute;
+  for (size_t t = 0; t < num_threads; ++t) {
+    rings.emplace_back(new BlockRing(depth, num_rows_ * num_cols_));
+    BlockRing *ring = rings.back().get();
+    compute.emplace_back([this, ring, t]() {
+        size_t nrows;
+        double *block;
+        while ((block = ring->next_full(&nrows)) != NULL) {
+          compress_block(block, nrows, t);
+          ring->pop();
+        }
+      });
+  }
+
+  size_t num_blocks = 0;
+  double *block = rings[0]->next_free();
+  size_t nrows = 0;
+  while (!in_.eof()) {
+    if (!in_.skip_next()) {
+      if (in_.eof()) {
+	break;
+      } else {
+	hadoop_error("invalid key: row %i\n", num_total_rows_);
+      }
+    }
+    read_row(block + reserved + nrows, num_rows_);
+    ++num_total_rows_;
+    if (++nrows == block_rows) {
+      rings[num_blocks % num_threads]->push(nrows);
+      ++num_blocks;
+      block = rings[num_blocks % num_threads]->next_free();
+      nrows = 0;
+    }
+  }
+  if (nrows > 0) {
+    rings[num_blocks % num_threads]->push(nrows);
+  }
+  for (size_t t = 0; t < num_threads; ++t) {
+    rings[t]->finish();
+    compute[t].join();
+  }
+  hadoop_status("final output");
+  output();
+}
+
+void MatrixHandler::file_mapper(const MatrixFile& file) {
+  if (!decode_in_place_) {
+    hadoop_error("this method does not read matrix files\n");
+  }
+  size_t total_rows = file.num_rows();
+  if (total_rows == 0 || file.num_cols() == 0) {
+    hadoop_message("no data in the matrix file\n");
+    output();
+    return;
+  }
+  num_cols_ = file.num_cols();
+  hadoop_message("matrix size: %zi x %zi, up to %zi localrows\n",
+                 total_rows, num_cols_, blocksize_ * num_cols_);
+  alloc(blocksize_ * num_cols_, num_cols_);
+  kernels_ = small_kernels(num_cols_);
+  size_t reserved = pipeline_reserved_rows();
+  if (num_rows_ <= reserved) {
+    hadoop_error("blocksize %zi is too small\n", blocksize_);
+  }
+  size_t block_rows = num_rows_ - reserved;
+  size_t num_blocks = (total_rows + block_rows - 1) / block_rows;
+  size_t num_threads = std::max(num_threads_, (size_t) 1);
+  // Each thread copies its own blocks, so the copies run in parallel
+  // too.  Blocks are dealt out to the threads in turn.
+  auto compute = [this, &file, reserved, block_rows, num_blocks, total_rows,
+                  num_threads](size_t t) {
+    std::vector<double> block(num_rows_ * num_cols_);
+    for (size_t b = t; b < num_blocks; b += num_threads) {
+      size_t first = b * block_rows;
+      size_t nrows = std::min(block_rows, total_rows - first);
+      file.read_block(first, nrows, &block[reserved], num_rows_);
+      compress_block(&block[0], nrows, t);
+    }
+  };
+  std::vector<std::thread> threads;
+  for (size_t t = 1; t < num_threads; ++t) {
+    threads.emplace_back(compute, t);
+  }
+  compute(0);
+  for (size_t t = 0; t < threads.size(); ++t) {
+    threads[t].join();
+  }
+  num_total_rows_ = total_rows;
+  hadoop_status("final output");
+  output();
+}
+
 // Allocate the local matrix and set to zero
 void MatrixHandler::alloc(size_t num_rows, size_t num_cols) {
   local_matrix_.resize(num_rows * num_cols);
@@ -132,3 +368,87 @@ void MatrixHandler::add_row(const std::vector<double>& row) {
     ++num_total_rows_;
   }
 }
+
+// Write the key (file, i) for a job with several output files.
+void MatrixHandler::write_file_key(const std::string& file, int i) {
+  out_.write_list_start();
+  out_.write_string_stl(file);
+  out_.write_int(i);
+  out_.write_list_end();
+}
+
+void MatrixHandler::write_file_key(const std::string& file,
+                                   const std::string& key) {
+  out_.write_list_start();
+  out_.write_string_stl(file);
+  out_.write_string_stl(key);
+  out_.write_list_end();
+}
+
+void MatrixHandler::write_key(const unsigned char *key, size_t size) {
+  unsigned char code = size > 0 ? key[0] : TypedBytesTypeError;
+  unsigned char *bytes = const_cast<unsigned char *>(key);
+  if (code == TypedBytesString) {
+    out_.write_string((const char *) key + 1, size - 1);
+  } else if (code == TypedBytesByteSequence) {
+    out_.write_byte_sequence(bytes + 1, size - 1);
+  } else if (code >= TypedBytesByte && code <= TypedBytesDouble) {
+    // the primitives are stored as read
+    out_.write_opaque_type(bytes, size);
+  } else {
+    // as direct TSQR does with its keys
+    out_.write_byte_sequence(bytes, size);
+  }
+}
+
+void MatrixHandler::output_svd(double *R) {
+  size_t n = num_cols_;
+  std::vector<double> S(n), U(n * n), Vt(n * n);
+  double t0 = sf_time();
+  if (!lapack_svd(R, n, &S[0], &U[0], &Vt[0], lapack_)) {
+    hadoop_error("lapack error\n");
+  }
+  incr_lapack_time(sf_time() - t0);
+
+  for (size_t i = 0; i < n; ++i) {
+    write_file_key("U", (int) i);
+    out_.write_double_list(&U[i], n, n);
+  }
+  for (size_t i = 0; i < n; ++i) {
+    write_file_key("Sigma", (int) i);
+    out_.write_double_list(&S[i], 1);
+  }
+  // row i of V is column i of V^T
+  for (size_t i = 0; i < n; ++i) {
+    write_file_key("V", (int) i);
+    out_.write_double_list(&Vt[i * n], n);
+  }
+}
+
+void MatrixFileWriter::first_row() {
+  typedbytes_opaque key;
+  std::vector<double> row;
+  if (read_key_val_pair(key, row)) {
+    num_cols_ = row.size();
+    collect(key, row);
+  }
+}
+
+void MatrixFileWriter::collect(typedbytes_opaque& key,
+                               std::vector<double>& value) {
+  if (value.size() != num_cols_) {
+    hadoop_error("row %zi has %zi columns, expected %zi\n", num_total_rows_,
+                 value.size(), num_cols_);
+  }
+  rows_.insert(rows_.end(), value.begin(), value.end());
+  ++num_total_rows_;
+}
+
+void MatrixFileWriter::output() {
+  hadoop_message("writing %zi x %zi to %s\n", num_total_rows_, num_cols_,
+                 path_.c_str());
+  if (!write_matrix_file(path_, rows_.empty() ? NULL : &rows_[0],
+                         num_total_rows_, num_cols_, layout_)) {
+    hadoop_error("could not write %s\n", path_.c_str());
+  }
+}
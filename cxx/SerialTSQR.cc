@@ -7,23 +7,53 @@
    http://opensource.org/licenses/BSD-2-Clause
 */
 
+#include <assert.h>
+#include <float.h>
+#include <math.h>
+
+#include <algorithm>
+#include <vector>
+
 #include "mrmc.h"
 #include "sparfun_util.h"
 #include "tsqr_util.h"
 
 void SerialTSQR::collect(typedbytes_opaque& key, std::vector<double>& value) {
   add_row(value);
+  collect_local_row();
+}
+
+void SerialTSQR::collect_local_row() {
   if (num_local_rows_ >= num_rows_) {
     compress();
     hadoop_counter("compressions", 1);
   }
 }
 
+void SerialTSQR::transform_new_rows() {
+  if (num_local_rows_ > first_new_row_) {
+    transform_rows(&local_matrix_[first_new_row_], num_rows_,
+                   num_local_rows_ - first_new_row_);
+  }
+  first_new_row_ = num_local_rows_;
+}
+
 // compress the local QR factorization
 void SerialTSQR::compress() {
+  transform_new_rows();
   // compute a QR factorization
   double t0 = sf_time();
-  if (lapack_qr(&local_matrix_[0], num_rows_, num_cols_, num_local_rows_)) {
+  bool success;
+  if (R_on_top_ && num_local_rows_ > num_cols_) {
+    // The top rows are already R, so only the new rows need to be
+    // eliminated against it.
+    success = tpqr(&local_matrix_[0], num_rows_, &local_matrix_[num_cols_],
+                   num_rows_, num_local_rows_ - num_cols_, 0, lapack_);
+  } else {
+    success = lapack_qr(&local_matrix_[0], num_rows_, num_cols_,
+                        num_local_rows_, lapack_);
+  }
+  if (success) {
     double dt = sf_time() - t0;
     hadoop_counter("lapack time (millisecs)", (int) (dt * 1000.));
   } else {
@@ -32,6 +62,127 @@ void SerialTSQR::compress() {
   if (num_cols_ < num_local_rows_) {
     num_local_rows_ = num_cols_;
   }
+  R_on_top_ = num_local_rows_ == num_cols_;
+  first_new_row_ = num_local_rows_;
+}
+
+bool SerialTSQR::tpqr(double *R, size_t ldr, double *B, size_t ldb,
+                      size_t urows, size_t ltri, LapackContext& ctx) {
+  if (kernels_ != NULL && kernels_->tpqr != NULL) {
+    kernels_->tpqr(R, ldr, B, ldb, urows, ltri);
+    return true;
+  }
+  return lapack_tpqr(R, ldr, B, ldb, num_cols_, urows, ltri, ctx);
+}
+
+void SerialTSQR::alloc(size_t num_rows, size_t num_cols) {
+  MatrixHandler::alloc(num_rows, num_cols);
+  size_t num_threads = std::max(num_threads_, (size_t) 1);
+  thread_R_.assign(num_threads, std::vector<double>(num_cols * num_cols));
+  thread_R_rows_.assign(num_threads, 0);
+  thread_lapack_.resize(num_threads);
+}
+
+void SerialTSQR::compress_block(double *block, size_t nrows, size_t thread) {
+  std::vector<double>& R = thread_R_[thread];
+  size_t R_rows = thread_R_rows_[thread];
+  assert(R_rows <= num_cols_);
+  transform_rows(block + num_cols_, num_rows_, nrows);
+  double t0 = sf_time();
+  if (R_rows == num_cols_) {
+    // update R in place with the new rows, which start at row num_cols_
+    // of block
+    if (!tpqr(&R[0], num_cols_, block + num_cols_, num_rows_, nrows, 0,
+              thread_lapack_[thread])) {
+      hadoop_error("lapack error\n");
+    }
+    incr_lapack_time(sf_time() - t0);
+    hadoop_counter("compressions", 1);
+    return;
+  }
+
+  // Copy this thread's R (fewer than num_cols_ rows) right above the
+  // new rows.
+  size_t offset = num_cols_ - R_rows;
+  for (size_t j = 0; j < num_cols_; ++j) {
+    for (size_t i = 0; i < R_rows; ++i) {
+      block[offset + i + j * num_rows_] = R[i + j * num_cols_];
+    }
+  }
+  size_t urows = R_rows + nrows;
+  if (lapack_qr(block + offset, num_rows_, num_cols_, urows,
+                thread_lapack_[thread])) {
+    incr_lapack_time(sf_time() - t0);
+  } else {
+    hadoop_error("lapack error\n");
+  }
+  // keep the new R
+  R_rows = std::min(urows, num_cols_);
+  for (size_t j = 0; j < num_cols_; ++j) {
+    for (size_t i = 0; i < R_rows; ++i) {
+      R[i + j * num_cols_] = block[offset + i + j * num_rows_];
+    }
+  }
+  thread_R_rows_[thread] = R_rows;
+  hadoop_counter("compressions", 1);
+}
+
+void SerialTSQR::merge_thread_R() {
+  std::vector<double> stacked(2 * num_cols_ * num_cols_);
+  size_t ld = 2 * num_cols_;
+  for (size_t step = 1; step < thread_R_.size(); step *= 2) {
+    for (size_t t = 0; t + step < thread_R_.size(); t += 2 * step) {
+      // factor [R_t; R_(t + step)] into R_t
+      size_t top = thread_R_rows_[t];
+      size_t bottom = thread_R_rows_[t + step];
+      if (bottom == 0) {
+        continue;
+      }
+      if (top == num_cols_ && bottom == num_cols_) {
+        // both are triangular
+        if (!tpqr(&thread_R_[t][0], num_cols_, &thread_R_[t + step][0],
+                  num_cols_, num_cols_, num_cols_, lapack_)) {
+          hadoop_error("lapack error\n");
+        }
+        continue;
+      }
+      for (size_t j = 0; j < num_cols_; ++j) {
+        for (size_t i = 0; i < top; ++i) {
+          stacked[i + j * ld] = thread_R_[t][i + j * num_cols_];
+        }
+        for (size_t i = 0; i < bottom; ++i) {
+          stacked[top + i + j * ld] = thread_R_[t + step][i + j * num_cols_];
+        }
+      }
+      size_t urows = top + bottom;
+      if (!lapack_qr(&stacked[0], ld, num_cols_, urows, lapack_)) {
+        hadoop_error("lapack error\n");
+      }
+      thread_R_rows_[t] = std::min(urows, num_cols_);
+      for (size_t j = 0; j < num_cols_; ++j) {
+        for (size_t i = 0; i < thread_R_rows_[t]; ++i) {
+          thread_R_[t][i + j * num_cols_] = stacked[i + j * ld];
+        }
+      }
+    }
+  }
+}
+
+void SerialTSQR::compress_all() {
+  // Stack the compute threads' R under the rows left in local_matrix_
+  // (only the first row in pipelined mode).
+  merge_thread_R();
+  transform_new_rows();
+  assert(num_local_rows_ + thread_R_rows_[0] <= num_rows_);
+  for (size_t j = 0; j < num_cols_; ++j) {
+    for (size_t i = 0; i < thread_R_rows_[0]; ++i) {
+      local_matrix_[num_local_rows_ + i + j * num_rows_] =
+        thread_R_[0][i + j * num_cols_];
+    }
+  }
+  num_local_rows_ += thread_R_rows_[0];
+  first_new_row_ = num_local_rows_;
+  compress();
 }
 
 // Output the matrix with random keys for the rows.
@@ -40,14 +191,91 @@ void SerialTSQR::output() {
     // no data was received on this task
     return;
   }
-  compress();
+  compress_all();
   for (size_t i = 0; i < num_local_rows_; ++i) {
     int rand_int = sf_randint(0, 2000000000);
     out_.write_int(rand_int);
-    out_.write_list_start();
-    for (size_t j = 0; j < num_cols_; ++j) {
-      out_.write_double(local_matrix_[i + j * num_rows_]);
+    out_.write_double_list(&local_matrix_[i], num_cols_, num_rows_);
+  }
+}
+
+void SerialSVD::output() {
+  if (num_cols_ == 0) {
+    // no data was received on this task
+    return;
+  }
+  compress_all();
+  // R has fewer rows than columns if there were few rows in total
+  std::vector<double> R(num_cols_ * num_cols_, 0.);
+  for (size_t j = 0; j < num_cols_; ++j) {
+    for (size_t i = 0; i < std::min(num_local_rows_, j + 1); ++i) {
+      R[i + j * num_cols_] = local_matrix_[i + j * num_rows_];
+    }
+  }
+  output_svd(&R[0]);
+}
+
+void SerialLstSq::output() {
+  if (num_cols_ == 0) {
+    // no data was received on this task
+    return;
+  }
+  if (nrhs_ == 0 || nrhs_ >= num_cols_) {
+    hadoop_error("%zu right-hand sides for %zu columns\n", nrhs_, num_cols_);
+  }
+  compress_all();
+  size_t n = num_cols_ - nrhs_;
+  if (num_local_rows_ < n) {
+    hadoop_error("%zu rows for %zu unknowns\n", num_local_rows_, n);
+  }
+  // a diagonal entry of R at rounding level relative to the largest one
+  // means A is rank deficient to working precision
+  double max_diag = 0.0;
+  for (size_t i = 0; i < n; ++i) {
+    max_diag = std::max(max_diag, fabs(local_matrix_[i + i * num_rows_]));
+  }
+  for (size_t i = 0; i < n; ++i) {
+    double d = fabs(local_matrix_[i + i * num_rows_]);
+    if (d == 0.0 || d <= n * DBL_EPSILON * max_diag) {
+      hadoop_error("A is rank deficient: R(%zu, %zu) is %g\n", i, i, d);
     }
-    out_.write_list_end();
   }
+  // the norm of column j of S is the residual norm of right-hand side j
+  std::vector<double> residual(nrhs_, 0.0);
+  for (size_t j = 0; j < nrhs_; ++j) {
+    const double *col = &local_matrix_[(n + j) * num_rows_];
+    for (size_t i = n; i < std::min(num_local_rows_, n + j + 1); ++i) {
+      residual[j] += col[i] * col[i];
+    }
+    residual[j] = sqrt(residual[j]);
+  }
+  // X = R^{-1} Q^T B, in place of Q^T B
+  double *X = &local_matrix_[n * num_rows_];
+  double t0 = sf_time();
+  lapack_tri_solve(&local_matrix_[0], num_rows_, n, X, num_rows_, nrhs_);
+  incr_lapack_time(sf_time() - t0);
+  for (size_t i = 0; i < n; ++i) {
+    write_file_key("X", (int) i);
+    out_.write_double_list(&X[i], nrhs_, num_rows_);
+  }
+  write_file_key("residual", 0);
+  out_.write_double_list(&residual[0], nrhs_);
+}
+
+void PremultTSQR::transform_rows(double *A, size_t lda, size_t urows) {
+  if (urows == 0) {
+    return;
+  }
+  if (R1_.size() != num_cols_ * num_cols_) {
+    hadoop_error("R1 is %zu entries, expected %zu columns\n", R1_.size(),
+                 num_cols_);
+  }
+  for (size_t i = 0; i < num_cols_; ++i) {
+    if (R1_[i + i * num_cols_] == 0.0) {
+      hadoop_error("R is singular: zero at diagonal entry %zu\n", i);
+    }
+  }
+  double t0 = sf_time();
+  lapack_trsm(A, lda, urows, num_cols_, &R1_[0]);
+  incr_lapack_time(sf_time() - t0);
 }
@@ -0,0 +1,197 @@
+/**
+   Copyright (c) 2012-2014, Austin Benson and David Gleich
+   All rights reserved.
+
+   This file is part of MRTSQR and is under the BSD 2-Clause License,
+   which can be found in the LICENSE file in the root directory, or at
+   http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "mrmc.h"
+#include "sparfun_util.h"
+#include "tsqr_util.h"
+#include "typedbytes.h"
+
+void BtAMap::mapper() {
+  // Hadoop streaming puts the input file of the map task in the
+  // environment (the name changed in later versions).
+  const char *path = getenv("mapreduce_map_input_file");
+  if (path == NULL) {
+    path = getenv("map_input_file");
+  }
+  if (path == NULL) {
+    hadoop_error("no map input file in the environment\n");
+  }
+  bool is_B = std::string(path).find(B_id_) != std::string::npos;
+  const char *tag = is_B ? "B" : "A";
+  hadoop_message("%s is %s\n", path, tag);
+
+  typedbytes_opaque key;
+  std::vector<double> row;
+  while (!in_.eof()) {
+    key.clear();
+    if (!read_key_val_pair(key, row)) {
+      if (in_.eof()) {
+        break;
+      } else {
+        hadoop_error("invalid key: row %i\n", num_total_rows_);
+      }
+    }
+    // the value is the (tag, row) pair of dumbo's BtAMapper
+    write_key(key.empty() ? NULL : &key[0], key.size());
+    out_.write_vector_start(2);
+    out_.write_string(tag, 1);
+    out_.write_byte_sequence(row.empty() ? NULL : (unsigned char *) &row[0],
+                             row.size() * sizeof(double));
+    ++num_total_rows_;
+  }
+  hadoop_counter(is_B ? "B values" : "A values", num_total_rows_);
+}
+
+bool BtAReduce::read_tagged_row(std::vector<double>& row) {
+  TypedBytesType code = in_.next_type();
+  if (code == TypedBytesVector) {
+    if (in_.read_typedbytes_sequence_length() != 2) {
+      hadoop_error("row %zi is not a (tag, row) pair\n", num_total_rows_);
+    }
+  } else if (code != TypedBytesList) {
+    hadoop_error("row %zi is not a (tag, row) pair\n", num_total_rows_);
+  }
+  std::string tag;
+  if (in_.next_type() != TypedBytesString || !in_.read_string(tag) ||
+      (tag != "A" && tag != "B")) {
+    hadoop_error("row %zi has an invalid tag\n", num_total_rows_);
+  }
+  read_full_row(row);
+  if (code == TypedBytesList && in_.next_type() != TypedBytesListEnd) {
+    hadoop_error("row %zi is not a (tag, row) pair\n", num_total_rows_);
+  }
+  ++num_total_rows_;
+  return tag == "B";
+}
+
+void BtAReduce::add_row(std::vector<double>& block, size_t& nrows,
+                        size_t& ncols, const std::vector<double>& row) {
+  if (num_rows_ == 0) {
+    num_rows_ = blocksize_ * row.size();
+    hadoop_message("up to %zi rows per block\n", num_rows_);
+  }
+  if (ncols == 0) {
+    ncols = row.size();
+    block.resize(num_rows_ * ncols);
+  }
+  if (row.size() != ncols || ncols == 0) {
+    hadoop_error("row %zi has %zi columns, expected %zi\n",
+                 num_total_rows_, row.size(), ncols);
+  }
+  if (nrows == num_rows_) {
+    if (key_first_row_ == 0) {
+      // only when more than a block of rows share a key
+      hadoop_error("more than %zi rows with the same key\n", num_rows_);
+    }
+    // make room for the rest of the key
+    compress_earlier_keys();
+  }
+  for (size_t j = 0; j < ncols; ++j) {
+    block[nrows + j * num_rows_] = row[j];
+  }
+  ++nrows;
+}
+
+void BtAReduce::multiply(size_t urows) {
+  if (urows == 0) {
+    return;
+  }
+  if (BtA_.empty()) {
+    BtA_.assign(num_B_cols_ * num_cols_, 0.0);
+  }
+  double t0 = sf_time();
+  lapack_gemm(true, false, num_B_cols_, num_cols_, urows, 1.0,
+              &B_block_[0], num_rows_, &local_matrix_[0], num_rows_, 1.0,
+              &BtA_[0], num_B_cols_);
+  incr_lapack_time(sf_time() - t0);
+  hadoop_counter("BtA compressions", 1);
+}
+
+void BtAReduce::compress() {
+  assert(num_local_rows_ == num_B_rows_);
+  multiply(num_local_rows_);
+  num_local_rows_ = 0;
+  num_B_rows_ = 0;
+  key_first_row_ = 0;
+}
+
+// Move rows first, ..., nrows - 1 of the column-major block to the top.
+static void shift_rows(std::vector<double>& block, size_t ld, size_t ncols,
+                       size_t first, size_t& nrows) {
+  for (size_t j = 0; j < ncols; ++j) {
+    double *col = &block[j * ld];
+    memmove(col, col + first, (nrows - first) * sizeof(double));
+  }
+  nrows -= first;
+}
+
+void BtAReduce::compress_earlier_keys() {
+  multiply(key_first_row_);
+  shift_rows(local_matrix_, num_rows_, num_cols_, key_first_row_,
+             num_local_rows_);
+  shift_rows(B_block_, num_rows_, num_B_cols_, key_first_row_, num_B_rows_);
+  key_first_row_ = 0;
+}
+
+void BtAReduce::mapper() {
+  typedbytes_opaque key, last_key;
+  std::vector<double> row;
+  bool first = true;
+  while (true) {
+    key.clear();
+    bool more = in_.read_opaque(key);
+    if (!more && !in_.eof()) {
+      hadoop_error("invalid key: row %i\n", num_total_rows_);
+    }
+    if (!first && (!more || key != last_key)) {
+      // the end of a key: its rows of A and B must pair up
+      if (num_local_rows_ != num_B_rows_) {
+        hadoop_error("%zi rows of A and %zi rows of B for a key\n",
+                     num_local_rows_, num_B_rows_);
+      }
+      if (num_local_rows_ == num_rows_) {
+        compress();
+      }
+      key_first_row_ = num_local_rows_;
+    }
+    if (!more) {
+      break;
+    }
+    if (first || key != last_key) {
+      last_key.swap(key);
+      first = false;
+    }
+    if (read_tagged_row(row)) {
+      add_row(B_block_, num_B_rows_, num_B_cols_, row);
+    } else {
+      add_row(local_matrix_, num_local_rows_, num_cols_, row);
+    }
+  }
+  hadoop_counter("rows processed", num_total_rows_);
+  output();
+}
+
+void BtAReduce::output() {
+  compress();
+  if (BtA_.empty()) {
+    // no rows of A and B were joined on this task
+    return;
+  }
+  for (size_t i = 0; i < num_B_cols_; ++i) {
+    out_.write_int(i);
+    out_.write_double_list(&BtA_[i], num_cols_, num_B_cols_);
+  }
+}
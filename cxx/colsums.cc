@@ -141,9 +141,9 @@ public:
     void mapper() {
         std::vector<double> row;
         first_row(); // handle the first row
-        while (!feof(in.get_stream())) {
+        while (!in.eof()) {
             if (in.skip_next() == false) {
-                if (feof(in.get_stream())) {
+                if (in.eof()) {
                     break;
                 } else {
                     hadoop_message("invalid key: row %i\n", totalrows);
@@ -162,9 +162,9 @@ public:
         bool more_data = false;
         int cur_key = 0;
         double rval = 0.;
-        while (!feof(in.get_stream())) {
+        while (!in.eof()) {
             TypedBytesType keytype = in.next_type();
-            if (keytype == TypedBytesTypeError && feof(in.get_stream())) {
+            if (keytype == TypedBytesTypeError && in.eof()) {
                 // we are at the end of the file.
                 break;
             }
@@ -8,9 +8,16 @@
 */
 
 #include <assert.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <list>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "mrmc.h"
@@ -18,6 +25,16 @@
 #include "tsqr_util.h"
 #include "typedbytes.h"
 
+void KeyArena::push_back(const unsigned char *key, size_t size) {
+  char header[24];
+  int header_len = snprintf(header, sizeof(header), "%zu", size);
+  // keep the '\0' terminator as the separator
+  bytes_.insert(bytes_.end(), header, header + header_len + 1);
+  offsets_.push_back(bytes_.size());
+  sizes_.push_back(size);
+  bytes_.insert(bytes_.end(), key, key + size);
+}
+
 std::string DirTSQRMap1::pseudo_uuid() {
   char buf[32];
   snprintf(buf, sizeof(buf), "%x%x%x%x",
@@ -38,30 +55,56 @@ void DirTSQRMap1::first_row() {
   collect(key, row);
 }
 
+// Add the keys of rows 0, ..., nrows - 1 of a matrix file: the typed
+// bytes ints, or longs, of the row numbers.
+static void push_row_number_keys(KeyArena& keys, size_t nrows) {
+  unsigned char key[9];
+  for (size_t i = 0; i < nrows; ++i) {
+    uint64_t row = i;
+    size_t size = row <= 0x7fffffff ? 4 : 8;
+    key[0] = size == 4 ? TypedBytesInteger : TypedBytesLong;
+    for (size_t b = 0; b < size; ++b) {
+      key[size - b] = (unsigned char) (row >> (8 * b));
+    }
+    keys.push_back(key, size + 1);
+  }
+}
+
 void DirTSQRMap1::collect(typedbytes_opaque& key, std::vector<double>& value) {
-  keys_.push_back(key);
+  keys_.push_back(key.empty() ? NULL : &key[0], key.size());
   for (size_t i = 0; i < value.size(); ++i) {
     row_accumulator_.push_back(value[i]);
   }
   ++num_rows_;
 }
 
+void DirTSQRMap1::file_mapper(const MatrixFile& file) {
+  num_cols_ = file.num_cols();
+  num_rows_ = file.num_rows();
+  hadoop_message("matrix size: %zi x %zi\n", num_rows_, num_cols_);
+  if (num_rows_ == 0 || num_cols_ == 0) {
+    num_cols_ = 0;
+    return;
+  }
+  row_accumulator_.resize(num_rows_ * num_cols_);
+  file.read_rows(0, num_rows_, &row_accumulator_[0]);
+  push_row_number_keys(keys_, num_rows_);
+  hadoop_status("final output");
+  output();
+}
+
 void DirTSQRMap1::output() {
   // num_cols_ is 0 if the task did not receive any data
   if (num_cols_ == 0) {
     return;
   }
   // Storage for R
-  double *R_matrix = (double *) malloc(num_cols_ * num_cols_ * sizeof(double));
-  assert(R_matrix);
+  std::vector<double> R_matrix(num_cols_ * num_cols_);
   size_t num_rows = row_accumulator_.size() / num_cols_;
   hadoop_message("nrows: %d, ncols: %d\n", num_rows, num_cols_);
-  // lapack is column major, unfortunately
-  double *matrix_copy = (double *) malloc(num_rows * num_cols_ * sizeof(double));
-  assert(matrix_copy);
-  row_to_col_major(&row_accumulator_[0], matrix_copy, num_rows, num_cols_);
-  row_accumulator_.clear();
-  lapack_full_qr(matrix_copy, R_matrix, num_rows, num_cols_, num_rows);
+  // Factor the row-major rows in place, which leaves Q row-major too.
+  lapack_row_major_qr(&row_accumulator_[0], &R_matrix[0], num_rows, num_cols_,
+                      lapack_);
 
   // output R
   out_.write_list_start();
@@ -73,7 +116,7 @@ void DirTSQRMap1::output() {
   out_.write_list_end();
 
   hadoop_message("Output: R");
-  out_.write_byte_sequence((unsigned char *) R_matrix,
+  out_.write_byte_sequence((unsigned char *) &R_matrix[0],
 			   num_cols_ * num_cols_ * sizeof(double));
 
 
@@ -91,38 +134,13 @@ void DirTSQRMap1::output() {
   // start value write
   out_.write_list_start();
 
-  out_.write_byte_sequence((unsigned char *) matrix_copy,
+  out_.write_byte_sequence((unsigned char *) &row_accumulator_[0],
 			   num_rows * num_cols_ * sizeof(double));
 
+  // The keys are already stored in the serialized format.
   hadoop_message("Output: keys");
-  size_t total_key_size = 0;
-  for (std::list<typedbytes_opaque>::iterator it = keys_.begin();
-       it != keys_.end(); ++it) {
-    total_key_size += it->size();
-  }
-  // We also need to account for approximately the size to store the
-  // lengths.  We are basically trying to accomplish a Python pickling
-  // of this data.
-  total_key_size += 4 * keys_.size();
-  typedbytes_opaque key_holder;
-  key_holder.reserve(total_key_size);
-
   assert(keys_.size() == num_rows);
-  for (std::list<typedbytes_opaque>::iterator it = keys_.begin();
-       it != keys_.end(); ++it) {
-    typedbytes_opaque key = *it;
-    char buf[10];
-    snprintf(buf, sizeof(buf), "%zu", key.size());
-    for (size_t i = 0; i < strlen(buf); ++i) {
-      key_holder.push_back(buf[i]);
-    }
-    key_holder.push_back('\0');
-    for (size_t i = 0; i < key.size(); ++i) {
-      key_holder.push_back(key[i]);
-    }
-  }
-
-  out_.write_byte_sequence(&key_holder[0], key_holder.size());
+  out_.write_byte_sequence(keys_.data(), keys_.num_bytes());
 
   // end value write
   out_.write_list_end();
@@ -138,61 +156,174 @@ void DirTSQRReduce2::first_row() {
 }
 
 void DirTSQRReduce2::collect(typedbytes_opaque& key, std::vector<double>& value) {
-  keys_.push_back(key);
+  keys_.push_back(key.empty() ? NULL : &key[0], key.size());
   for (size_t i = 0; i < value.size(); ++i) {
     row_accumulator_.push_back(value[i]);
   }
   num_rows_ += num_cols_;
 }
 
+// Factor the stacked row-major R factors of nblocks mappers in place.
+// On return, R holds the row-major R and the stack holds the column-major
+// Q2 blocks.
+static void factor_R_stack(double *stack, size_t nblocks, size_t num_cols,
+                           double *R, LapackContext& ctx) {
+  size_t num_rows = nblocks * num_cols;
+  hadoop_message("nrows: %d, ncols: %d\n", num_rows, num_cols);
+
+  // The R factors are row-major, so the stack holds the stacked R
+  // factors in row-major order.  Factor them in place.
+  lapack_row_major_qr(stack, R, num_rows, num_cols, ctx);
+
+  // Block i of Q2 is rows i * ncols to (i + 1) * ncols - 1 of the
+  // row-major Q.  Store each block in column-major order.
+  size_t block_size = num_cols * num_cols;
+  for (size_t i = 0; i < nblocks; ++i) {
+    transpose_square(&stack[i * block_size], num_cols);
+  }
+}
+
+// Write the Q2 block of each key to the output file Q2.
+static void write_Q2_blocks(TypedBytesOutFile& out, const KeyArena& keys,
+                            const double *Q2, size_t num_cols) {
+  size_t ind = 0;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    // Specify output file
+    out.write_list_start();
+    out.write_string_stl("Q2");
+    // Specify actual key
+    out.write_string((const char *) keys.key(i), keys.key_size(i));
+    out.write_list_end();
+
+    // write value
+    out.write_double_list(&Q2[ind], num_cols * num_cols);
+    ind += num_cols * num_cols;
+  }
+}
+
 void DirTSQRReduce2::output() {
   // Storage for R
   double *R_matrix = (double *) malloc(num_cols_ * num_cols_ * sizeof(double));
   assert(R_matrix);
-  size_t num_rows = row_accumulator_.size() / num_cols_;
-  hadoop_message("nrows: %d, ncols: %d\n", num_rows, num_cols_);
-
-  lapack_full_qr(&row_accumulator_[0], R_matrix, num_rows, num_cols_, num_rows);
+  assert(keys_.size() * num_cols_ * num_cols_ == row_accumulator_.size());
+  factor_R_stack(&row_accumulator_[0], keys_.size(), num_cols_, R_matrix,
+                 lapack_);
 
   // output R
   for (size_t i = 0; i < num_cols_; ++i) {
-    out_.write_list_start();
-    // Specify output file
-    std::string output_file = "R_final";
-    out_.write_string_stl(output_file);
-    // Specify actual key
-    out_.write_int((int) i);
-    out_.write_list_end();
+    write_file_key("R_final", (int) i);
+    out_.write_double_list(&R_matrix[i * num_cols_], num_cols_);
+  }
 
-    // Write the value
-    out_.write_list_start();
-    for (size_t j = 0; j < num_cols_; ++j)
-      out_.write_double(R_matrix[j + i * num_cols_]);
-    out_.write_list_end();
+  if (svd_) {
+    // the row-major R is the column-major R^T
+    transpose_square(R_matrix, num_cols_);
+    output_svd(R_matrix);
+  }
+
+  free(R_matrix);
+
+  if (!Q2_path_.empty()) {
+    if (!write_Q2_file(Q2_path_, keys_, &row_accumulator_[0], num_cols_)) {
+      hadoop_error("could not write Q2 to %s\n", Q2_path_.c_str());
+    }
+    return;
   }
 
   // output Q
-  size_t ind = 0;
-  for (std::list<typedbytes_opaque>::iterator it = keys_.begin();
-       it != keys_.end(); ++it) {
-    // Specify output file
+  write_Q2_blocks(out_, keys_, &row_accumulator_[0], num_cols_);
+}
+
+std::string direct_tsqr_group(size_t level, const unsigned char *key,
+                              size_t size, size_t num_groups) {
+  // 64-bit FNV-1a, so that every task agrees on the groups
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ key[i]) * 1099511628211ULL;
+  }
+  char buf[64];
+  snprintf(buf, sizeof(buf), "L%zu_%llu", level,
+           (unsigned long long) (hash % num_groups));
+  return std::string(buf);
+}
+
+void DirTSQRGroupMap::mapper() {
+  typedbytes_opaque key;
+  std::vector<double> R;
+  while (true) {
+    key.clear();
+    if (!in_.read_opaque(key)) {
+      break;
+    }
+    read_full_row(R);
+    out_.write_string_stl(direct_tsqr_group(level_, &key[0], key.size(),
+                                            num_groups_));
     out_.write_list_start();
-    std::string output_file = "Q2";
-    out_.write_string_stl(output_file);
-    // Specify actual key
-    typedbytes_opaque tb_key = *it;
-    std::string key((const char *) &tb_key[0], tb_key.size());
-    out_.write_string_stl(key);
+    out_.write_byte_sequence(&key[0], key.size());
+    out_.write_byte_sequence((unsigned char *) &R[0],
+                             R.size() * sizeof(double));
     out_.write_list_end();
+  }
+}
 
-    // write value
-    out_.write_list_start();
-    for (size_t j = 0; j < num_cols_ * num_cols_; ++j) {
-      out_.write_double(row_accumulator_[ind]);
-      ++ind;
+void DirTSQRReduceLevel::mapper() {
+  std::string group;
+  typedbytes_opaque key;
+  std::vector<double> R;
+  while (!in_.eof()) {
+    if (in_.next_type() != TypedBytesString) {
+      break;
     }
-    out_.write_list_end();
+    std::string next_group;
+    in_.read_string(next_group);
+    if (next_group != group) {
+      output_group(group);
+      group = next_group;
+    }
+    // the value is the list (mapper key, R)
+    if (in_.next_type() != TypedBytesList ||
+        in_.next_type() != TypedBytesByteSequence) {
+      hadoop_error("expected a (key, R) list for group %s\n", group.c_str());
+    }
+    key.resize(in_.read_byte_sequence_length());
+    in_.read_byte_sequence(key.empty() ? NULL : &key[0], key.size());
+    read_full_row(R);
+    if (in_.next_type() != TypedBytesListEnd) {
+      hadoop_error("expected the end of the (key, R) list\n");
+    }
+    if (R.size() != num_cols_ * num_cols_) {
+      hadoop_error("R factor of size %zu, expected %zu\n", R.size(),
+                   num_cols_ * num_cols_);
+    }
+    keys_.push_back(key.empty() ? NULL : &key[0], key.size());
+    row_accumulator_.insert(row_accumulator_.end(), R.begin(), R.end());
   }
+  hadoop_status("final output");
+  output_group(group);
+}
+
+void DirTSQRReduceLevel::output_group(const std::string& group) {
+  if (keys_.size() == 0) {
+    return;
+  }
+  std::vector<double> R_matrix(num_cols_ * num_cols_);
+  double t0 = sf_time();
+  factor_R_stack(&row_accumulator_[0], keys_.size(), num_cols_, &R_matrix[0],
+                 lapack_);
+  incr_lapack_time(sf_time() - t0);
+  hadoop_counter("groups", 1);
+
+  // R for the next level, as DirTSQRMap1 emits it
+  out_.write_list_start();
+  out_.write_string_stl("R_" + group);
+  out_.write_string_stl(group);
+  out_.write_list_end();
+  out_.write_byte_sequence((unsigned char *) &R_matrix[0],
+                           num_cols_ * num_cols_ * sizeof(double));
+
+  write_Q2_blocks(out_, keys_, &row_accumulator_[0], num_cols_);
+  keys_.clear();
+  row_accumulator_.clear();
 }
 
 bool DirTSQRMap3::read_key_val_pair(typedbytes_opaque& key,
@@ -246,77 +377,293 @@ void DirTSQRMap3::collect(typedbytes_opaque& key, std::vector<double>& value,
   keys_[str_key] = key_list;
 }
 
+// Whether the file at path starts like a binary Q2 file.
+static bool has_Q2_magic(const std::string& path) {
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  char magic[8];
+  bool found = fread(magic, 1, sizeof(magic), f) == sizeof(magic) &&
+    memcmp(magic, Q2_FILE_MAGIC, sizeof(magic)) == 0;
+  fclose(f);
+  return found;
+}
+
 void DirTSQRMap3::mapper() {
-  while (!feof(in_.get_stream())) {
+  kernels_ = small_kernels(num_cols_);
+  Q2_binary_ = Q2_file_.open(Q2_path_);
+  if (!Q2_binary_ && has_Q2_magic(Q2_path_)) {
+    hadoop_error("%s is a truncated or corrupt Q2 file\n", Q2_path_.c_str());
+  }
+  if (Q2_binary_ && Q2_file_.num_cols() != num_cols_) {
+    hadoop_error("Q2 file has %zu columns, expected %zu\n",
+                 Q2_file_.num_cols(), num_cols_);
+  }
+  while (!in_.eof()) {
     typedbytes_opaque key;
     std::vector<double> row;
     std::list<typedbytes_opaque> string_keys;
     if (!read_key_val_pair(key, row, string_keys)) {
-      if (feof(in_.get_stream())) {
+      if (in_.eof()) {
 	break;
       } else {
 	hadoop_error("invalid key: row %i\n", num_total_rows_);
       }
     }
     collect(key, row, string_keys);
+    // In streaming mode, multiply as soon as the Q2 blocks are available:
+    // right away with the binary Q2 file, or with one pass over the text
+    // file once max_blocks_ Q1 blocks are held.
+    if (max_blocks_ > 0 &&
+        (Q2_binary_ || Q_matrices_.size() >= max_blocks_)) {
+      output();
+    }
   }
   hadoop_status("final output");
   output();
 }
 
 void DirTSQRMap3::output() {
+  if (Q_matrices_.empty()) {
+    return;
+  }
+  if (!Q2_binary_) {
+    output_text_Q2();
+    return;
+  }
+  // look up only the blocks for the keys on this task
+  std::vector<std::string> keys;
+  for (std::map<std::string, std::vector<double>>::iterator it =
+         Q_matrices_.begin(); it != Q_matrices_.end(); ++it) {
+    keys.push_back(it->first);
+  }
+  for (size_t i = 0; i < keys.size(); ++i) {
+    const double *Q2 = Q2_file_.find((const unsigned char *) keys[i].data(),
+                                     keys[i].size());
+    if (Q2 == NULL) {
+      hadoop_error("key %zu is missing from the Q2 file\n", i);
+    }
+    handle_matmul(keys[i], Q2);
+  }
+}
+
+void DirTSQRMap3::output_text_Q2() {
   FILE *f = fopen(Q2_path_.c_str(), "r");
-  assert(f);
+  if (!f) {
+    hadoop_error("could not open %s\n", Q2_path_.c_str());
+  }
   char b[262144];
+  std::string key;
+  std::vector<double> value;
   while (fgets(b, sizeof(b), f)) {
     char *buf = b;
-    size_t i;
-    while (*buf != '\0' && *buf++ != '(') ;
-    if (*buf == '\0')
-      hadoop_error("could not find key while parsing matrix\n");
-
-    for (i = 0; buf[i] != '\0' && buf[i] != ')'; ++i) ;
-    if (buf[i] == '\0')
-      hadoop_error("could not find key while parsing matrix\n");
-
-    std::string key((const char *) buf, i);
+    parse_text_dump_key(buf, key);
     std::map<std::string, std::vector<double>>::iterator Q_it =
       Q_matrices_.find(key);
     if (Q_it == Q_matrices_.end())
       continue;
 
-    buf += i + 1;
-    while (*buf != '\0' && *buf++ != '[') ;
-    if (*buf == '\0')
-      hadoop_error("could not find value while parsing matrix\n");
-
-    std::vector<double> value;
+    value.clear();
     value.reserve(num_cols_ * num_cols_);
-    double val;
-    while (true) {
-      for (i = 0; buf[i] != '\0' && buf[i] != ',' && buf[i] != ']'; ++i) ;
-      if (buf[i] == '\0') {
-	hadoop_error("could not find value\n");
-      } else if (buf[i] == ',') {
-	if (sscanf(buf, "%lg,", &val) != 1)
-	  hadoop_error("non-double in value\n");
-	value.push_back(val);
-	buf += i + 1;
-	// skip whitespace
-	++buf;
-      } else {
-	if (sscanf(buf, "%lg]", &val) != 1)
-	  hadoop_error("non-double in value\n");
-	value.push_back(val);
-	break;
-      }
-    }
+    parse_text_dump_values(buf, value);
     assert(value.size() == num_cols_ * num_cols_);
-    handle_matmul(key, value);
+    handle_matmul(key, &value[0]);
+    if (Q_matrices_.empty())
+      break;
+  }
+  fclose(f);
+  if (max_blocks_ > 0 && !Q_matrices_.empty()) {
+    hadoop_error("%zu Q1 blocks have no Q2 block\n", Q_matrices_.size());
+  }
+}
+
+bool convert_text_Q2_file(const std::string& text_path,
+                          const std::string& path, size_t num_cols) {
+  FILE *f = fopen(text_path.c_str(), "r");
+  if (!f) {
+    return false;
+  }
+  char b[262144];
+  std::string key;
+  KeyArena keys;
+  std::vector<double> values;
+  while (fgets(b, sizeof(b), f)) {
+    char *buf = b;
+    parse_text_dump_key(buf, key);
+    keys.push_back((const unsigned char *) key.data(), key.size());
+    parse_text_dump_values(buf, values);
+    if (values.size() != keys.size() * num_cols * num_cols) {
+      hadoop_error("Q2 block %zu has the wrong size\n", keys.size());
+    }
+  }
+  fclose(f);
+  return write_Q2_file(path, keys, values.empty() ? NULL : &values[0],
+                       num_cols);
+}
+
+// Order the index of a Q2 file by key.
+class Q2KeyLess {
+public:
+  Q2KeyLess(const KeyArena& keys) : keys_(keys) {}
+  bool operator()(size_t a, size_t b) const {
+    return key_less(keys_.key(a), keys_.key_size(a),
+                    keys_.key(b), keys_.key_size(b));
+  }
+  static bool key_less(const unsigned char *a, size_t a_size,
+                       const unsigned char *b, size_t b_size) {
+    int cmp = memcmp(a, b, std::min(a_size, b_size));
+    return cmp < 0 || (cmp == 0 && a_size < b_size);
+  }
+
+private:
+  const KeyArena& keys_;
+};
+
+bool write_Q2_file(const std::string& path, const KeyArena& keys,
+                   const double *Q2, size_t num_cols) {
+  size_t num_keys = keys.size();
+  size_t block_size = num_cols * num_cols * sizeof(double);
+  std::vector<size_t> order(num_keys);
+  for (size_t i = 0; i < num_keys; ++i) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), Q2KeyLess(keys));
+
+  Q2FileHeader header;
+  memcpy(header.magic, Q2_FILE_MAGIC, sizeof(header.magic));
+  header.num_cols = num_cols;
+  header.num_keys = num_keys;
+
+  // lay out the keys after the index, then the (aligned) blocks
+  std::vector<Q2FileEntry> index(num_keys);
+  uint64_t offset = sizeof(header) + num_keys * sizeof(Q2FileEntry);
+  for (size_t i = 0; i < num_keys; ++i) {
+    index[i].key_offset = offset;
+    index[i].key_size = keys.key_size(order[i]);
+    offset += index[i].key_size;
+  }
+  offset = (offset + sizeof(double) - 1) / sizeof(double) * sizeof(double);
+  uint64_t data_start = offset;
+  for (size_t i = 0; i < num_keys; ++i) {
+    index[i].data_offset = data_start + order[i] * block_size;
+  }
+
+  FILE *f = fopen(path.c_str(), "wb");
+  if (!f) {
+    return false;
+  }
+  bool success = fwrite(&header, sizeof(header), 1, f) == 1;
+  if (num_keys > 0) {
+    success = success && fwrite(&index[0], sizeof(Q2FileEntry),
+                                num_keys, f) == num_keys;
+  }
+  for (size_t i = 0; i < num_keys && success; ++i) {
+    size_t key_size = keys.key_size(order[i]);
+    success = fwrite(keys.key(order[i]), 1, key_size, f) == key_size;
+  }
+  static const char padding[sizeof(double)] = {0};
+  size_t pad = data_start - (size_t) ftell(f);
+  success = success && fwrite(padding, 1, pad, f) == pad;
+  if (num_keys > 0) {
+    success = success && fwrite(Q2, block_size, num_keys, f) == num_keys;
+  }
+  return fclose(f) == 0 && success;
+}
+
+bool Q2File::open(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(Q2FileHeader)) {
+    close(fd);
+    return false;
+  }
+  void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  data_ = (unsigned char *) data;
+  size_ = (size_t) st.st_size;
+  header_ = (const Q2FileHeader *) data_;
+  index_ = (const Q2FileEntry *) (data_ + sizeof(Q2FileHeader));
+  if (!check_index()) {
+    munmap(data_, size_);
+    data_ = NULL;
+    return false;
+  }
+  return true;
+}
+
+bool Q2File::check_index() const {
+  if (memcmp(header_->magic, Q2_FILE_MAGIC, sizeof(header_->magic)) != 0) {
+    return false;
+  }
+  // the sizes are compared by division, so that they cannot overflow
+  size_t num_keys = (size_t) header_->num_keys;
+  size_t num_cols = (size_t) header_->num_cols;
+  if (header_->num_keys > (size_ - sizeof(Q2FileHeader)) / sizeof(Q2FileEntry)) {
+    return false;
+  }
+  if (num_keys > 0 && num_cols == 0) {
+    return false;
+  }
+  for (size_t i = 0; i < num_keys; ++i) {
+    const Q2FileEntry& entry = index_[i];
+    if (entry.key_offset > size_ || entry.key_size > size_ - entry.key_offset ||
+        entry.data_offset > size_ || entry.data_offset % sizeof(double) != 0 ||
+        (size_ - entry.data_offset) / sizeof(double) / num_cols < num_cols) {
+      return false;
+    }
+  }
+  return true;
+}
+
+Q2File::~Q2File() {
+  if (data_ != NULL) {
+    munmap(data_, size_);
   }
 }
 
-void DirTSQRMap3::handle_matmul(std::string& key, std::vector<double>& Q2) {
+const double *Q2File::find(const unsigned char *key, size_t size) const {
+  // binary search of the sorted index
+  size_t lo = 0;
+  size_t hi = (size_t) header_->num_keys;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const Q2FileEntry& entry = index_[mid];
+    if (Q2KeyLess::key_less(data_ + entry.key_offset, entry.key_size,
+                            key, size)) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == header_->num_keys) {
+    return NULL;
+  }
+  const Q2FileEntry& entry = index_[lo];
+  if (entry.key_size != size ||
+      memcmp(data_ + entry.key_offset, key, size) != 0) {
+    return NULL;
+  }
+  return (const double *) (data_ + entry.data_offset);
+}
+
+bool DirTSQRMap3::add_level(const std::string& path, size_t num_groups) {
+  std::unique_ptr<Q2File> file(new Q2File);
+  if (!file->open(path) || file->num_cols() != num_cols_) {
+    return false;
+  }
+  levels_.push_back(std::move(file));
+  level_groups_.push_back(num_groups);
+  return true;
+}
+
+void DirTSQRMap3::handle_matmul(const std::string& key, const double *Q2) {
   std::map<std::string, std::vector<double>>::iterator Q_it =
     Q_matrices_.find(key);
   assert(Q_it != Q_matrices_.end());
@@ -331,23 +678,203 @@ void DirTSQRMap3::handle_matmul(std::string& key, std::vector<double>& Q2) {
     hadoop_message("num rows: %d, keys: %d\n", Q1.size() / num_cols_, key_output.size());
   assert(Q1.size() / num_cols_ == key_output.size());
 
+  // multiply the Q2 blocks along the path of a recursive stage 2
+  std::string path_key = key;
+  for (size_t level = 0; level < levels_.size(); ++level) {
+    // the keys of the next level are the groups, as typed bytes strings
+    path_key = (char) TypedBytesString +
+      direct_tsqr_group(level + 1, (const unsigned char *) path_key.data(),
+                        path_key.size(), level_groups_[level]);
+    const double *next = levels_[level]->find(
+      (const unsigned char *) path_key.data(), path_key.size());
+    if (next == NULL) {
+      hadoop_error("group %s is missing from level %zu\n",
+                   path_key.c_str() + 1, level + 2);
+    }
+    std::vector<double>& product = path_Q2_[level % 2];
+    product.resize(num_cols_ * num_cols_);
+    lapack_tsmatmul(const_cast<double *>(Q2), num_cols_, num_cols_,
+                    const_cast<double *>(next), num_cols_, &product[0]);
+    Q2 = &product[0];
+  }
+
+  if (!U_.empty()) {
+    // Q1 * (Q2 * U_R), the block of the left singular vectors
+    Q2U_.resize(num_cols_ * num_cols_);
+    lapack_tsmatmul(const_cast<double *>(Q2), num_cols_, num_cols_, &U_[0],
+                    num_cols_, &Q2U_[0]);
+    Q2 = &Q2U_[0];
+  }
+
+  // Q1 is row-major, so the product comes out row-major a chunk of rows
+  // at a time, ready to write.
   size_t num_rows = Q1.size() / num_cols_;
+  size_t chunk_rows = std::min(num_rows, (size_t) MAP3_CHUNK_ROWS);
+  product_.resize(chunk_rows * num_cols_);
+  std::list<typedbytes_opaque>::iterator out_key = key_output.begin();
+  for (size_t row = 0; row < num_rows; row += chunk_rows) {
+    size_t nrows = std::min(chunk_rows, num_rows - row);
+    if (kernels_ != NULL && kernels_->row_major_matmul != NULL) {
+      kernels_->row_major_matmul(&Q1[row * num_cols_], nrows, Q2,
+                                 &product_[0]);
+    } else {
+      lapack_row_major_matmul(&Q1[row * num_cols_], nrows, num_cols_, Q2,
+                              num_cols_, &product_[0]);
+    }
+    for (size_t i = 0; i < nrows; ++i, ++out_key) {
+      out_.write_byte_sequence(&(*out_key)[0], out_key->size());
+      out_.write_byte_sequence((unsigned char *) &product_[i * num_cols_],
+                               num_cols_ * sizeof(double));
+    }
+  }
+
+  // this block is done
+  keys_.erase(key_it);
+  Q_matrices_.erase(Q_it);
+}
 
-  double *C = (double *) malloc (Q1.size() * sizeof(double));
-  assert(C);
-  lapack_tsmatmul(&Q1[0], num_rows, num_cols_, &Q2[0], num_cols_, C);
 
-  col_to_row_major(C, &Q1[0], num_rows, num_cols_);
-  free(C);
 
-  double *out = &Q1[0];
-  while (!key_output.empty()) {
-    typedbytes_opaque curr_key = key_output.front();
-    out_.write_byte_sequence(&curr_key[0], curr_key.size());
-    out_.write_byte_sequence((unsigned char *) out, num_cols_ * sizeof(double));
-    out += num_cols_;
-    key_output.pop_front();
+void DirTSQRLocal::mapper() {
+  typedbytes_opaque key;
+  std::vector<double> row;
+  if (!read_key_val_pair(key, row) || row.empty()) {
+    hadoop_error("no rows in the input\n");
   }
+  num_cols_ = row.size();
+  hadoop_message("matrix size: %zi columns\n", num_cols_);
+  keys_.push_back(key.empty() ? NULL : &key[0], key.size());
+  row_accumulator_.assign(row.begin(), row.end());
+  num_total_rows_ = 1;
+  while (!in_.eof()) {
+    key.clear();
+    if (!in_.read_opaque(key)) {
+      if (in_.eof()) {
+        break;
+      } else {
+        hadoop_error("invalid key: row %i\n", num_total_rows_);
+      }
+    }
+    keys_.push_back(key.empty() ? NULL : &key[0], key.size());
+    // decode straight into the accumulator
+    row_accumulator_.resize(row_accumulator_.size() + num_cols_);
+    read_row(&row_accumulator_[row_accumulator_.size() - num_cols_], 1);
+    ++num_total_rows_;
+  }
+  hadoop_status("final output");
+  output();
+}
+
+void DirTSQRLocal::file_mapper(const MatrixFile& file) {
+  num_cols_ = file.num_cols();
+  num_total_rows_ = file.num_rows();
+  if (num_total_rows_ == 0 || num_cols_ == 0) {
+    hadoop_error("no rows in the input\n");
+  }
+  hadoop_message("matrix size: %zi x %zi\n", num_total_rows_, num_cols_);
+  row_accumulator_.resize(num_total_rows_ * num_cols_);
+  file.read_rows(0, num_total_rows_, &row_accumulator_[0]);
+  push_row_number_keys(keys_, num_total_rows_);
+  hadoop_status("final output");
+  output();
 }
 
+template <typename F> void DirTSQRLocal::for_each_part(F f) {
+  size_t num_threads = std::min(std::max(num_threads_, (size_t) 1),
+                                num_parts_);
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < num_threads; ++t) {
+    threads.emplace_back([this, &f, t, num_threads]() {
+        for (size_t p = t; p < num_parts_; p += num_threads) {
+          f(p, t);
+        }
+      });
+  }
+  for (size_t t = 0; t < num_threads; ++t) {
+    threads[t].join();
+  }
+}
 
+void DirTSQRLocal::output() {
+  size_t n = num_cols_;
+  size_t m = num_total_rows_;
+  if (m < n) {
+    hadoop_error("%zu rows is fewer than %zu columns\n", m, n);
+  }
+  // every partition needs at least n rows for an n x n R
+  num_parts_ = std::max(std::min(std::max(num_parts_, (size_t) 1), m / n),
+                        (size_t) 1);
+  part_rows_.resize(num_parts_ + 1);
+  for (size_t p = 0; p <= num_parts_; ++p) {
+    part_rows_[p] = m * p / num_parts_;
+  }
+  hadoop_message("%zu rows in %zu partitions on %zu threads\n", m,
+                 num_parts_, std::min(num_threads_, num_parts_));
+  size_t num_threads = std::max(num_threads_, (size_t) 1);
+  std::vector<LapackContext> contexts(num_threads);
+
+  // stage 1: the Q1 of each partition in place, and its R in the stack
+  std::vector<double> R_stack(num_parts_ * n * n);
+  double t0 = sf_time();
+  for_each_part([&](size_t p, size_t t) {
+      size_t first = part_rows_[p];
+      if (!lapack_row_major_qr(&row_accumulator_[first * n], &R_stack[p * n * n],
+                               part_rows_[p + 1] - first, n, contexts[t])) {
+        hadoop_error("lapack error in partition %zu\n", p);
+      }
+    });
+  double t1 = sf_time();
+  hadoop_message("stage 1: %.3f s\n", t1 - t0);
+
+  // stage 2: R, and the column-major Q2 blocks in the stack
+  std::vector<double> R(n * n);
+  factor_R_stack(&R_stack[0], num_parts_, n, &R[0], lapack_);
+  double t2 = sf_time();
+  hadoop_message("stage 2: %.3f s\n", t2 - t1);
+
+  // stage 3: Q = Q1 * Q2 in place, a chunk of rows at a time
+  kernels_ = small_kernels(n);
+  std::vector<std::vector<double>> chunks(num_threads);
+  for_each_part([&](size_t p, size_t t) {
+      const double *Q2 = &R_stack[p * n * n];
+      std::vector<double>& chunk = chunks[t];
+      chunk.resize(MAP3_CHUNK_ROWS * n);
+      for (size_t row = part_rows_[p]; row < part_rows_[p + 1];
+           row += MAP3_CHUNK_ROWS) {
+        size_t nrows = std::min((size_t) MAP3_CHUNK_ROWS,
+                                part_rows_[p + 1] - row);
+        double *Q1 = &row_accumulator_[row * n];
+        if (kernels_ != NULL && kernels_->row_major_matmul != NULL) {
+          kernels_->row_major_matmul(Q1, nrows, Q2, &chunk[0]);
+        } else {
+          lapack_row_major_matmul(Q1, nrows, n, Q2, n, &chunk[0]);
+        }
+        std::copy(chunk.begin(), chunk.begin() + nrows * n, Q1);
+      }
+    });
+  double t3 = sf_time();
+  hadoop_message("stage 3: %.3f s\n", t3 - t2);
+
+  if (R_path_ != "-") {
+    FILE *f = fopen(R_path_.c_str(), "w");
+    if (!f) {
+      hadoop_error("could not open %s\n", R_path_.c_str());
+    }
+    // the text dump of the R_final output of stage 2
+    for (size_t i = 0; i < n; ++i) {
+      fprintf(f, "(%zu)\t[", i);
+      for (size_t j = 0; j < n; ++j) {
+        fprintf(f, j > 0 ? ", %.17g" : "%.17g", R[i * n + j]);
+      }
+      fprintf(f, "]\n");
+    }
+    if (fclose(f) != 0) {
+      hadoop_error("could not write %s\n", R_path_.c_str());
+    }
+  }
+  for (size_t i = 0; i < m; ++i) {
+    write_key(keys_.key(i), keys_.key_size(i));
+    out_.write_byte_sequence((unsigned char *) &row_accumulator_[i * n],
+                             n * sizeof(double));
+  }
+}
@@ -139,7 +139,7 @@ void dump_typedbytes_one(TypedBytesInFile& in, int indent) {
 }
         
 void dump_typedbytes_all(TypedBytesInFile& in, int indent) {
-  while (!feof(in.get_stream())) {
+  while (!in.eof()) {
         dump_typedbytes_one(in, indent);
     }
 }
@@ -0,0 +1,454 @@
+/**
+   Copyright (c) 2012-2014, Austin Benson and David Gleich
+   All rights reserved.
+
+   This file is part of MRTSQR and is under the BSD 2-Clause License,
+   which can be found in the LICENSE file in the root directory, or at
+   http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include <assert.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "mrmc.h"
+#include "sparfun_util.h"
+#include "tsqr_util.h"
+#include "typedbytes.h"
+
+bool HouseholderPanel::load_panel(const std::string& path) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f) {
+    return false;
+  }
+  char b[262144];
+  std::string key;
+  std::vector<double> value;
+  while (fgets(b, sizeof(b), f)) {
+    char *buf = b;
+    parse_text_dump_key(buf, key);
+    value.clear();
+    parse_text_dump_values(buf, value);
+    if (key.compare(0, 6, "pivot:") == 0) {
+      pivots_[key.substr(6)] = (int) value[0];
+    } else if (key == "T") {
+      T_ = value;
+    } else if (key == "UR") {
+      UR_ = value;
+    } else if (key == "V1") {
+      V1_ = value;
+    } else if (key == "RH") {
+      RH_ = value;
+    }
+  }
+  fclose(f);
+
+  panel_cols_ = (size_t) (sqrt((double) T_.size()) + 0.5);
+  size_t size = panel_cols_ * panel_cols_;
+  if (panel_cols_ == 0 || T_.size() != size || UR_.size() != size ||
+      V1_.size() != size || RH_.size() != size ||
+      pivots_.size() != panel_cols_) {
+    hadoop_error("incomplete Householder panel in %s\n", path.c_str());
+  }
+  return true;
+}
+
+void HouseholderPanel::first_row() {
+  typedbytes_opaque key;
+  std::vector<double> row;
+  read_key_val_pair(key, row);
+  num_cols_ = row.size();
+  hadoop_message("matrix size: %zi columns, up to %i localrows\n",
+                 num_cols_, blocksize_ * num_cols_);
+  if (num_cols_ == 0) {
+    hadoop_message("no data received on this task\n");
+    return;
+  }
+  if (num_cols_ < panel_cols_) {
+    hadoop_error("rows of %zu columns for a panel of %zu columns\n",
+                 num_cols_, panel_cols_);
+  }
+  alloc(blocksize_ * num_cols_, num_cols_);
+  collect(key, row);
+}
+
+void HouseholderPanel::collect(typedbytes_opaque& key,
+                               std::vector<double>& value) {
+  keys_.push_back(key.empty() ? NULL : &key[0], key.size());
+  // the pivot rows are the ones with the string keys of the panel
+  int pivot = -1;
+  if (!pivots_.empty() && !key.empty() && key[0] == TypedBytesString) {
+    std::map<std::string, int>::const_iterator it =
+      pivots_.find(std::string((const char *) &key[1], key.size() - 1));
+    if (it != pivots_.end()) {
+      pivot = it->second;
+    }
+  }
+  pivot_of_row_.push_back(pivot);
+  add_row(value);
+  if (num_local_rows_ >= num_rows_) {
+    compress();
+    hadoop_counter("compressions", 1);
+  }
+}
+
+void HouseholderPanel::panel_V(std::vector<double>& V) {
+  size_t urows = num_local_rows_;
+  size_t b = panel_cols_;
+  V.resize(urows * b);
+  for (size_t j = 0; j < b; ++j) {
+    std::copy(&local_matrix_[j * num_rows_],
+              &local_matrix_[j * num_rows_] + urows, &V[j * urows]);
+  }
+  double t0 = sf_time();
+  lapack_trsm(&V[0], urows, urows, b, &UR_[0]);
+  incr_lapack_time(sf_time() - t0);
+  for (size_t i = 0; i < urows; ++i) {
+    int pivot = pivot_of_row_[i];
+    if (pivot >= 0) {
+      for (size_t j = 0; j < b; ++j) {
+        V[i + j * urows] = V1_[pivot + j * b];
+      }
+    }
+  }
+}
+
+bool HouseholderMap::load_W(const std::string& path) {
+  FILE *f = fopen(path.c_str(), "r");
+  if (!f) {
+    return false;
+  }
+  size_t b = panel_cols_;
+  std::vector<double> W;
+  size_t width = 0;
+  char buf_storage[262144];
+  std::string key;
+  std::vector<double> row;
+  while (fgets(buf_storage, sizeof(buf_storage), f)) {
+    char *buf = buf_storage;
+    parse_text_dump_key(buf, key);
+    size_t i = atoi(key.c_str());
+    row.clear();
+    parse_text_dump_values(buf, row);
+    if (W.empty()) {
+      width = row.size();
+      W.assign(b * width, 0.0);
+    }
+    if (i >= b || row.size() != width) {
+      hadoop_error("invalid row %s of W in %s\n", key.c_str(), path.c_str());
+    }
+    for (size_t j = 0; j < width; ++j) {
+      W[i + j * b] = row[j];
+    }
+  }
+  fclose(f);
+
+  // the update of a row a is a - v T^T W
+  TW_.resize(b * width);
+  lapack_gemm(true, false, b, width, b, 1.0, &T_[0], b, &W[0], b, 0.0,
+              &TW_[0], b);
+  return true;
+}
+
+void HouseholderMap::write_R_row(size_t i, int pivot) {
+  size_t b = panel_cols_;
+  size_t offset = total_cols_ - num_cols_;
+  std::vector<double> row(total_cols_, 0.0);
+  for (size_t j = pivot; j < b; ++j) {
+    row[offset + j] = RH_[pivot + j * b];
+  }
+  for (size_t j = b; j < num_cols_; ++j) {
+    row[offset + j] = local_matrix_[i + j * num_rows_];
+  }
+  write_file_key("R_final", (int) (offset + pivot));
+  out_.write_double_list(&row[0], total_cols_);
+}
+
+void HouseholderMap::compress() {
+  size_t urows = num_local_rows_;
+  if (urows == 0) {
+    return;
+  }
+  size_t b = panel_cols_;
+  size_t width = num_cols_ - b;
+  double *trailing = &local_matrix_[0] + b * num_rows_;
+  if (total_cols_ < num_cols_) {
+    hadoop_error("rows of %zu columns in a matrix of %zu columns\n",
+                 num_cols_, total_cols_);
+  }
+
+  // apply H^T = I - V T^T V^T of the previous panel
+  if (b > 0) {
+    if (TW_.size() != b * width) {
+      hadoop_error("W is %zu entries, expected %zu\n", TW_.size(), b * width);
+    }
+    if (width > 0) {
+      panel_V(V_);
+      double t0 = sf_time();
+      lapack_gemm(false, false, urows, width, b, -1.0, &V_[0], urows,
+                  &TW_[0], b, 1.0, trailing, num_rows_);
+      incr_lapack_time(sf_time() - t0);
+    }
+    for (size_t i = 0; i < urows; ++i) {
+      if (pivot_of_row_[i] >= 0) {
+        write_R_row(i, pivot_of_row_[i]);
+      }
+    }
+  }
+
+  if (R_.empty()) {
+    next_cols_ = std::min(panel_size_, width);
+    R_.assign(next_cols_ * next_cols_, 0.0);
+  }
+  size_t nb = next_cols_;
+  panel_.resize(urows * nb);
+  size_t nrows = 0;
+  for (size_t i = 0; i < urows; ++i) {
+    if (pivot_of_row_[i] >= 0) {
+      continue;
+    }
+    const double *row = trailing + i;
+    // the first rows of each task are the pivot candidates of the next
+    // panel, and get keys that the reduce can refer to
+    if (num_candidates_ < nb) {
+      char tag[64];
+      snprintf(tag, sizeof(tag), "%s_%zu", mapper_id_.c_str(),
+               num_candidates_);
+      write_file_key("A_matrix", tag);
+      out_.write_double_list(row, width, num_rows_);
+      write_file_key("C_" + mapper_id_, std::string("C:") + tag);
+      out_.write_double_list(row, nb, num_rows_);
+      ++num_candidates_;
+    } else {
+      out_.write_list_start();
+      out_.write_string_stl("A_matrix");
+      write_key(keys_.key(i), keys_.key_size(i));
+      out_.write_list_end();
+      out_.write_double_list(row, width, num_rows_);
+    }
+    for (size_t j = 0; j < nb; ++j) {
+      panel_[nrows + j * urows] = row[j * num_rows_];
+    }
+    ++nrows;
+  }
+
+  // the local R of the next panel
+  if (nb > 0 && nrows > 0) {
+    double t0 = sf_time();
+    if (!lapack_tpqr(&R_[0], nb, &panel_[0], urows, nb, nrows, 0, lapack_)) {
+      hadoop_error("lapack error\n");
+    }
+    incr_lapack_time(sf_time() - t0);
+    num_factored_ += nrows;
+  }
+
+  num_local_rows_ = 0;
+  keys_.clear();
+  pivot_of_row_.clear();
+}
+
+void HouseholderMap::output() {
+  if (num_cols_ == 0) {
+    // no data was received on this task
+    return;
+  }
+  compress();
+  if (num_factored_ == 0 || next_cols_ == 0) {
+    return;
+  }
+  // row-major, as DirTSQRMap1 emits R
+  size_t nb = next_cols_;
+  std::vector<double> R(nb * nb);
+  col_to_row_major(&R_[0], &R[0], nb, nb);
+  write_file_key("R_" + mapper_id_, "R:" + mapper_id_);
+  out_.write_byte_sequence((unsigned char *) &R[0], nb * nb * sizeof(double));
+}
+
+void HouseholderReduce::mapper() {
+  typedbytes_opaque key;
+  std::vector<double> value;
+  while (!in_.eof()) {
+    key.clear();
+    if (!read_key_val_pair(key, value)) {
+      if (in_.eof()) {
+        break;
+      } else {
+        hadoop_error("invalid key: row %i\n", num_total_rows_);
+      }
+    }
+    ++num_total_rows_;
+    std::string name;
+    if (key.size() > 1 && key[0] == TypedBytesString) {
+      name.assign((const char *) &key[1], key.size() - 1);
+    }
+    if (name.compare(0, 2, "R:") == 0) {
+      R_stack_.insert(R_stack_.end(), value.begin(), value.end());
+    } else if (name.compare(0, 2, "C:") == 0) {
+      candidates_[name.substr(2)] = value;
+    } else {
+      hadoop_error("unexpected key %s\n", name.c_str());
+    }
+  }
+  hadoop_status("final output");
+  output();
+}
+
+void HouseholderReduce::output() {
+  if (candidates_.empty() || R_stack_.empty()) {
+    hadoop_error("no panel received on this task\n");
+  }
+  size_t b = candidates_.begin()->second.size();
+  size_t size = b * b;
+  if (candidates_.size() < b) {
+    hadoop_error("%zu rows left for a panel of %zu columns\n",
+                 candidates_.size(), b);
+  }
+  if (R_stack_.size() % size != 0) {
+    hadoop_error("R factors do not match a panel of %zu columns\n", b);
+  }
+
+  // the R of the panel, from its local R factors
+  double t0 = sf_time();
+  std::vector<double> R(size);
+  lapack_row_major_qr(&R_stack_[0], &R[0], R_stack_.size() / b, b, lapack_);
+  transpose_square(&R[0], b);
+  for (size_t i = 0; i < b; ++i) {
+    if (R[i + i * b] == 0.0) {
+      hadoop_error("the panel is rank deficient\n");
+    }
+  }
+
+  // The first b candidates are the pivot rows, and their rows of the Q
+  // of the panel are Q1 = A1 R^{-1}.
+  std::vector<std::string> pivots;
+  std::vector<double> LU(size);
+  std::map<std::string, std::vector<double>>::const_iterator it =
+    candidates_.begin();
+  for (size_t i = 0; i < b; ++i, ++it) {
+    pivots.push_back(it->first);
+    for (size_t j = 0; j < b; ++j) {
+      LU[i + j * b] = it->second[j];
+    }
+  }
+  lapack_trsm(&LU[0], b, b, b, &R[0]);
+
+  // Q1 - S = L U without pivoting, where the signs S make the pivots at
+  // least 1 in magnitude.  Then V1 = L and H = I - V T V^T has the
+  // first columns Q S, with T = -U S V1^{-T} and R_H = S R.
+  std::vector<double> S(b);
+  for (size_t k = 0; k < b; ++k) {
+    double *pivot = &LU[k + k * b];
+    S[k] = *pivot < 0 ? 1.0 : -1.0;
+    *pivot -= S[k];
+    for (size_t i = k + 1; i < b; ++i) {
+      LU[i + k * b] /= *pivot;
+    }
+    for (size_t j = k + 1; j < b; ++j) {
+      for (size_t i = k + 1; i < b; ++i) {
+        LU[i + j * b] -= LU[i + k * b] * LU[k + j * b];
+      }
+    }
+  }
+  std::vector<double> U(size, 0.0);
+  std::vector<double> V1(size, 0.0);
+  for (size_t j = 0; j < b; ++j) {
+    for (size_t i = 0; i <= j; ++i) {
+      U[i + j * b] = LU[i + j * b];
+    }
+    V1[j + j * b] = 1.0;
+    for (size_t i = j + 1; i < b; ++i) {
+      V1[i + j * b] = LU[i + j * b];
+    }
+  }
+
+  // The other rows of V are (A R^{-1}) U^{-1} = A (U R)^{-1}.
+  std::vector<double> UR(size);
+  lapack_gemm(false, false, b, b, b, 1.0, &U[0], b, &R[0], b, 0.0, &UR[0], b);
+
+  // T V1^T = -U S, one column at a time since V1^T is unit upper
+  std::vector<double> T(size);
+  for (size_t j = 0; j < b; ++j) {
+    double *t = &T[j * b];
+    for (size_t i = 0; i < b; ++i) {
+      t[i] = -S[j] * U[i + j * b];
+    }
+    for (size_t k = 0; k < j; ++k) {
+      for (size_t i = 0; i < b; ++i) {
+        t[i] -= V1[j + k * b] * T[i + k * b];
+      }
+    }
+  }
+
+  std::vector<double> RH(size);
+  for (size_t j = 0; j < b; ++j) {
+    for (size_t i = 0; i < b; ++i) {
+      RH[i + j * b] = S[i] * R[i + j * b];
+    }
+  }
+  incr_lapack_time(sf_time() - t0);
+
+  out_.write_string_stl("T");
+  out_.write_double_list(&T[0], size);
+  out_.write_string_stl("UR");
+  out_.write_double_list(&UR[0], size);
+  out_.write_string_stl("V1");
+  out_.write_double_list(&V1[0], size);
+  out_.write_string_stl("RH");
+  out_.write_double_list(&RH[0], size);
+  for (size_t i = 0; i < b; ++i) {
+    double index = (double) i;
+    out_.write_string_stl("pivot:" + pivots[i]);
+    out_.write_double_list(&index, 1);
+  }
+}
+
+void HouseholderW::compress() {
+  size_t urows = num_local_rows_;
+  if (urows == 0) {
+    return;
+  }
+  size_t b = panel_cols_;
+  size_t width = num_cols_ - b;
+  if (width == 0) {
+    // the last panel has nothing after it
+    num_local_rows_ = 0;
+    keys_.clear();
+    pivot_of_row_.clear();
+    return;
+  }
+  if (W_.empty()) {
+    W_.assign(b * width, 0.0);
+  }
+  panel_V(V_);
+  double t0 = sf_time();
+  lapack_gemm(true, false, b, width, urows, 1.0, &V_[0], urows,
+              &local_matrix_[b * num_rows_], num_rows_, 1.0, &W_[0], b);
+  incr_lapack_time(sf_time() - t0);
+  num_local_rows_ = 0;
+  keys_.clear();
+  pivot_of_row_.clear();
+}
+
+void HouseholderW::output() {
+  if (num_cols_ == 0) {
+    // no data was received on this task
+    return;
+  }
+  compress();
+  size_t b = panel_cols_;
+  size_t width = num_cols_ - b;
+  if (width == 0) {
+    return;
+  }
+  // row i of W, which RowSum adds up over the tasks
+  for (size_t i = 0; i < b; ++i) {
+    out_.write_int(i);
+    out_.write_double_list(&W_[i], width, b);
+  }
+}
@@ -9,6 +9,10 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <thread>
 
 #include "sparfun_util.h"
 #include "tsqr_util.h"
@@ -16,6 +20,24 @@
 
 // TODO(arbenson): real command-line options
 
+// A matrix file to read instead of the typed bytes input (see
+// MatrixFile): tsqr --matrix path method ...  The methods that cannot
+// read a matrix file fail, through MatrixHandler::file_mapper.
+static const char *matrix_path = NULL;
+
+// Run map.mapper(), or map.file_mapper() on the matrix file.
+static void run_mapper(MatrixHandler& map) {
+  if (matrix_path == NULL) {
+    map.mapper();
+    return;
+  }
+  MatrixFile file;
+  if (!file.open(matrix_path)) {
+    hadoop_error("%s is not a matrix file\n", matrix_path);
+  }
+  map.file_mapper(file);
+}
+
 void handle_direct_tsqr(int argc, char **argv) {
   fprintf(stderr, "using direct TSQR\n");
   // create typed bytes files
@@ -25,6 +47,41 @@ void handle_direct_tsqr(int argc, char **argv) {
   if (argc < 1) {
     fprintf(stderr, "ERROR: missing stage!\n");
   }
+
+  // Convert the text dump of the stage 2 Q2 output into a binary Q2
+  // file for stage 3: direct q2index ncols text_file binary_file
+  if (!strcmp(argv[0], "q2index")) {
+    if (argc < 4) {
+      fprintf(stderr, "ERROR: usage is direct q2index ncols text bin\n");
+      return;
+    }
+    if (!convert_text_Q2_file(argv[2], argv[3], atoi(argv[1]))) {
+      hadoop_error("could not convert %s to %s\n", argv[2], argv[3]);
+    }
+    return;
+  }
+
+  // A level of a recursive stage 2: direct rgroup level ngroups maps the
+  // R factors into groups, and direct rlevel ncols factors each group.
+  if (!strcmp(argv[0], "rgroup")) {
+    if (argc < 3) {
+      fprintf(stderr, "ERROR: usage is direct rgroup level ngroups\n");
+      return;
+    }
+    DirTSQRGroupMap map(in, out, atoi(argv[1]), atoi(argv[2]));
+    run_mapper(map);
+    return;
+  }
+  if (!strcmp(argv[0], "rlevel")) {
+    if (argc < 2) {
+      fprintf(stderr, "ERROR: usage is direct rlevel ncols\n");
+      return;
+    }
+    DirTSQRReduceLevel map(in, out, atoi(argv[1]));
+    run_mapper(map);
+    return;
+  }
+
   size_t stage = atoi(argv[0]);
 
   if (stage != 1 && argc < 2) {
@@ -34,16 +91,98 @@ void handle_direct_tsqr(int argc, char **argv) {
   // TODO(arbenson): handle rows per record
   if (stage == 1) {
     DirTSQRMap1 map(in, out, 1);
-    map.mapper();
+    run_mapper(map);
   } else if (stage == 2) {
+    // optional: write Q2 to a binary file instead of the output ("-" for
+    // the output), and whether to also output the SVD of R
     size_t ncols = atoi(argv[1]);
-    DirTSQRReduce2 map(in, out, 1, ncols);
-    map.mapper();
+    std::string Q2_path;
+    if (argc > 2 && strcmp(argv[2], "-"))
+      Q2_path = argv[2];
+    bool svd = false;
+    if (argc > 3)
+      svd = atoi(argv[3]) != 0;
+    DirTSQRReduce2 map(in, out, 1, ncols, Q2_path, svd);
+    run_mapper(map);
   } else if (stage == 3) {
+    // optional: the Q2 file, either binary or the text dump, the
+    // maximum number of Q1 blocks to hold (0 holds all of them), and the
+    // text dump of the U output of stage 2 to output U instead of Q
     size_t ncols = atoi(argv[1]);
-    DirTSQRMap3 map(in, out, 1, ncols);
+    std::string Q2_path = "Q2.txt.out";
+    if (argc > 2)
+      Q2_path = argv[2];
+    size_t max_blocks = 0;
+    if (argc > 3)
+      max_blocks = atoi(argv[3]);
+    std::vector<double> U;
+    if (argc > 4 && strcmp(argv[4], "-") &&
+        !read_text_R(argv[4], ncols, U)) {
+      hadoop_error("could not read U from %s\n", argv[4]);
+    }
+    DirTSQRMap3 map(in, out, 1, ncols, Q2_path, max_blocks, U);
+    // optional, for a recursive stage 2: the binary Q2 file of each level
+    // above the first, as a comma-separated list of groups:file, where
+    // groups is the number of groups of the level below
+    if (argc > 5) {
+      char *levels = argv[5];
+      for (char *level = strtok(levels, ","); level != NULL;
+           level = strtok(NULL, ",")) {
+        char *path = strchr(level, ':');
+        if (path == NULL || !map.add_level(path + 1, atoi(level))) {
+          hadoop_error("invalid Q2 level %s\n", level);
+        }
+      }
+    }
+    run_mapper(map);
+  }
+}
+
+// Direct TSQR on one node: local matrix R_path [threads [parts]].  The
+// matrix is a matrix file (see MatrixFile), whose rows get their row
+// numbers as keys, or a typed bytes file of (key, row) pairs ("-" for
+// stdin), the
+// rows of Q go to the output and the text dump of R to R_path ("-" to
+// skip it).  By default, there is one thread per core and one partition
+// per thread.
+void handle_local_tsqr(int argc, char **argv) {
+  fprintf(stderr, "using local direct TSQR\n");
+  if (argc < 2) {
+    hadoop_error("usage is local matrix R_path [threads [parts]]\n");
+  }
+  if (matrix_path != NULL) {
+    hadoop_error("local takes the matrix file as its first argument\n");
+  }
+  // a matrix file, or a typed bytes file
+  MatrixFile file;
+  bool is_matrix_file = strcmp(argv[0], "-") && file.open(argv[0]);
+  FILE *f = stdin;
+  if (strcmp(argv[0], "-") && !is_matrix_file) {
+    f = fopen(argv[0], "rb");
+    if (!f) {
+      hadoop_error("could not open %s\n", argv[0]);
+    }
+  }
+  // create typed bytes files
+  TypedBytesInFile in(f);
+  TypedBytesOutFile out(stdout);
+
+  size_t num_threads = std::thread::hardware_concurrency();
+  if (argc > 2)
+    num_threads = atoi(argv[2]);
+  num_threads = std::max(num_threads, (size_t) 1);
+  size_t num_parts = num_threads;
+  if (argc > 3)
+    num_parts = atoi(argv[3]);
+  DirTSQRLocal map(in, out, num_threads, num_parts, argv[1]);
+  if (is_matrix_file) {
+    map.file_mapper(file);
+  } else {
     map.mapper();
   }
+  if (f != stdin) {
+    fclose(f);
+  }
 }
 
 void handle_indirect_tsqr(int argc, char **argv) {
@@ -61,7 +200,68 @@ void handle_indirect_tsqr(int argc, char **argv) {
     rows_per_record = atoi(argv[1]);
 
   SerialTSQR map(in, out, blocksize, rows_per_record);
-  map.mapper();
+  // number of blocks to overlap decoding with the QR (0 to disable)
+  if (argc > 2)
+    map.pipeline_depth_ = atoi(argv[2]);
+  // number of threads that factor blocks, each with its own R
+  if (argc > 3)
+    map.num_threads_ = atoi(argv[3]);
+  run_mapper(map);
+}
+
+// The final reduce of indirect TSQR, followed by the SVD of R.  The
+// map and the other reduce iterations are indirect TSQR.
+void handle_svd(int argc, char **argv) {
+  fprintf(stderr, "using TSQR SVD\n");
+  // create typed bytes files
+  TypedBytesInFile in(stdin);
+  TypedBytesOutFile out(stdout);
+
+  size_t blocksize = 3;
+  if (argc > 0)
+    blocksize = atoi(argv[0]);
+
+  size_t rows_per_record = 1;
+  if (argc > 1)
+    rows_per_record = atoi(argv[1]);
+
+  SerialSVD map(in, out, blocksize, rows_per_record);
+  if (argc > 2)
+    map.pipeline_depth_ = atoi(argv[2]);
+  if (argc > 3)
+    map.num_threads_ = atoi(argv[3]);
+  run_mapper(map);
+}
+
+// The final reduce of a least-squares solve, where the last nrhs columns
+// of the rows are the right-hand sides: lstsq nrhs [blocksize
+// rows_per_record pipeline_blocks threads].  The map and the other reduce
+// iterations are indirect TSQR.
+void handle_lstsq(int argc, char **argv) {
+  fprintf(stderr, "using TSQR least squares\n");
+  // create typed bytes files
+  TypedBytesInFile in(stdin);
+  TypedBytesOutFile out(stdout);
+
+  if (argc < 1) {
+    hadoop_error("usage is lstsq nrhs [blocksize ...]\n");
+  }
+  size_t nrhs = atoi(argv[0]);
+
+  size_t blocksize = 3;
+  if (argc > 1)
+    blocksize = atoi(argv[1]);
+
+  size_t rows_per_record = 1;
+  if (argc > 2)
+    rows_per_record = atoi(argv[2]);
+
+  SerialLstSq map(in, out, blocksize, rows_per_record, nrhs);
+  if (argc > 3)
+    map.pipeline_depth_ = atoi(argv[3]);
+  if (argc > 4)
+    map.num_threads_ = atoi(argv[4]);
+  run_mapper(map);
 }
 
 void handle_cholesky_AtA(int argc, char **argv) {
@@ -79,7 +279,10 @@ void handle_cholesky_AtA(int argc, char **argv) {
     rows_per_record = atoi(argv[1]);
 
   AtA map(in, out, blocksize, rows_per_record);
-  map.mapper();
+  // number of blocks to overlap decoding with syrk (0 to disable)
+  if (argc > 2)
+    map.pipeline_depth_ = atoi(argv[2]);
+  run_mapper(map);
 }
 
 void handle_cholesky_rowsum(int argc, char **argv) {
@@ -93,7 +296,7 @@ void handle_cholesky_rowsum(int argc, char **argv) {
     rows_per_record = atoi(argv[0]);
 
   RowSum map(in, out, rows_per_record);
-  map.mapper();
+  run_mapper(map);
 }
 
 void handle_cholesky_comp(int argc, char **argv) {
@@ -107,7 +310,273 @@ void handle_cholesky_comp(int argc, char **argv) {
     rows_per_record = atoi(argv[0]);
 
   Cholesky map(in, out, rows_per_record);
-  map.mapper();
+  run_mapper(map);
+}
+
+// Cholesky QR2 in two MapReduce passes:
+//   pass 1: cholqr2 1 [blocksize rows_per_record pipeline_blocks] (map)
+//           cholqr2 2 [rows_per_record] (reduce, R1)
+//   pass 2: cholqr2 3 ncols R1 [blocksize rows_per_record pipeline_blocks]
+//           cholqr2 4 ncols R1 [rows_per_record] (reduce, R = R2 R1)
+// R1 is the text dump of the pass 1 output.
+void handle_cholqr2(int argc, char **argv) {
+  fprintf(stderr, "using Cholesky QR2\n");
+  // create typed bytes files
+  TypedBytesInFile in(stdin);
+  TypedBytesOutFile out(stdout);
+
+  if (argc < 1) {
+    hadoop_error("missing stage!\n");
+  }
+  size_t stage = atoi(argv[0]);
+  ++argv;
+  --argc;
+
+  std::vector<double> R1;
+  if (stage == 3 || stage == 4) {
+    if (argc < 2) {
+      hadoop_error("usage is cholqr2 %zu ncols R1 ...\n", stage);
+    }
+    size_t ncols = atoi(argv[0]);
+    if (!read_text_R(argv[1], ncols, R1)) {
+      hadoop_error("could not read R1 from %s\n", argv[1]);
+    }
+    argv += 2;
+    argc -= 2;
+  }
+
+  if (stage == 1 || stage == 3) {
+    size_t blocksize = 3;
+    if (argc > 0)
+      blocksize = atoi(argv[0]);
+    size_t rows_per_record = 1;
+    if (argc > 1)
+      rows_per_record = atoi(argv[1]);
+    size_t pipeline_depth = 0;
+    if (argc > 2)
+      pipeline_depth = atoi(argv[2]);
+    if (stage == 1) {
+      AtA map(in, out, blocksize, rows_per_record);
+      map.pipeline_depth_ = pipeline_depth;
+      run_mapper(map);
+    } else {
+      CholQR2Map map(in, out, blocksize, rows_per_record, R1);
+      map.pipeline_depth_ = pipeline_depth;
+      run_mapper(map);
+    }
+  } else if (stage == 2 || stage == 4) {
+    size_t rows_per_record = 1;
+    if (argc > 0)
+      rows_per_record = atoi(argv[0]);
+    if (stage == 2) {
+      Cholesky map(in, out, rows_per_record);
+      run_mapper(map);
+    } else {
+      CholQR2Reduce map(in, out, rows_per_record, R1);
+      run_mapper(map);
+    }
+  } else {
+    hadoop_error("unknown stage %zu\n", stage);
+  }
+}
+
+// A * B for a small B, read from a text or .bin file (see
+// read_small_matrix): tsmatmul B [blocksize]
+void handle_tsmatmul(int argc, char **argv) {
+  fprintf(stderr, "using TSMatMul\n");
+  // create typed bytes files
+  TypedBytesInFile in(stdin);
+  TypedBytesOutFile out(stdout);
+
+  if (argc < 1) {
+    hadoop_error("usage is tsmatmul B [blocksize]\n");
+  }
+  std::vector<double> B;
+  size_t B_rows;
+  if (!read_small_matrix(argv[0], B, B_rows)) {
+    hadoop_error("could not read B from %s\n", argv[0]);
+  }
+  size_t blocksize = 3;
+  if (argc > 1)
+    blocksize = atoi(argv[1]);
+  TSMatMul map(in, out, blocksize, B, B_rows);
+  run_mapper(map);
+}
+
+// Read the ncols x ncols R from the text dump of the TSQR output, whose
+// keys are random, so the rows are taken in file order (or from a .bin
+// file, see read_small_matrix).  R is column-major.
+static void read_tsqr_R(const char *path, size_t ncols,
+                        std::vector<double>& R) {
+  std::vector<double> A;
+  size_t nrows;
+  if (!read_small_matrix(path, A, nrows)) {
+    hadoop_error("could not read R from %s\n", path);
+  }
+  if (A.size() != ncols * ncols) {
+    hadoop_error("%s is not a %zu x %zu R\n", path, ncols, ncols);
+  }
+  R.resize(ncols * ncols);
+  row_to_col_major(&A[0], &R[0], ncols, ncols);
+}
+
+// Q = A R^{-1} with (pseudo-)iterative refinement, as run_tsqr_ir.py:
+//   R1 from indirect TSQR of A
+//   arinv tsqr ncols R1 [blocksize rows_per_record pipeline_blocks threads]
+//     (map, R2 = the R of A R1^{-1}, with indirect TSQR as the reduce)
+//   arinv ncols R1 [R2 [blocksize]] (map only, Q = A R1^{-1} R2^{-1})
+// R1 and R2 are the text dumps of the TSQR output; R2 may be "-" to skip
+// the refinement.  The R of A is R2 R1.
+void handle_arinv(int argc, char **argv) {
+  fprintf(stderr, "using ARInv\n");
+  // create typed bytes files
+  TypedBytesInFile in(stdin);
+  TypedBytesOutFile out(stdout);
+
+  bool tsqr = argc > 0 && !strcmp(argv[0], "tsqr");
+  if (tsqr) {
+    ++argv;
+    --argc;
+  }
+  if (argc < 2) {
+    hadoop_error("usage is arinv [tsqr] ncols R1 ...\n");
+  }
+  size_t ncols = atoi(argv[0]);
+  std::vector<double> R1;
+  read_tsqr_R(argv[1], ncols, R1);
+  argv += 2;
+  argc -= 2;
+
+  if (tsqr) {
+    size_t blocksize = 3;
+    if (argc > 0)
+      blocksize = atoi(argv[0]);
+    size_t rows_per_record = 1;
+    if (argc > 1)
+      rows_per_record = atoi(argv[1]);
+    PremultTSQR map(in, out, blocksize, rows_per_record, R1);
+    if (argc > 2)
+      map.pipeline_depth_ = atoi(argv[2]);
+    if (argc > 3)
+      map.num_threads_ = atoi(argv[3]);
+    run_mapper(map);
+    return;
+  }
+
+  std::vector<double> R2;
+  if (argc > 0 && strcmp(argv[0], "-"))
+    read_tsqr_R(argv[0], ncols, R2);
+  size_t blocksize = 3;
+  if (argc > 1)
+    blocksize = atoi(argv[1]);
+  ARInv map(in, out, blocksize, R1, ncols, R2);
+  run_mapper(map);
+}
+
+// B^T A for two matrices with the same row keys:
+//   bta 1 B_id       (map, B is the input whose path contains B_id)
+//   bta 2 [blocksize] (reduce, partial sums of B^T A)
+// followed by rowsum (as the combiner and the reducer) to sum the
+// partial products when there is more than one reducer.
+void handle_bta(int argc, char **argv) {
+  fprintf(stderr, "using BtA\n");
+  // create typed bytes files
+  TypedBytesInFile in(stdin);
+  TypedBytesOutFile out(stdout);
+
+  if (argc < 1) {
+    hadoop_error("missing stage!\n");
+  }
+  size_t stage = atoi(argv[0]);
+  if (stage == 1) {
+    if (argc < 2) {
+      hadoop_error("usage is bta 1 B_id\n");
+    }
+    BtAMap map(in, out, argv[1]);
+    run_mapper(map);
+  } else if (stage == 2) {
+    size_t blocksize = 3;
+    if (argc > 1)
+      blocksize = atoi(argv[1]);
+    BtAReduce map(in, out, blocksize);
+    run_mapper(map);
+  } else {
+    hadoop_error("unknown stage %zu\n", stage);
+  }
+}
+
+// Blocked Householder QR, with the steps for each panel of b columns:
+//   householder 1 ncols b [panel W [blocksize]]  (map only)
+//   householder 2                                (reduce, the panel)
+//   householder 3 panel [blocksize]              (map, W), with rowsum
+// panel and W are the text dumps of the previous steps 2 and 3, or "-"
+// for the first panel.
+void handle_householder(int argc, char **argv) {
+  fprintf(stderr, "using Householder QR\n");
+  // create typed bytes files
+  TypedBytesInFile in(stdin);
+  TypedBytesOutFile out(stdout);
+
+  if (argc < 1) {
+    hadoop_error("missing stage!\n");
+  }
+  size_t stage = atoi(argv[0]);
+  if (stage == 1) {
+    if (argc < 3) {
+      hadoop_error("usage is householder 1 ncols b [panel W [blocksize]]\n");
+    }
+    size_t blocksize = 3;
+    if (argc > 5)
+      blocksize = atoi(argv[5]);
+    HouseholderMap map(in, out, blocksize, atoi(argv[1]), atoi(argv[2]));
+    if (argc > 3 && strcmp(argv[3], "-")) {
+      if (!map.load_panel(argv[3])) {
+        hadoop_error("could not read the panel from %s\n", argv[3]);
+      }
+      if (argc > 4 && strcmp(argv[4], "-") && !map.load_W(argv[4])) {
+        hadoop_error("could not read W from %s\n", argv[4]);
+      }
+    }
+    run_mapper(map);
+  } else if (stage == 2) {
+    HouseholderReduce map(in, out);
+    run_mapper(map);
+  } else if (stage == 3) {
+    if (argc < 2) {
+      hadoop_error("usage is householder 3 panel [blocksize]\n");
+    }
+    size_t blocksize = 3;
+    if (argc > 2)
+      blocksize = atoi(argv[2]);
+    HouseholderW map(in, out, blocksize);
+    if (!map.load_panel(argv[1])) {
+      hadoop_error("could not read the panel from %s\n", argv[1]);
+    }
+    run_mapper(map);
+  } else {
+    hadoop_error("unknown stage %zu\n", stage);
+  }
+}
+
+// Convert the typed bytes input into a matrix file, for --matrix and
+// local: convert path [row|col]
+void handle_convert(int argc, char **argv) {
+  fprintf(stderr, "converting to a matrix file\n");
+  // create typed bytes files
+  TypedBytesInFile in(stdin);
+  TypedBytesOutFile out(stdout);
+
+  if (argc < 1) {
+    hadoop_error("usage is convert path [row|col]\n");
+  }
+  MatrixFileLayout layout = MATRIX_FILE_ROW_MAJOR;
+  if (argc > 1 && !strcmp(argv[1], "col")) {
+    layout = MATRIX_FILE_COL_MAJOR;
+  } else if (argc > 1 && strcmp(argv[1], "row")) {
+    hadoop_error("unknown layout %s\n", argv[1]);
+  }
+  MatrixFileWriter map(in, out, argv[0], layout);
+  run_mapper(map);
 }
 
 int main(int argc, char **argv) {  
@@ -115,22 +584,45 @@ int main(int argc, char **argv) {
   unsigned long seed = sf_randseed();
   hadoop_message("seed = %u\n", seed);
 
+  if (argc > 2 && !strcmp(argv[1], "--matrix")) {
+    matrix_path = argv[2];
+    argv += 2;
+    argc -= 2;
+  }
+
   if (argc < 2) {
     fprintf(stderr, "ERROR: unknown TSQR type\n");
     return -1;
   }
 
-  // TODO(arbenson): Cholesky QR is broken
   if (!strcmp(argv[1], "direct")) {
     handle_direct_tsqr(argc - 2, argv + 2);
+  } else if (!strcmp(argv[1], "local")) {
+    handle_local_tsqr(argc - 2, argv + 2);
   } else if (!strcmp(argv[1], "indirect")) {
     handle_indirect_tsqr(argc - 2, argv + 2);
+  } else if (!strcmp(argv[1], "svd")) {
+    handle_svd(argc - 2, argv + 2);
+  } else if (!strcmp(argv[1], "lstsq")) {
+    handle_lstsq(argc - 2, argv + 2);
   } else if (!strcmp(argv[1], "ata")) {
     handle_cholesky_AtA(argc - 2, argv + 2);
   } else if (!strcmp(argv[1], "rowsum")) {
     handle_cholesky_rowsum(argc - 2, argv + 2);
   } else if (!strcmp(argv[1], "cholesky")) {
     handle_cholesky_comp(argc - 2, argv + 2);
+  } else if (!strcmp(argv[1], "cholqr2")) {
+    handle_cholqr2(argc - 2, argv + 2);
+  } else if (!strcmp(argv[1], "tsmatmul")) {
+    handle_tsmatmul(argc - 2, argv + 2);
+  } else if (!strcmp(argv[1], "arinv")) {
+    handle_arinv(argc - 2, argv + 2);
+  } else if (!strcmp(argv[1], "bta")) {
+    handle_bta(argc - 2, argv + 2);
+  } else if (!strcmp(argv[1], "convert")) {
+    handle_convert(argc - 2, argv + 2);
+  } else if (!strcmp(argv[1], "householder")) {
+    handle_householder(argc - 2, argv + 2);
   } else {
     fprintf(stderr, "unknown method!\n");
     return -1;
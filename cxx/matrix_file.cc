@@ -0,0 +1,170 @@
+/**
+   Copyright (c) 2012-2014, Austin Benson and David Gleich
+   All rights reserved.
+
+   This file is part of MRTSQR and is under the BSD 2-Clause License,
+   which can be found in the LICENSE file in the root directory, or at
+   http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "tsqr_util.h"
+
+// the entries start on a cache line
+#define MATRIX_FILE_DATA_OFFSET 64
+
+bool write_matrix_file(const std::string& path, const double *A,
+                       size_t nrows, size_t ncols, MatrixFileLayout layout) {
+  MatrixFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MATRIX_FILE_MAGIC, sizeof(header.magic));
+  header.num_rows = nrows;
+  header.num_cols = ncols;
+  header.dtype = MATRIX_FILE_FLOAT64;
+  header.layout = layout;
+  header.data_offset = MATRIX_FILE_DATA_OFFSET;
+
+  FILE *f = fopen(path.c_str(), "wb");
+  if (!f) {
+    return false;
+  }
+  static const char padding[MATRIX_FILE_DATA_OFFSET] = {0};
+  bool success = fwrite(&header, sizeof(header), 1, f) == 1 &&
+    fwrite(padding, 1, MATRIX_FILE_DATA_OFFSET - sizeof(header), f) ==
+    MATRIX_FILE_DATA_OFFSET - sizeof(header);
+  if (layout == MATRIX_FILE_ROW_MAJOR || nrows * ncols == 0) {
+    success = success &&
+      fwrite(A, sizeof(double), nrows * ncols, f) == nrows * ncols;
+  } else {
+    // a column at a time
+    std::vector<double> col(nrows);
+    for (size_t j = 0; j < ncols && success; ++j) {
+      for (size_t i = 0; i < nrows; ++i) {
+        col[i] = A[i * ncols + j];
+      }
+      success = fwrite(&col[0], sizeof(double), nrows, f) == nrows;
+    }
+  }
+  return fclose(f) == 0 && success;
+}
+
+bool MatrixFile::open(const std::string& path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(MatrixFileHeader)) {
+    close(fd);
+    return false;
+  }
+  void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  data_ = (unsigned char *) data;
+  size_ = (size_t) st.st_size;
+  header_ = (const MatrixFileHeader *) data_;
+  size_t entry_size = header_->dtype == MATRIX_FILE_FLOAT32 ?
+    sizeof(float) : sizeof(double);
+  if (memcmp(header_->magic, MATRIX_FILE_MAGIC, sizeof(header_->magic)) != 0 ||
+      header_->dtype > MATRIX_FILE_FLOAT32 ||
+      header_->layout > MATRIX_FILE_COL_MAJOR ||
+      header_->data_offset % entry_size != 0 ||
+      header_->data_offset > size_ ||
+      (size_ - header_->data_offset) / entry_size / std::max(
+        header_->num_cols, (uint64_t) 1) < header_->num_rows) {
+    munmap(data_, size_);
+    data_ = NULL;
+    header_ = NULL;
+    return false;
+  }
+  madvise(data_, size_, MADV_SEQUENTIAL);
+  return true;
+}
+
+MatrixFile::~MatrixFile() {
+  if (data_ != NULL) {
+    munmap(data_, size_);
+  }
+}
+
+const unsigned char *MatrixFile::entry(size_t i, size_t j) const {
+  size_t index = header_->layout == MATRIX_FILE_ROW_MAJOR ?
+    i * num_cols() + j : i + j * num_rows();
+  size_t entry_size = header_->dtype == MATRIX_FILE_FLOAT32 ?
+    sizeof(float) : sizeof(double);
+  return data_ + header_->data_offset + index * entry_size;
+}
+
+void MatrixFile::will_need(size_t first, size_t nrows) const {
+  nrows = std::min(nrows, num_rows() - std::min(first, num_rows()));
+  if (nrows == 0 || num_cols() == 0) {
+    return;
+  }
+  size_t page = (size_t) sysconf(_SC_PAGESIZE);
+  // the rows are one range in a row-major file, and one per column in a
+  // column-major file
+  size_t nranges = header_->layout == MATRIX_FILE_ROW_MAJOR ? 1 : num_cols();
+  for (size_t j = 0; j < nranges; ++j) {
+    const unsigned char *begin = entry(first, j);
+    const unsigned char *end = header_->layout == MATRIX_FILE_ROW_MAJOR ?
+      entry(first + nrows - 1, num_cols() - 1) : entry(first + nrows - 1, j);
+    size_t offset = (size_t) (begin - data_) / page * page;
+    madvise(data_ + offset, (size_t) (end - data_) - offset + 1,
+            MADV_WILLNEED);
+  }
+}
+
+void MatrixFile::read_block(size_t first, size_t nrows, double *dst,
+                            size_t ld) const {
+  will_need(first + nrows, nrows);
+  size_t ncols = num_cols();
+  if (header_->dtype == MATRIX_FILE_FLOAT64) {
+    if (header_->layout == MATRIX_FILE_COL_MAJOR) {
+      for (size_t j = 0; j < ncols; ++j) {
+        memcpy(dst + j * ld, entry(first, j), nrows * sizeof(double));
+      }
+    } else {
+      // the row-major rows are the column-major ncols x nrows transpose
+      transpose((const double *) entry(first, 0), ncols, dst, ld, ncols,
+                nrows);
+    }
+    return;
+  }
+  for (size_t j = 0; j < ncols; ++j) {
+    for (size_t i = 0; i < nrows; ++i) {
+      dst[i + j * ld] = *(const float *) entry(first + i, j);
+    }
+  }
+}
+
+void MatrixFile::read_rows(size_t first, size_t nrows, double *dst) const {
+  will_need(first + nrows, nrows);
+  size_t ncols = num_cols();
+  if (header_->dtype == MATRIX_FILE_FLOAT64) {
+    if (header_->layout == MATRIX_FILE_ROW_MAJOR) {
+      memcpy(dst, entry(first, 0), nrows * ncols * sizeof(double));
+    } else {
+      transpose((const double *) entry(first, 0), num_rows(), dst, ncols,
+                nrows, ncols);
+    }
+    return;
+  }
+  for (size_t i = 0; i < nrows; ++i) {
+    for (size_t j = 0; j < ncols; ++j) {
+      dst[i * ncols + j] = *(const float *) entry(first + i, j);
+    }
+  }
+}
@@ -10,33 +10,87 @@
 #ifndef MRTSQR_CXX_MRMC_H_
 #define MRTSQR_CXX_MRMC_H_
 
+#include "small_kernels.h"
 #include "typedbytes.h"
 #include "tsqr_util.h"
 
 #include <algorithm>
+#include <atomic>
 #include <list>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include <stdint.h>
 #include <time.h>
 
+// A lock-free single-producer/single-consumer ring of matrix blocks.
+// The producer fills a free block and pushes it; the consumer takes full
+// blocks in order and pops them once it is done with them.
+class BlockRing {
+public:
+  BlockRing(size_t num_blocks, size_t block_size)
+    : blocks_(num_blocks, std::vector<double>(block_size)),
+      block_rows_(num_blocks, 0), head_(0), tail_(0), done_(false) {}
+
+  // Producer: wait for a free block.
+  double *next_free();
+  // Producer: publish the block from next_free with nrows rows.
+  void push(size_t nrows);
+  // Producer: there are no more blocks.
+  void finish() { done_.store(true, std::memory_order_release); }
+
+  // Consumer: wait for a full block.  Returns NULL once the producer
+  // has finished and every block has been consumed.
+  double *next_full(size_t *nrows);
+  // Consumer: release the block from next_full.
+  void pop() { tail_.store(tail_.load() + 1, std::memory_order_release); }
+
+private:
+  std::vector<std::vector<double>> blocks_;
+  std::vector<size_t> block_rows_;
+  std::atomic<size_t> head_;  // number of blocks pushed
+  std::atomic<size_t> tail_;  // number of blocks popped
+  std::atomic<bool> done_;
+};
+
 class MatrixHandler {
 public:
   MatrixHandler(TypedBytesInFile& in, TypedBytesOutFile& out,
                 size_t blocksize, size_t rows_per_record)
     : in_(in), out_(out),
       blocksize_(blocksize), rows_per_record_(rows_per_record),
-      num_cols_(0), num_rows_(0), num_total_rows_(0) {}
+      num_cols_(0), num_rows_(0), num_local_rows_(0), num_total_rows_(0),
+      decode_in_place_(false), pipeline_depth_(0), num_threads_(1),
+      kernels_(NULL) {}
 
   ~MatrixHandler() {}
 
   void read_full_row(std::vector<double>& row);
 
+  // Decode the next row and store it at dst[0], dst[stride], ...
+  void read_row(double *dst, size_t stride);
+
+  // Decode the next row straight into the next free row of
+  // local_matrix_, without an intermediate row vector.
+  virtual void read_local_row();
+
   bool read_key_val_pair(typedbytes_opaque& key,
                          std::vector<double>& value);
 
   virtual void mapper();
+
+  // Decode rows into rings of pipeline_depth_ blocks on this thread
+  // while num_threads_ compute threads run compress_block on the full
+  // blocks.  Blocks are dealt out to the threads in turn.
+  void pipelined_mapper();
+
+  // mapper() for a matrix file instead of the input stream: the compute
+  // threads copy blocks of rows straight from the file and run
+  // compress_block on them, as in pipelined mode.  Only for handlers that
+  // set decode_in_place_.
+  virtual void file_mapper(const MatrixFile& file);
     
   // Allocate the local matrix and set to zero
   virtual void alloc(size_t num_rows, size_t num_cols);
@@ -51,6 +105,33 @@ public:
   virtual void collect(typedbytes_opaque& key, std::vector<double>& value) = 0;
   virtual void output() = 0;
 
+  // Called by mapper() after read_local_row() has stored a row.  Only
+  // used by handlers that set decode_in_place_.
+  virtual void collect_local_row() {}
+
+  // Pipelined mode: each block is num_rows_ x num_cols_ (column-major)
+  // and the decoder leaves the top pipeline_reserved_rows() rows free.
+  virtual size_t pipeline_reserved_rows() { return 0; }
+  // Pipelined mode: process the nrows new rows of a block on compute
+  // thread number thread.  With one thread, it owns local_matrix_ until
+  // the pipeline ends; with more, each thread must keep its own state.
+  virtual void compress_block(double *block, size_t nrows, size_t thread) {}
+
+  // Write the key (file, i), which sends the pair to the output file
+  // named file of a job with several output files.
+  void write_file_key(const std::string& file, int i);
+  void write_file_key(const std::string& file, const std::string& key);
+
+  // Write a key read with read_opaque back out as the same key.
+  // Strings and byte sequences lose their length in the opaque form;
+  // other non-primitive keys go out as the bytes of their opaque form.
+  void write_key(const unsigned char *key, size_t size);
+
+  // Compute the SVD R = U S V^T of the num_cols_ x num_cols_
+  // column-major R (destroyed) and write the rows of U, the singular
+  // values and the rows of V to the files U, Sigma and V.
+  void output_svd(double *R);
+
   // add time (given in seconds) to the Hadoop counter
   void incr_lapack_time(double time) {
     hadoop_counter("lapack time (millisecs)", (int) (time * 1000.));
@@ -65,30 +146,156 @@ public:
   size_t num_rows_;        // the maximum number of rows of the local matrix
   size_t num_local_rows_;  // the current number of local rows
   size_t num_total_rows_;  // the total number of rows processed
+
+  // ignore the keys and decode rows with read_local_row
+  bool decode_in_place_;
+  // number of blocks in the decode/compute pipeline (< 2 to disable)
+  size_t pipeline_depth_;
+  // number of compute threads in the pipeline
+  size_t num_threads_;
     
   std::vector<double> local_matrix_;
+
+  // LAPACK workspace for the factorizations on the calling thread
+  LapackContext lapack_;
+  // kernels specialized for num_cols_, if any (set once it is known)
+  const SmallKernels *kernels_;
+};
+
+// Convert the typed bytes input to a matrix file (see MatrixFile).  The
+// rows are kept in order, without their keys.
+class MatrixFileWriter : public MatrixHandler {
+public:
+  MatrixFileWriter(TypedBytesInFile& in, TypedBytesOutFile& out,
+                   const std::string& path, MatrixFileLayout layout)
+    : MatrixHandler(in, out, -1, 1), path_(path), layout_(layout) {}
+
+  void first_row();
+  void collect(typedbytes_opaque& key, std::vector<double>& value);
+  void output();
+
+private:
+  std::string path_;
+  MatrixFileLayout layout_;
+  // row-major
+  std::vector<double> rows_;
 };
 
 class SerialTSQR : public MatrixHandler {
 public:
   SerialTSQR(TypedBytesInFile& in, TypedBytesOutFile& out,
              size_t blocksize, size_t rows_per_record)
-    : MatrixHandler(in, out, blocksize, rows_per_record) {}
+    : MatrixHandler(in, out, blocksize, rows_per_record), R_on_top_(false),
+      first_new_row_(0) {
+    decode_in_place_ = true;
+  }
   virtual ~SerialTSQR() {}
 
   void collect(typedbytes_opaque& key, std::vector<double>& value);
+  void collect_local_row();
   // compress the local QR factorization
   void compress();
+  // also allocate an R for each compute thread
+  void alloc(size_t num_rows, size_t num_cols);
+  // room to stack a partial R on top of each pipeline block
+  size_t pipeline_reserved_rows() { return num_cols_; }
+  void compress_block(double *block, size_t nrows, size_t thread);
   // Output the matrix with random keys for the rows.
   void output();
+
+protected:
+  // Fold the compute threads' R and any remaining rows into the R at
+  // the top of local_matrix_ (num_local_rows_ rows).
+  void compress_all();
+  // Called on each block of input rows before they are factored.  The
+  // urows rows of A are column-major with leading dimension lda.  May be
+  // called from the compute threads.
+  virtual void transform_rows(double *A, size_t lda, size_t urows) {}
+
+private:
+  // Combine the compute threads' R factors with a binary reduction
+  // tree.  The result is in thread_R_[0].
+  void merge_thread_R();
+  // lapack_tpqr, or the specialized kernel for num_cols_
+  bool tpqr(double *R, size_t ldr, double *B, size_t ldb, size_t urows,
+            size_t ltri, LapackContext& ctx);
+
+  // transform_rows on the rows of local_matrix_ from first_new_row_
+  void transform_new_rows();
+
+  // whether the top num_cols_ rows of local_matrix_ are an R factor
+  bool R_on_top_;
+  // the rows of local_matrix_ before this one are R or transformed
+  size_t first_new_row_;
+
+  // The running R of each compute thread (num_cols_ x num_cols_,
+  // column-major) and its number of rows.
+  std::vector<std::vector<double>> thread_R_;
+  std::vector<size_t> thread_R_rows_;
+  // the LAPACK workspace of each compute thread
+  std::vector<LapackContext> thread_lapack_;
 };
 
+// The final reduce of a tall-and-skinny SVD: the R of SerialTSQR goes
+// through lapack_svd, and the output is U_R, Sigma and V, with
+// A = (Q U_R) Sigma V^T.
+class SerialSVD : public SerialTSQR {
+public:
+  SerialSVD(TypedBytesInFile& in, TypedBytesOutFile& out,
+            size_t blocksize, size_t rows_per_record)
+    : SerialTSQR(in, out, blocksize, rows_per_record) {}
+
+  void output();
+};
+
+// The final reduce of a least-squares solve of A X = B in one pass: the
+// rows are [A B], with the nrhs columns of B last, and the map and the
+// other reduce iterations are indirect TSQR.  The R of [A B] is
+// [R Q^T B; 0 S], so its top rows are [R | Q^T B] and X = R^{-1} Q^T B.
+// The output is the rows of X and the residual norms, the column norms
+// of S.
+class SerialLstSq : public SerialTSQR {
+public:
+  SerialLstSq(TypedBytesInFile& in, TypedBytesOutFile& out,
+              size_t blocksize, size_t rows_per_record, size_t nrhs)
+    : SerialTSQR(in, out, blocksize, rows_per_record), nrhs_(nrhs) {}
+
+  void output();
+
+private:
+  size_t nrhs_;
+};
+
+// The map of the refinement pass of indirect TSQR with (pseudo-)
+// iterative refinement: the R of A R1^{-1}, where R1 is the R of A.
+// The reduce is plain indirect TSQR.
+class PremultTSQR : public SerialTSQR {
+public:
+  PremultTSQR(TypedBytesInFile& in, TypedBytesOutFile& out,
+              size_t blocksize, size_t rows_per_record,
+              const std::vector<double>& R1)
+    : SerialTSQR(in, out, blocksize, rows_per_record), R1_(R1) {}
+
+protected:
+  void transform_rows(double *A, size_t lda, size_t urows);
+
+private:
+  std::vector<double> R1_;  // column-major
+};
+
+// AtA uses gram_update on tiles of GRAM_TILE_ROWS rows, instead of
+// dsyrk on blocks, for matrices with at most GRAM_KERNEL_MAX_COLS columns
+// or with a specialized Gram kernel.
+#define GRAM_KERNEL_MAX_COLS 64
+#define GRAM_TILE_ROWS 32
+
 class AtA : public MatrixHandler {
 public:
   AtA(TypedBytesInFile& in, TypedBytesOutFile& out,
       size_t blocksize, size_t rows_per_record)
-    : MatrixHandler(in, out, blocksize, rows_per_record) {
+    : MatrixHandler(in, out, blocksize, rows_per_record), tile_rows_(0) {
     local_AtA_ = NULL;
+    decode_in_place_ = true;
   }
 
   // Call syrk and store the result in local AtA computation
@@ -96,11 +303,37 @@ public:
   // Output the matrix with key equal to row number
   void output();
   void collect(typedbytes_opaque& key, std::vector<double>& value);
+  // with the Gram kernel, decode into tile_ instead of local_matrix_
+  void read_local_row();
+  void collect_local_row();
+  void compress_block(double *block, size_t nrows, size_t thread);
+
+protected:
+  // Called on each block of rows before it is added to the Gram
+  // matrix.  The urows rows of A are column-major with leading
+  // dimension lda, or row-major when row_major is set.
+  virtual void transform_rows(double *A, size_t lda, size_t urows,
+                              bool row_major) {}
   
 private:
+  // whether the rows decoded in place go through gram_update.  Records
+  // of several rows go through collect into local_matrix_ instead.
+  bool use_gram_kernel() const {
+    return pipeline_depth_ < 2 && rows_per_record_ == 1 &&
+      (num_cols_ <= GRAM_KERNEL_MAX_COLS ||
+       (kernels_ != NULL && kernels_->gram_update != NULL));
+  }
+  // add the rows in tile_ to local_AtA_
+  void compress_tile();
+
   double *local_AtA_;
+  // up to GRAM_TILE_ROWS decoded rows, row-major
+  std::vector<double> tile_;
+  size_t tile_rows_;
 };
 
+// Sum the rows with the same nonnegative integer key.  The number of
+// keys need not match the row length, though Cholesky needs it to.
 class RowSum : public MatrixHandler {
 public:
   RowSum(TypedBytesInFile& in, TypedBytesOutFile& out,
@@ -127,8 +360,132 @@ public:
 
   // Computes Cholesky decomposition and outputs R
   void output();
+
+protected:
+  // Sum the rows into L and factor it, so that L holds R^T (column-major)
+  void factor(std::vector<double>& L);
 };
 
+// Second pass of Cholesky QR2: the Gram matrix of A R1^{-1}, where R1
+// is the R from a first Cholesky QR pass.
+class CholQR2Map : public AtA {
+public:
+  CholQR2Map(TypedBytesInFile& in, TypedBytesOutFile& out,
+             size_t blocksize, size_t rows_per_record,
+             const std::vector<double>& R1)
+    : AtA(in, out, blocksize, rows_per_record), R1_(R1) {}
+
+protected:
+  void transform_rows(double *A, size_t lda, size_t urows, bool row_major);
+
+private:
+  std::vector<double> R1_;  // column-major
+};
+
+// Final reduce of Cholesky QR2: factor the summed Gram matrix of
+// A R1^{-1} as R2^T R2 and output R = R2 R1.
+class CholQR2Reduce : public Cholesky {
+public:
+  CholQR2Reduce(TypedBytesInFile& in, TypedBytesOutFile& out,
+                size_t rows_per_record, const std::vector<double>& R1)
+    : Cholesky(in, out, rows_per_record), R1_(R1) {}
+
+  void output();
+
+private:
+  std::vector<double> R1_;  // column-major
+};
+
+// Read the text dump of a matrix output one row per key, such as the R
+// of Cholesky, into the column-major A (num_rows x num_cols).  Returns
+// false if the file cannot be opened.
+bool read_text_matrix(const std::string& path, size_t num_rows,
+                      size_t num_cols, std::vector<double>& A);
+
+// read_text_matrix for a square R
+bool read_text_R(const std::string& path, size_t num_cols,
+                 std::vector<double>& R);
+
+// Contiguous storage for the keys seen by a direct TSQR task.  Keys are
+// kept back to back in the serialized form that DirTSQRMap1 emits
+// ("<length>\0<key bytes>" for each key), so the whole store can be
+// written out with a single write_byte_sequence.
+class KeyArena {
+public:
+  void push_back(const unsigned char *key, size_t size);
+
+  size_t size() const { return offsets_.size(); }
+  const unsigned char *key(size_t i) const { return &bytes_[offsets_[i]]; }
+  size_t key_size(size_t i) const { return sizes_[i]; }
+
+  // the serialized keys
+  unsigned char *data() { return bytes_.empty() ? NULL : &bytes_[0]; }
+  size_t num_bytes() const { return bytes_.size(); }
+
+  void clear() { bytes_.clear(); offsets_.clear(); sizes_.clear(); }
+
+private:
+  std::vector<unsigned char> bytes_;
+  std::vector<size_t> offsets_;  // where each key's bytes start in bytes_
+  std::vector<size_t> sizes_;
+};
+
+// A binary copy of the Q2 factors from direct TSQR stage 2, indexed by
+// key so that stage 3 only touches the blocks it needs.  The file is
+//   Q2FileHeader
+//   num_keys Q2FileEntry records, sorted by key
+//   the key bytes
+//   the ncols x ncols column-major Q2 blocks
+// Offsets are in bytes from the start of the file.
+#define Q2_FILE_MAGIC "MRTSQRQ2"
+
+struct Q2FileHeader {
+  char magic[8];
+  uint64_t num_cols;
+  uint64_t num_keys;
+};
+
+struct Q2FileEntry {
+  uint64_t key_offset;
+  uint64_t key_size;
+  uint64_t data_offset;
+};
+
+// Write the Q2 blocks (ncols x ncols, column-major, one per key in the
+// order of keys) to a binary Q2 file.
+bool write_Q2_file(const std::string& path, const KeyArena& keys,
+                   const double *Q2, size_t num_cols);
+
+// Convert the text dump of the stage 2 output into a binary Q2 file.
+bool convert_text_Q2_file(const std::string& text_path,
+                          const std::string& path, size_t num_cols);
+
+// Read-only, memory-mapped view of a binary Q2 file.
+class Q2File {
+public:
+  Q2File() : data_(NULL), size_(0), header_(NULL), index_(NULL) {}
+  ~Q2File();
+
+  // Returns false if path is not a binary Q2 file.
+  bool open(const std::string& path);
+
+  size_t num_cols() const { return (size_t) header_->num_cols; }
+
+  // Look up the Q2 block for a key.  Returns NULL if the key is missing.
+  const double *find(const unsigned char *key, size_t size) const;
+
+private:
+  // Check that the index and every key and block fit in the file.
+  bool check_index() const;
+
+  unsigned char *data_;
+  size_t size_;
+  const Q2FileHeader *header_;
+  const Q2FileEntry *index_;
+};
+
+// Direct TSQR stage 1.  Emits R (row-major) and the pair (Q, keys), where
+// Q is the row-major local Q factor and keys are the serialized row keys.
 class DirTSQRMap1 : public MatrixHandler {
 public:
   DirTSQRMap1(TypedBytesInFile& in, TypedBytesOutFile& out,
@@ -139,22 +496,26 @@ public:
   }
   virtual ~DirTSQRMap1() {}
 
-  std::string pseudo_uuid();
+  static std::string pseudo_uuid();
   void first_row();
+  // the rows of the matrix file, with their row numbers as the keys
+  void file_mapper(const MatrixFile& file);
   void collect(typedbytes_opaque& key, std::vector<double>& value);
   void output();
 
 private:
   std::string mapper_id_;
-  std::list<typedbytes_opaque> keys_;
+  KeyArena keys_;
   std::vector<double> row_accumulator_;
 };
 
 class DirTSQRReduce2: public MatrixHandler {
 public:
   DirTSQRReduce2(TypedBytesInFile& in, TypedBytesOutFile& out,
-                  size_t rows_per_record, size_t num_cols)
-    : MatrixHandler(in, out, -1, rows_per_record) {
+                  size_t rows_per_record, size_t num_cols,
+                  const std::string& Q2_path="", bool svd=false)
+    : MatrixHandler(in, out, -1, rows_per_record), Q2_path_(Q2_path),
+      svd_(svd) {
     num_cols_ = num_cols;
   }
 
@@ -166,17 +527,113 @@ public:
 
 private:
   std::vector<double> row_accumulator_;
-  std::list<typedbytes_opaque> keys_;
+  KeyArena keys_;
+  // if set, write Q2 to this binary file instead of the output stream
+  std::string Q2_path_;
+  // also output the SVD of R (see output_svd)
+  bool svd_;
+};
+
+// Direct TSQR on one node, without Hadoop: the rows are read into
+// memory and split into num_parts row partitions.  num_threads_ threads
+// factor the partitions (stage 1, as DirTSQRMap1), the stacked R factors
+// are factored in memory (stage 2, as DirTSQRReduce2), and the threads
+// multiply each Q1 by its Q2 block in place (stage 3, as DirTSQRMap3).
+// The output is the rows of Q with their keys, and the rows of R go to a
+// text dump at R_path.
+class DirTSQRLocal : public MatrixHandler {
+public:
+  DirTSQRLocal(TypedBytesInFile& in, TypedBytesOutFile& out,
+               size_t num_threads, size_t num_parts,
+               const std::string& R_path)
+    : MatrixHandler(in, out, -1, 1), num_parts_(num_parts),
+      R_path_(R_path) {
+    num_threads_ = num_threads;
+  }
+
+  void mapper();
+  // the rows of the matrix file, with their row numbers as the keys
+  void file_mapper(const MatrixFile& file);
+  void collect(typedbytes_opaque& key, std::vector<double>& value) {}
+  void output();
+
+private:
+  // Run f(part, thread) for each partition on num_threads_ threads.
+  template <typename F> void for_each_part(F f);
+
+  size_t num_parts_;
+  std::string R_path_;
+  // the first row of each partition, and the end
+  std::vector<size_t> part_rows_;
+  // row-major, then Q1, then Q
+  std::vector<double> row_accumulator_;
+  KeyArena keys_;
 };
 
+// Recursive direct TSQR, for when the R factors of all the stage 1
+// mappers do not fit on one reducer.  Each extra level of stage 2 hashes
+// its R factors into groups (DirTSQRGroupMap), and factors each group on
+// its own (DirTSQRReduceLevel).  That gives the Q2 blocks of the group's
+// keys and one R per group, which is the input of the next level.  The
+// last level is DirTSQRReduce2, and DirTSQRMap3 multiplies the Q2 blocks
+// along the path of each key (see DirTSQRMap3::add_level).
+
+// The group of the key at the given level, one of num_groups
+std::string direct_tsqr_group(size_t level, const unsigned char *key,
+                              size_t size, size_t num_groups);
+
+// Map the R factors (key, R) to (group, (key, R)).
+class DirTSQRGroupMap : public MatrixHandler {
+public:
+  DirTSQRGroupMap(TypedBytesInFile& in, TypedBytesOutFile& out,
+                  size_t level, size_t num_groups)
+    : MatrixHandler(in, out, -1, 1), level_(level),
+      num_groups_(num_groups) {}
+
+  void mapper();
+  void collect(typedbytes_opaque& key, std::vector<double>& value) {}
+  void output() {}
+
+private:
+  size_t level_;
+  size_t num_groups_;
+};
+
+// Factor the R factors of each group, which arrive sorted by group.
+// Emits the R of each group as DirTSQRMap1 does, and the Q2 blocks of
+// its keys as DirTSQRReduce2 does.
+class DirTSQRReduceLevel : public MatrixHandler {
+public:
+  DirTSQRReduceLevel(TypedBytesInFile& in, TypedBytesOutFile& out,
+                     size_t num_cols)
+    : MatrixHandler(in, out, -1, 1) {
+    num_cols_ = num_cols;
+  }
+
+  void mapper();
+  void collect(typedbytes_opaque& key, std::vector<double>& value) {}
+  void output() {}
+
+private:
+  void output_group(const std::string& group);
+
+  std::vector<double> row_accumulator_;
+  KeyArena keys_;
+};
+
+// the number of rows of Q1 * Q2 that DirTSQRMap3 forms at a time
+#define MAP3_CHUNK_ROWS 1024
+
 class DirTSQRMap3: public MatrixHandler {
 public:
   DirTSQRMap3(TypedBytesInFile& in, TypedBytesOutFile& out,
-               size_t rows_per_record, size_t num_cols)
-    : MatrixHandler(in, out, -1, rows_per_record_) {
+               size_t rows_per_record, size_t num_cols,
+               const std::string& Q2_path="Q2.txt.out",
+               size_t max_blocks=0,
+               const std::vector<double>& U=std::vector<double>())
+    : MatrixHandler(in, out, -1, rows_per_record), Q2_path_(Q2_path),
+      Q2_binary_(false), max_blocks_(max_blocks), U_(U) {
     num_cols_ = num_cols;
-    // TODO(arbenson): make the Q2 path a constructor argument
-    Q2_path_ = "Q2.txt.out";
   }
 
   bool read_key_val_pair(typedbytes_opaque& key,
@@ -188,12 +645,274 @@ public:
   void output();
   void collect(typedbytes_opaque& key, std::vector<double>& value) {}
 
+  // Add the binary Q2 file of the next level up of a recursive stage 2,
+  // whose keys are the groups that the level below hashed its keys into.
+  // Each Q2 block is then the product of the blocks along its path.
+  bool add_level(const std::string& path, size_t num_groups);
+
 private:
   std::map<std::string, std::vector<double>> Q_matrices_;
   std::map<std::string, std::list<typedbytes_opaque>> keys_;
   std::string Q2_path_;
+  Q2File Q2_file_;
+  // a chunk of rows of Q1 * Q2
+  std::vector<double> product_;
+  bool Q2_binary_;
+  // If nonzero, multiply and emit the Q1 blocks while reading instead of
+  // at the end, holding at most this many Q1 blocks in memory.
+  size_t max_blocks_;
+  // If set, the U_R of the SVD of R (column-major), and the output is the
+  // left singular vectors Q1 * Q2 * U_R instead of Q.
+  std::vector<double> U_;
+  std::vector<double> Q2U_;
+  // the Q2 files of the levels above, and the number of groups of the
+  // level below each one
+  std::vector<std::unique_ptr<Q2File>> levels_;
+  std::vector<size_t> level_groups_;
+  // the products along the path, computed in turn
+  std::vector<double> path_Q2_[2];
+
+  // read Q2 from the text dump of the stage 2 output
+  void output_text_Q2();
+  void handle_matmul(const std::string& key, const double *Q2);
+};
+
+// A * B for a tall A and a small B, the C++ version of mrmc.TSMatMul.
+// The rows of A are decoded straight into column-major blocks, each
+// block is multiplied with one dgemm, and each row of the product goes
+// out under the key of the row of A as a byte sequence.
+class TSMatMul : public MatrixHandler {
+public:
+  // B is row-major with B_rows rows, or 0 if B_rows should be the
+  // number of columns of A (see read_small_matrix).
+  TSMatMul(TypedBytesInFile& in, TypedBytesOutFile& out, size_t blocksize,
+           const std::vector<double>& B, size_t B_rows)
+    : MatrixHandler(in, out, blocksize, 1), B_(B), B_rows_(B_rows),
+      out_cols_(0) {}
+  virtual ~TSMatMul() {}
+
+  void mapper();
+  void first_row();
+  void collect(typedbytes_opaque& key, std::vector<double>& value) {}
+  void output();
+
+protected:
+  // Check B against num_cols_ and set out_cols_.
+  virtual void setup();
+  // Store the product of the local rows in product_ (row-major).
+  virtual void multiply_block();
+  // multiply and write out the local rows
+  void compress();
+
+  std::vector<double> B_;
+  size_t B_rows_;
+  // the number of columns of the product
+  size_t out_cols_;
+  KeyArena keys_;
+  std::vector<double> product_;
+};
+
+// Q = A R^{-1}, or (A R^{-1}) R2^{-1} after a refinement pass with
+// PremultTSQR, the C++ version of dumbo/ARInv.py.  Each block of rows is
+// solved in place with dtrsm, so R is never inverted.
+class ARInv : public TSMatMul {
+public:
+  // R and R2 are column-major and upper triangular; R2 may be empty.
+  ARInv(TypedBytesInFile& in, TypedBytesOutFile& out, size_t blocksize,
+        const std::vector<double>& R, size_t ncols,
+        const std::vector<double>& R2)
+    : TSMatMul(in, out, blocksize, R, ncols), R2_(R2) {}
+
+protected:
+  void setup();
+  void multiply_block();
+
+private:
+  std::vector<double> R2_;
+};
+
+// B^T A for two tall matrices whose rows share keys, the C++ version of
+// dumbo/BtA.py.  BtAMap tags each row with the matrix it came from, and
+// BtAReduce joins the rows by key and accumulates B^T A with dgemm on
+// blocks of rows.  The partial products of the reducers are summed with
+// RowSum, which can also be the combiner of that job.
+class BtAMap : public MatrixHandler {
+public:
+  // The rows are from B if the input file name contains B_id.
+  BtAMap(TypedBytesInFile& in, TypedBytesOutFile& out,
+         const std::string& B_id)
+    : MatrixHandler(in, out, 1, 1), B_id_(B_id) {}
+
+  void mapper();
+  void collect(typedbytes_opaque& key, std::vector<double>& value) {}
+  void output() {}
+
+private:
+  std::string B_id_;
+};
+
+class BtAReduce : public MatrixHandler {
+public:
+  BtAReduce(TypedBytesInFile& in, TypedBytesOutFile& out, size_t blocksize)
+    : MatrixHandler(in, out, blocksize, 1), num_B_cols_(0),
+      num_B_rows_(0), key_first_row_(0) {}
+
+  void mapper();
+  void collect(typedbytes_opaque& key, std::vector<double>& value) {}
+  // write the rows of B^T A, with keys 0, ..., n_B - 1
+  void output();
+
+private:
+  // Read a (tag, row) value into row; true if it is a row of B.
+  bool read_tagged_row(std::vector<double>& row);
+  // Append a row of A or B to its block.
+  void add_row(std::vector<double>& block, size_t& nrows, size_t& ncols,
+               const std::vector<double>& row);
+  // BtA_ += B^T A for the first urows rows of the blocks
+  void multiply(size_t urows);
+  // BtA_ += B^T A for the rows in the blocks
+  void compress();
+  // BtA_ += B^T A for the rows of the keys before the current one, and
+  // move the rows of the current key to the top of the blocks
+  void compress_earlier_keys();
+
+  // The blocks of A (local_matrix_) and B are column-major with
+  // num_rows_ rows, blocksize_ times the length of the first row read.
+  size_t num_B_cols_;
+  size_t num_B_rows_;
+  // the rows of the keys before the current one, in both blocks
+  size_t key_first_row_;
+  std::vector<double> B_block_;
+  // n_B x n_A, column-major
+  std::vector<double> BtA_;
+};
+
+// Blocked Householder QR, the C++ version of dumbo/Householder.  Instead
+// of one reflector per pass, each step factors a panel of b columns and
+// keeps it in compact WY form, H = I - V T V^T, so there are two passes
+// over A for every b columns:
+//
+//   HouseholderMap (map only): apply H^T of the previous panel to the
+//     rows and drop its columns, emit the rows of R that the previous
+//     panel finished, and emit the local R and the first b rows (the
+//     pivot candidates) of the next panel.
+//   HouseholderReduce: combine the local R factors into the R of the
+//     panel, pick b pivot rows and reconstruct V and T from the Q of the
+//     panel (Ballard et al., "Reconstructing Householder vectors from
+//     tall-skinny QR").
+//   HouseholderW (map, with a RowSum reduce): W = V^T A for the columns
+//     after the panel, which the next HouseholderMap needs.
+//
+// The pivot rows of a panel hold its rows of R.  The other rows of V are
+// A_panel (U R_panel)^{-1}, which the map tasks form a block at a time,
+// so V never goes through HDFS.  Since that is the Q of the panel from
+// R^{-1}, the panels should be well conditioned, as for indirect TSQR.
+//
+// The panel is given by the text dump of the HouseholderReduce output:
+// T, UR = U R_panel, V1 (the pivot rows of V), RH (the pivot rows of R)
+// and "pivot:<key>" with the index of each pivot row.
+class HouseholderPanel : public MatrixHandler {
+public:
+  HouseholderPanel(TypedBytesInFile& in, TypedBytesOutFile& out,
+                   size_t blocksize)
+    : MatrixHandler(in, out, blocksize, 1), panel_cols_(0) {}
+  virtual ~HouseholderPanel() {}
+
+  // Read the previous panel from the text dump of its HouseholderReduce.
+  bool load_panel(const std::string& path);
+
+  void first_row();
+  void collect(typedbytes_opaque& key, std::vector<double>& value);
+
+protected:
+  // process the num_local_rows_ rows in local_matrix_
+  virtual void compress() = 0;
+  // The rows of V for the local rows (num_local_rows_ x panel_cols_,
+  // column-major), from the first panel_cols_ columns.
+  void panel_V(std::vector<double>& V);
+
+  // the number of columns of the previous panel (0 if none)
+  size_t panel_cols_;
+  std::vector<double> T_;
+  std::vector<double> UR_;
+  std::vector<double> V1_;
+  std::vector<double> RH_;
+  std::map<std::string, int> pivots_;
+
+  // the keys of the local rows, and their pivot index or -1
+  KeyArena keys_;
+  std::vector<int> pivot_of_row_;
+};
+
+class HouseholderMap : public HouseholderPanel {
+public:
+  HouseholderMap(TypedBytesInFile& in, TypedBytesOutFile& out,
+                 size_t blocksize, size_t num_cols, size_t panel_size)
+    : HouseholderPanel(in, out, blocksize),
+      total_cols_(num_cols), panel_size_(panel_size), next_cols_(0),
+      num_candidates_(0), num_factored_(0) {
+    mapper_id_ = DirTSQRMap1::pseudo_uuid();
+  }
+
+  // Read W = V^T A (the columns after the previous panel) from the text
+  // dump of the HouseholderW output.  Call after load_panel.
+  bool load_W(const std::string& path);
+
+  void output();
+
+protected:
+  void compress();
+
+private:
+  // emit row i of the local rows, a pivot row of the previous panel
+  void write_R_row(size_t i, int pivot);
+
+  std::string mapper_id_;
+  // the number of columns of A
+  size_t total_cols_;
+  size_t panel_size_;
+  // T^T W, the update of the columns after the previous panel
+  std::vector<double> TW_;
+  // the number of columns of the next panel, and its local R
+  size_t next_cols_;
+  std::vector<double> R_;
+  size_t num_candidates_;
+  size_t num_factored_;
+  std::vector<double> V_;
+  std::vector<double> panel_;
+};
+
+class HouseholderReduce : public MatrixHandler {
+public:
+  HouseholderReduce(TypedBytesInFile& in, TypedBytesOutFile& out)
+    : MatrixHandler(in, out, -1, 1) {}
+
+  void mapper();
+  void collect(typedbytes_opaque& key, std::vector<double>& value) {}
+  void output();
+
+private:
+  // the stacked row-major local R factors
+  std::vector<double> R_stack_;
+  // the pivot candidates, sorted by key
+  std::map<std::string, std::vector<double>> candidates_;
+};
+
+class HouseholderW : public HouseholderPanel {
+public:
+  HouseholderW(TypedBytesInFile& in, TypedBytesOutFile& out,
+               size_t blocksize)
+    : HouseholderPanel(in, out, blocksize) {}
+
+  void output();
 
-  void handle_matmul(std::string& key, std::vector<double>& Q2);
+protected:
+  void compress();
+
+private:
+  // V^T A for the columns after the panel (column-major)
+  std::vector<double> W_;
+  std::vector<double> V_;
 };
 
 #endif  // MRTSQR_CXX_MRMC_H_
@@ -51,15 +51,24 @@ parser.add_option('-s', '--schedule', dest='sched', default='100,100,100',
                   help='comma separated list of number of map tasks to use for'
                        + ' the three jobs')
 
-# TODO(arbenson): add option that computes singular vectors but not the Q in
-# QR.  This will be the go-to option for computing the SVD of a
-# tall-and-skinny matrix.
 parser.add_option('-x', '--svd', type='int', dest='svd', default=0,
                   help="""0: no SVD computed ;
-1: compute the singular values (R = USV^t) ;
-2: compute the singular vectors as well as QR
+1: compute the singular values and right singular vectors (R = USV^t) ;
+2: compute the left singular vectors instead of the Q in QR
 """
 )
+parser.add_option('-b', '--binary_q2', type='int', dest='binary_q2',
+                  default=1,
+                  help='1: convert Q2 to an indexed binary file for stage 3 ;'
+                       + ' 0: ship the text dump of Q2')
+parser.add_option('-m', '--max_blocks', type='int', dest='max_blocks',
+                  default=0,
+                  help='maximum number of Q1 blocks a stage 3 mapper holds'
+                       + ' in memory (0: no limit)')
+parser.add_option('-r', '--rec_groups', dest='rec_groups', default='',
+                  help='comma separated list of the number of groups (and'
+                       + ' reduce tasks) of each extra level of stage 2, for'
+                       + ' when one reducer cannot hold every R factor')
 parser.add_option('-q', '--quiet', action='store_false', dest='verbose',
                   default=True, help='turn off some statement printing')
 
@@ -91,6 +100,8 @@ if ncols == 0:
   cm.error('number of columns not provided, use --ncols')
 
 svd_opt = options.svd
+if svd_opt not in [0, 1, 2]:
+  cm.error('invalid svd option %d' % svd_opt)
 
 sched = options.sched
 try:
@@ -99,6 +110,13 @@ try:
 except:
   cm.error('invalid schedule provided')
 
+rec_groups = []
+if options.rec_groups != '':
+  try:
+    rec_groups = [int(g) for g in options.rec_groups.split(',')]
+  except:
+    cm.error('invalid rec_groups provided')
+
 def form_cmd(hadoop_opts):
   cmd = 'hadoop jar %s -libjars feathers.jar ' % STREAMING_JAR
   for opt_type in hadoop_opts:
@@ -131,32 +149,93 @@ jobconf = [x for x in hadoop_opts['jobconf']]
 hadoop_opts['jobconf'] = jobconf + ['mapred.map.tasks=%d' % sched[0]]
 run_step(hadoop_opts)
 
+def fetch_Q2(out_dir, name):
+  """ Copy the Q2 output of out_dir, from any number of reduce tasks, into
+  one local text dump, and return its path. """
+  local_dir = out_file(name)
+  cm.exec_cmd('hadoop fs -copyToLocal %s/Q2 %s' % (out_dir, local_dir))
+  parts = sorted(f for f in os.listdir(local_dir) if f.startswith('part-'))
+  text_file = local_dir + '.txt.out'
+  for part in parts:
+    cm.parse_seq_file(os.path.join(local_dir, part))
+  cm.exec_cmd('cat %s > %s' % (
+      ' '.join(os.path.join(local_dir, part + '.out') for part in parts),
+      text_file))
+  return text_file
+
+def Q2_index(text_file):
+  """ Parse the text dump of Q2 once into a binary file that stage 3 can
+  index instead of parsing it all. """
+  binary_file = text_file.replace('.txt.out', '.bin')
+  cm.exec_cmd('./tsqr direct q2index %d %s %s' % (ncols, text_file,
+                                                 binary_file))
+  return binary_file
+
+# Recursive stage 2: each level factors groups of the R factors of the
+# level below, and gives one R per group to the level above.
+R_input = out1 + '/R_*'
+level_Q2_files = []
+for level, ngroups in enumerate(rec_groups, 1):
+  out_level = out + '_2_level%d' % level
+  hadoop_opts['input'] = [R_input]
+  hadoop_opts['output'] = [out_level]
+  hadoop_opts['mapper'] = ["'./tsqr_wrapper.sh direct rgroup %d %d'" % (
+      level, ngroups)]
+  hadoop_opts['reducer'] = ["'./tsqr_wrapper.sh direct rlevel %d'" % ncols]
+  hadoop_opts['numReduceTasks'] = [str(ngroups)]
+  hadoop_opts['jobconf'] = jobconf + ['mapred.map.tasks=%d' % sched[1]]
+  run_step(hadoop_opts)
+  level_Q2_files.append(fetch_Q2(out_level, 'Q2_level%d' % level))
+  R_input = out_level + '/R_*'
+
 out2 = out + '_2'
-hadoop_opts['input'] = [out1 + '/R_*']
+hadoop_opts['input'] = [R_input]
 hadoop_opts['output'] = [out2]
 hadoop_opts['mapper'] =  ['org.apache.hadoop.mapred.lib.IdentityMapper']
-hadoop_opts['reducer'] =  ["'./tsqr_wrapper.sh direct 2 %d'" % ncols]
+hadoop_opts['reducer'] =  ["'./tsqr_wrapper.sh direct 2 %d - %d'" % (
+    ncols, int(svd_opt > 0))]
 hadoop_opts['numReduceTasks'] = ['1']
 hadoop_opts['jobconf'] = jobconf + ['mapred.map.tasks=%d' % sched[1]]
 run_step(hadoop_opts)
 
 # Q2 file needs parsing before being distributed to phase 3
-Q2_file = out_file('Q2.txt')
-
-if os.path.exists(Q2_file):
-  os.remove(Q2_file)
-
-if os.path.exists(Q2_file + '.out'):
-  os.remove(Q2_file + '.out')
-
-cm.copy_from_hdfs(out2 + '/Q2', Q2_file)
-cm.parse_seq_file(Q2_file)
+Q2_text_file = fetch_Q2(out2, 'Q2')
+
+# With a recursive stage 2, stage 3 starts from the Q2 of the first
+# level and multiplies by the Q2 blocks of the levels above, which must
+# be binary.
+level_Q2_files.append(Q2_text_file)
+Q2_text_file = level_Q2_files[0]
+upper_Q2_files = [Q2_index(f) for f in level_Q2_files[1:]]
+
+if options.binary_q2:
+  Q2_side_file = Q2_index(Q2_text_file)
+else:
+  Q2_side_file = Q2_text_file
+hadoop_opts['file'] += [Q2_side_file] + upper_Q2_files
+
+map3_opts = '%d %s %d' % (ncols, os.path.basename(Q2_side_file),
+                          options.max_blocks)
+
+# With svd option 2, stage 3 multiplies by the U of the SVD of R, which
+# gives the left singular vectors instead of Q.
+if svd_opt == 2:
+  small_U_file = out_file('U.txt')
+  cm.copy_from_hdfs(out2 + '/U', small_U_file)
+  cm.parse_seq_file(small_U_file)
+  hadoop_opts['file'] += [small_U_file + '.out']
+  map3_opts += ' ' + os.path.basename(small_U_file + '.out')
+else:
+  map3_opts += ' -'
+
+if len(upper_Q2_files) > 0:
+  map3_opts += ' ' + ','.join('%d:%s' % (g, os.path.basename(f))
+                              for g, f in zip(rec_groups, upper_Q2_files))
 
 out3 = out + '_3'
 hadoop_opts['input'] = [out1 + '/Q_*']
 hadoop_opts['output'] = [out3]
-hadoop_opts['file'] += [Q2_file + '.out']
-hadoop_opts['mapper'] =  ["'./tsqr_wrapper.sh direct 3 %d'" % ncols]
+hadoop_opts['mapper'] =  ["'./tsqr_wrapper.sh direct 3 %s'" % map3_opts]
 hadoop_opts['reducer'] = ['org.apache.hadoop.mapred.lib.IdentityReducer']
 hadoop_opts['outputformat'] = ['org.apache.hadoop.mapred.SequenceFileOutputFormat']
 hadoop_opts['numReduceTasks'] = ['0']
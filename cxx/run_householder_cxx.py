@@ -0,0 +1,214 @@
+"""
+   Copyright (c) 2012-2014, Austin Benson and David Gleich
+   All rights reserved.
+
+   This file is part of MRTSQR and is under the BSD 2-Clause License,
+   which can be found in the LICENSE file in the root directory, or at
+   http://opensource.org/licenses/BSD-2-Clause
+"""
+
+"""
+This is a script to run the C++ blocked Householder QR, which computes R
+one panel of b columns at a time.  For each panel:
+     step 1 (map only): apply the previous panel to A, and emit the local
+                        R and the pivot candidates of this panel
+     step 2 (reduce):   the R of the panel, its pivot rows and (V, T)
+     step 3:            W = V^T A for the columns after the panel
+Each panel reads A twice, instead of twice per column for the
+one-reflector-at-a-time dumbo/Householder.
+
+See options:
+     python run_householder_cxx.py --help
+
+Example usage:
+     python run_householder_cxx.py --input=A_800M_10.bseq \
+            --ncols=10 --panel=5 --schedule=100 \
+            --local_output=hh-tmp --output=HH_TESTING
+
+The rows of R are gathered in local_output/R.txt.out.
+
+This script is designed to run on ICME's MapReduce cluster, icme-hadoop1.
+"""
+
+import os
+import shutil
+import sys
+from optparse import OptionParser
+lib_path = os.path.abspath('../dumbo')
+sys.path.append(lib_path)
+import util
+
+# Parse command-line options
+#
+# TODO(arbenson): use argparse instead of optparse when icme-hadoop1 defaults
+# to python 2.7
+parser = OptionParser()
+parser.add_option('-i', '--input', dest='input', default='',
+                  help='input matrix')
+parser.add_option('-o', '--output', dest='out', default='',
+                  help='base string for output of Hadoop jobs')
+parser.add_option('-l', '--local_output', dest='local_out',
+                  default='householder_out_tmp',
+                  help='Base directory for placing local files')
+parser.add_option('-t', '--times_output', dest='times_out', default='times',
+                  help='Base directory for placing local files')
+parser.add_option('-n', '--ncols', type='int', dest='ncols', default=0,
+                  help='number of columns in the matrix')
+parser.add_option('-p', '--panel', type='int', dest='panel', default=10,
+                  help='number of columns factored per step')
+parser.add_option('-s', '--schedule', type='int', dest='sched', default=100,
+                  help='number of map tasks to use')
+parser.add_option('-b', '--blocksize', type='int', dest='blocksize',
+                  default=3, help='blocksize of the map tasks')
+parser.add_option('-q', '--quiet', action='store_false', dest='verbose',
+                  default=True, help='turn off some statement printing')
+
+(options, args) = parser.parse_args()
+cm = util.CommandManager(verbose=options.verbose)
+
+STREAMING_JAR='/usr/lib/hadoop/contrib/streaming/hadoop-streaming-0.20.2-cdh3u4.jar'
+
+# Store options in the appropriate variables
+in1 = options.input
+if in1 == '':
+  cm.error('no input matrix provided, use --input')
+
+out = options.out
+if out == '':
+  # TODO(arbenson): make sure in1 is clean
+  out = in1 + '_HOUSEHOLDER'
+
+local_out = options.local_out
+out_file = lambda f: local_out + '/' + f
+if os.path.exists(local_out):
+  shutil.rmtree(local_out)
+os.mkdir(local_out)
+
+times_out = options.times_out
+
+ncols = options.ncols
+if ncols == 0:
+  cm.error('number of columns not provided, use --ncols')
+
+panel = options.panel
+if panel <= 0:
+  cm.error('invalid panel size %d' % panel)
+
+def form_cmd(hadoop_opts):
+  cmd = 'hadoop jar %s -libjars feathers.jar ' % STREAMING_JAR
+  for opt_type in hadoop_opts:
+    for opt in hadoop_opts[opt_type]:
+      cmd += '-%s %s ' % (opt_type, opt)
+  return cmd
+
+def run_step(hadoop_opts):
+  cm.exec_cmd('hadoop fs -rmr ' + hadoop_opts['output'][0])
+  cm.exec_cmd(form_cmd(hadoop_opts))
+
+def fetch(hdfs_path, name):
+  """ Copy the output at hdfs_path, from any number of tasks, into one
+  local text dump, and return its path. """
+  local_dir = out_file(name)
+  cm.exec_cmd('hadoop fs -copyToLocal %s %s' % (hdfs_path, local_dir))
+  parts = sorted(f for f in os.listdir(local_dir) if f.startswith('part-'))
+  text_file = local_dir + '.txt.out'
+  for part in parts:
+    cm.parse_seq_file(os.path.join(local_dir, part))
+  cm.exec_cmd('cat %s > %s' % (
+      ' '.join(os.path.join(local_dir, part + '.out') for part in parts),
+      text_file))
+  return text_file
+
+jobconf = ['mapreduce.job.name=tsqr_cxx',
+           'stream.map.input=typedbytes',
+           'stream.reduce.input=typedbytes',
+           'stream.map.output=typedbytes',
+           'stream.reduce.output=typedbytes',
+           'mapred.map.tasks=%d' % options.sched]
+
+def hadoop_opts(inputs, output, mapper, reducer, nreduce, side_files,
+                outputformat):
+  return {'jobconf': jobconf,
+          'inputformat': ['org.apache.hadoop.streaming.AutoInputFormat'],
+          'outputformat': [outputformat],
+          'file': ['tsqr', 'tsqr_wrapper.sh'] + side_files,
+          'input': inputs,
+          'output': [output],
+          'mapper': [mapper],
+          'reducer': [reducer],
+          'numReduceTasks': [str(nreduce)],
+          }
+
+MULTIPLE_OUTPUTS = 'fm.last.feathers.output.MultipleSequenceFiles'
+SEQ_OUTPUT = 'org.apache.hadoop.mapred.SequenceFileOutputFormat'
+
+A_input = in1
+panel_file = W_file = '-'
+side_files = []
+R_files = []
+start = 0
+step = 0
+while start < ncols:
+  width = min(panel, ncols - start)
+
+  # step 1: apply the previous panel, and factor this one locally
+  out1 = '%s_%d_1' % (out, step)
+  run_step(hadoop_opts(
+      [A_input], out1,
+      "'./tsqr_wrapper.sh householder 1 %d %d %s %s %d'" % (
+          ncols, panel, os.path.basename(panel_file),
+          os.path.basename(W_file), options.blocksize),
+      'org.apache.hadoop.mapred.lib.IdentityReducer', 0, side_files,
+      MULTIPLE_OUTPUTS))
+  if step > 0:
+    R_files.append(fetch(out1 + '/R_final', 'R_%d' % step))
+  A_input = out1 + '/A_matrix'
+
+  # step 2: the panel
+  out2 = '%s_%d_2' % (out, step)
+  run_step(hadoop_opts(
+      [out1 + '/R_*', out1 + '/C_*'], out2,
+      'org.apache.hadoop.mapred.lib.IdentityMapper',
+      "'./tsqr_wrapper.sh householder 2'", 1, [], SEQ_OUTPUT))
+  panel_file = fetch(out2, 'panel_%d' % step)
+  side_files = [panel_file]
+  start += width
+  if start == ncols:
+    break
+
+  # step 3: W for the columns after the panel
+  out3 = '%s_%d_3' % (out, step)
+  run_step(hadoop_opts(
+      [A_input], out3,
+      "'./tsqr_wrapper.sh householder 3 %s %d'" % (
+          os.path.basename(panel_file), options.blocksize),
+      "'./tsqr_wrapper.sh rowsum'", 1, side_files, SEQ_OUTPUT))
+  W_file = fetch(out3, 'W_%d' % step)
+  side_files.append(W_file)
+  step += 1
+
+# The rows of R from the last panel are its RH, which step 2 leaves in
+# the panel file (column-major) rather than on HDFS.
+R_last = out_file('R_last.txt.out')
+f_in = open(panel_file)
+RH = None
+for line in f_in:
+  if line.startswith('(RH)'):
+    RH = [float(x) for x in line[line.index('[') + 1:line.rindex(']')].split(',')]
+f_in.close()
+f_out = open(R_last, 'w')
+for i in range(width):
+  row = [0.0] * (ncols - width + i) + [RH[i + j * width]
+                                       for j in range(i, width)]
+  f_out.write('(%d)\t[%s]\n' % (ncols - width + i,
+                                ', '.join(repr(x) for x in row)))
+f_out.close()
+R_files.append(R_last)
+cm.exec_cmd('cat %s > %s' % (' '.join(R_files), out_file('R.txt.out')))
+
+try:
+  f = open(times_out, 'a')
+  f.write('times: ' + str(cm.times) + '\n')
+  f.close
+except:
+  pass
@@ -0,0 +1,169 @@
+"""
+   Copyright (c) 2012-2014, Austin Benson and David Gleich
+   All rights reserved.
+
+   This file is part of MRTSQR and is under the BSD 2-Clause License, 
+   which can be found in the LICENSE file in the root directory, or at 
+   http://opensource.org/licenses/BSD-2-Clause
+"""
+
+"""
+This is a script to run the C++ TSQR with iterative refinement to compute
+Q, the C++ version of dumbo/run_tsqr_ir.py:
+     pass 1:            R1 from indirect TSQR of A
+     pass 2 (--refine): R2 from indirect TSQR of A R1^{-1}
+     pass 3 (map only): Q = A R1^{-1} R2^{-1}, solved with dtrsm
+The R of A is R2 R1.
+
+See options:
+     python run_tsqr_ir_cxx.py --help
+
+Example usage:
+     python run_tsqr_ir_cxx.py --input=A_800M_10.bseq \
+            --ncols=10 --schedule=100,100,100 --refine \
+            --local_output=tsqr-ir-tmp --output=TSQR_IR_TESTING
+
+This script is designed to run on ICME's MapReduce cluster, icme-hadoop1.
+"""
+
+import os
+import shutil
+import sys
+from optparse import OptionParser
+lib_path = os.path.abspath('../dumbo')
+sys.path.append(lib_path)
+import util
+
+# Parse command-line options
+#
+# TODO(arbenson): use argparse instead of optparse when icme-hadoop1 defaults
+# to python 2.7
+parser = OptionParser()
+parser.add_option('-i', '--input', dest='input', default='',
+                  help='input matrix')
+parser.add_option('-o', '--output', dest='out', default='',
+                  help='base string for output of Hadoop jobs')
+parser.add_option('-l', '--local_output', dest='local_out',
+                  default='tsqr_ir_out_tmp',
+                  help='Base directory for placing local files')
+parser.add_option('-t', '--times_output', dest='times_out', default='times',
+                  help='Base directory for placing local files')
+parser.add_option('-n', '--ncols', type='int', dest='ncols', default=0,
+                  help='number of columns in the matrix')
+parser.add_option('-s', '--schedule', dest='sched', default='100,100,100',
+                  help='comma separated list of number of map tasks to use for'
+                       + ' the three passes')
+parser.add_option('-b', '--blocksize', type='int', dest='blocksize',
+                  default=3, help='blocksize of the map tasks')
+parser.add_option('-r', '--refine', action='store_true', dest='refine',
+                  default=False, help='do the refinement pass')
+parser.add_option('-q', '--quiet', action='store_false', dest='verbose',
+                  default=True, help='turn off some statement printing')
+
+(options, args) = parser.parse_args()
+cm = util.CommandManager(verbose=options.verbose)
+
+STREAMING_JAR='/usr/lib/hadoop/contrib/streaming/hadoop-streaming-0.20.2-cdh3u4.jar'
+
+# Store options in the appropriate variables
+in1 = options.input
+if in1 == '':
+  cm.error('no input matrix provided, use --input')
+
+out = options.out
+if out == '':
+  # TODO(arbenson): make sure in1 is clean
+  out = in1 + '_TSQR_IR'
+
+local_out = options.local_out
+out_file = lambda f: local_out + '/' + f
+if os.path.exists(local_out):
+  shutil.rmtree(local_out)
+os.mkdir(local_out)
+
+times_out = options.times_out
+
+ncols = options.ncols
+if ncols == 0:
+  cm.error('number of columns not provided, use --ncols')
+
+sched = options.sched
+try:
+  sched = [int(s) for s in sched.split(',')]
+  sched[2]
+except:
+  cm.error('invalid schedule provided')
+
+blocksize = options.blocksize
+
+def form_cmd(hadoop_opts):
+  cmd = 'hadoop jar %s ' % STREAMING_JAR
+  for opt_type in hadoop_opts:
+    for opt in hadoop_opts[opt_type]:
+      cmd += '-%s %s ' % (opt_type, opt)
+  return cmd
+
+def run_step(hadoop_opts):
+  cm.exec_cmd('hadoop fs -rmr ' + hadoop_opts['output'][0])
+  cm.exec_cmd(form_cmd(hadoop_opts))
+
+def fetch_R(hdfs_path, name):
+  """ Copy R from hdfs_path to a local text dump, and return its path. """
+  R_file = out_file(name + '.txt')
+  cm.copy_from_hdfs(hdfs_path, R_file)
+  cm.parse_seq_file(R_file)
+  return R_file + '.out'
+
+hadoop_opts = {'jobconf': ['mapreduce.job.name=tsqr_cxx',
+                           'stream.map.input=typedbytes',
+                           'stream.reduce.input=typedbytes',
+                           'stream.map.output=typedbytes',
+                           'stream.reduce.output=typedbytes',],
+               'inputformat': ['org.apache.hadoop.streaming.AutoInputFormat'],
+               'outputformat': ['org.apache.hadoop.mapred.SequenceFileOutputFormat'],
+               'file': ['tsqr', 'tsqr_wrapper.sh'],
+               'input': [in1],
+               'mapper': ["'./tsqr_wrapper.sh indirect %d'" % blocksize],
+               'reducer': ["'./tsqr_wrapper.sh indirect %d'" % blocksize],
+               'numReduceTasks': ['1'],
+               }
+jobconf = [x for x in hadoop_opts['jobconf']]
+
+# Pass 1: R1
+out1 = out + '_1'
+hadoop_opts['output'] = [out1]
+hadoop_opts['jobconf'] = jobconf + ['mapred.map.tasks=%d' % sched[0]]
+run_step(hadoop_opts)
+R1_file = fetch_R(out1, 'R1')
+R1_name = os.path.basename(R1_file)
+hadoop_opts['file'] += [R1_file]
+
+# Pass 2: R2, the R of A R1^{-1}
+R2_name = '-'
+if options.refine:
+  out2 = out + '_2'
+  hadoop_opts['output'] = [out2]
+  hadoop_opts['mapper'] = ["'./tsqr_wrapper.sh arinv tsqr %d %s %d'" % (
+      ncols, R1_name, blocksize)]
+  hadoop_opts['jobconf'] = jobconf + ['mapred.map.tasks=%d' % sched[1]]
+  run_step(hadoop_opts)
+  R2_file = fetch_R(out2, 'R2')
+  R2_name = os.path.basename(R2_file)
+  hadoop_opts['file'] += [R2_file]
+
+# Pass 3: Q = A R1^{-1} R2^{-1}
+out3 = out + '_Q'
+hadoop_opts['output'] = [out3]
+hadoop_opts['mapper'] = ["'./tsqr_wrapper.sh arinv %d %s %s %d'" % (
+    ncols, R1_name, R2_name, blocksize)]
+hadoop_opts['reducer'] = ['org.apache.hadoop.mapred.lib.IdentityReducer']
+hadoop_opts['numReduceTasks'] = ['0']
+hadoop_opts['jobconf'] = jobconf + ['mapred.map.tasks=%d' % sched[2]]
+run_step(hadoop_opts)
+
+try:
+  f = open(times_out, 'a')
+  f.write('times: ' + str(cm.times) + '\n')
+  f.close
+except:
+  pass
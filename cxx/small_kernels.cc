@@ -0,0 +1,158 @@
+/**
+   Copyright (c) 2012-2014, Austin Benson and David Gleich
+   All rights reserved.
+
+   This file is part of MRTSQR and is under the BSD 2-Clause License,
+   which can be found in the LICENSE file in the root directory, or at
+   http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include "small_kernels.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+template <size_t N>
+static void gram_update_n(const double *A, size_t nrows, double *C) {
+  size_t r = 0;
+  for (; r + 4 <= nrows; r += 4) {
+    const double *a0 = A + r * N;
+    const double *a1 = a0 + N;
+    const double *a2 = a1 + N;
+    const double *a3 = a2 + N;
+    for (size_t j = 0; j < N; ++j) {
+      double b0 = a0[j];
+      double b1 = a1[j];
+      double b2 = a2[j];
+      double b3 = a3[j];
+      double *c = C + j * N;
+      for (size_t i = 0; i <= j; ++i) {
+        c[i] += a0[i] * b0 + a1[i] * b1 + a2[i] * b2 + a3[i] * b3;
+      }
+    }
+  }
+  for (; r < nrows; ++r) {
+    const double *a = A + r * N;
+    for (size_t j = 0; j < N; ++j) {
+      double b = a[j];
+      double *c = C + j * N;
+      for (size_t i = 0; i <= j; ++i) {
+        c[i] += a[i] * b;
+      }
+    }
+  }
+}
+
+// Householder QR of [R; B], one column at a time (dtpqrt2 without
+// keeping T).  Only the rows of B that are nonzero in column k take
+// part in the k-th reflection.
+template <size_t N>
+static void tpqr_n(double *R, size_t ldr, double *B, size_t ldb,
+                   size_t urows, size_t ltri) {
+  double w[N];
+  for (size_t k = 0; k < N; ++k) {
+    size_t mk = std::min(urows, urows - ltri + k + 1);
+    double *x = B + k * ldb;
+    double xnorm2 = 0.;
+    for (size_t p = 0; p < mk; ++p) {
+      xnorm2 += x[p] * x[p];
+    }
+    if (xnorm2 == 0.) {
+      continue;
+    }
+    // the reflector H = I - tau [1; v] [1; v]^T maps [alpha; x] to
+    // [beta; 0], with the sign of beta chosen as in dlarfg
+    double alpha = R[k + k * ldr];
+    double beta = -copysign(sqrt(alpha * alpha + xnorm2), alpha);
+    double tau = (beta - alpha) / beta;
+    double scale = 1. / (alpha - beta);
+    for (size_t p = 0; p < mk; ++p) {
+      x[p] *= scale;
+    }
+    R[k + k * ldr] = beta;
+
+    // w = tau * ([R(k, :); B(:, :)]^T [1; v]) for the columns after k
+    for (size_t j = k + 1; j < N; ++j) {
+      const double *b = B + j * ldb;
+      double sum = R[k + j * ldr];
+      for (size_t p = 0; p < mk; ++p) {
+        sum += x[p] * b[p];
+      }
+      w[j] = tau * sum;
+    }
+    for (size_t j = k + 1; j < N; ++j) {
+      double *b = B + j * ldb;
+      R[k + j * ldr] -= w[j];
+      for (size_t p = 0; p < mk; ++p) {
+        b[p] -= w[j] * x[p];
+      }
+    }
+  }
+}
+
+template <size_t N>
+static void row_major_matmul_n(const double *A, size_t nrows, const double *B,
+                               double *C) {
+  // B^T, so that each row of C is a sum of contiguous rows of B^T
+  double Bt[N * N];
+  for (size_t j = 0; j < N; ++j) {
+    for (size_t k = 0; k < N; ++k) {
+      Bt[j + k * N] = B[k + j * N];
+    }
+  }
+  size_t r = 0;
+  for (; r + 4 <= nrows; r += 4) {
+    // four rows at a time, so that each row of B^T is loaded once
+    const double *a = A + r * N;
+    double c[4][N];
+    for (size_t j = 0; j < N; ++j) {
+      c[0][j] = c[1][j] = c[2][j] = c[3][j] = 0.;
+    }
+    for (size_t k = 0; k < N; ++k) {
+      const double *bt = Bt + k * N;
+      double a0 = a[k];
+      double a1 = a[N + k];
+      double a2 = a[2 * N + k];
+      double a3 = a[3 * N + k];
+      for (size_t j = 0; j < N; ++j) {
+        c[0][j] += a0 * bt[j];
+        c[1][j] += a1 * bt[j];
+        c[2][j] += a2 * bt[j];
+        c[3][j] += a3 * bt[j];
+      }
+    }
+    std::copy(&c[0][0], &c[0][0] + 4 * N, C + r * N);
+  }
+  for (; r < nrows; ++r) {
+    const double *a = A + r * N;
+    double c[N];
+    for (size_t j = 0; j < N; ++j) {
+      c[j] = 0.;
+    }
+    for (size_t k = 0; k < N; ++k) {
+      for (size_t j = 0; j < N; ++j) {
+        c[j] += a[k] * Bt[j + k * N];
+      }
+    }
+    std::copy(c, c + N, C + r * N);
+  }
+}
+
+// The unblocked tpqr_n only beats dtpqrt up to about 25 columns, and
+// row_major_matmul_n only beats dgemm on short rows.
+static const SmallKernels kernel_table[] = {
+  { 10, gram_update_n<10>, tpqr_n<10>, row_major_matmul_n<10> },
+  { 25, gram_update_n<25>, tpqr_n<25>, row_major_matmul_n<25> },
+  { 50, gram_update_n<50>, NULL, NULL },
+  { 100, gram_update_n<100>, NULL, NULL },
+};
+
+const SmallKernels *small_kernels(size_t num_cols) {
+  for (size_t i = 0; i < sizeof(kernel_table) / sizeof(kernel_table[0]); ++i) {
+    if (kernel_table[i].num_cols == num_cols) {
+      return &kernel_table[i];
+    }
+  }
+  return NULL;
+}
@@ -0,0 +1,41 @@
+/**
+   Copyright (c) 2012-2014, Austin Benson and David Gleich
+   All rights reserved.
+
+   This file is part of MRTSQR and is under the BSD 2-Clause License,
+   which can be found in the LICENSE file in the root directory, or at
+   http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#ifndef MRTSQR_CXX_SMALL_KERNELS_H_
+#define MRTSQR_CXX_SMALL_KERNELS_H_
+
+#include <stdlib.h>
+
+// Kernels compiled for a fixed number of columns.  Most of our jobs use
+// a handful of column counts, and with the count known at compile time
+// the loops over columns unroll and vectorize.  The arguments are the
+// same as the generic versions in tsqr_util.h, minus the column count.
+// A kernel is NULL where the generic BLAS/LAPACK version is faster.
+struct SmallKernels {
+  size_t num_cols;
+
+  // gram_update: add the upper triangle of A^T A to C (A row-major)
+  void (*gram_update)(const double *A, size_t nrows, double *C);
+
+  // lapack_tpqr: factor [R; B] with R upper triangular and the last
+  // ltri rows of B upper trapezoidal; R holds the new R on return.
+  // Unlike dtpqrt, B is left in an unspecified state.
+  void (*tpqr)(double *R, size_t ldr, double *B, size_t ldb, size_t urows,
+               size_t ltri);
+
+  // lapack_row_major_matmul with a square B: C = A * B, with A and C
+  // row-major and B column-major.
+  void (*row_major_matmul)(const double *A, size_t nrows, const double *B,
+                           double *C);
+};
+
+// The kernels for num_cols columns, or NULL if there are none.
+const SmallKernels *small_kernels(size_t num_cols);
+
+#endif  // MRTSQR_CXX_SMALL_KERNELS_H_
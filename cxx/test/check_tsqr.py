@@ -0,0 +1,1020 @@
+"""
+   Copyright (c) 2012-2014, Austin Benson and David Gleich
+   All rights reserved.
+
+   This file is part of MRTSQR and is under the BSD 2-Clause License,
+   which can be found in the LICENSE file in the root directory, or at
+   http://opensource.org/licenses/BSD-2-Clause
+"""
+
+"""
+check_tsqr.py
+=============
+
+Run the stages of the tsqr methods by hand on small random matrices,
+with the shuffles done here, and check the results against reference
+computations.  Only needs the Python standard library.
+
+usage: python check_tsqr.py [tsqr_binary [test ...]]
+"""
+
+import os
+import random
+import shutil
+import struct
+import subprocess
+import sys
+import tempfile
+
+tsqr = './tsqr'
+failures = 0
+
+
+# Typed bytes encoding
+
+def tb_double(x):
+  return b'\x06' + struct.pack('>d', x)
+
+def tb_int(x):
+  return b'\x03' + struct.pack('>i', x)
+
+def tb_string(s):
+  if not isinstance(s, bytes):
+    s = s.encode()
+  return b'\x07' + struct.pack('>i', len(s)) + s
+
+def tb_bytes(b):
+  return b'\x00' + struct.pack('>i', len(b)) + b
+
+def tb_list(items):
+  return b'\x09' + b''.join(items) + b'\xff'
+
+def tb_vector(items):
+  return b'\x08' + struct.pack('>i', len(items)) + b''.join(items)
+
+def tb_row(row, enc='list'):
+  if enc == 'list':
+    return tb_list([tb_double(x) for x in row])
+  if enc == 'vector':
+    return tb_vector([tb_double(x) for x in row])
+  return tb_bytes(struct.pack('<%dd' % len(row), *row))
+
+def tb_key(key):
+  """The typed bytes of a key as returned by read_pairs."""
+  if isinstance(key, tuple):
+    return (tb_string if key[0] == 'string' else tb_bytes)(key[1])
+  return tb_int(key)
+
+def read_value(data, pos):
+  """Decode the typed bytes value at pos; returns (value, next pos).
+  Strings and byte sequences come back as ('string', b) or ('bytes', b)."""
+  code = bytearray(data[pos:pos + 1])[0]
+  pos += 1
+  if code in (0, 7):
+    n = struct.unpack('>i', data[pos:pos + 4])[0]
+    return ('bytes' if code == 0 else 'string', data[pos + 4:pos + 4 + n]), \
+        pos + 4 + n
+  fmt = {1: '>b', 3: '>i', 4: '>q', 5: '>f', 6: '>d'}
+  if code in fmt:
+    size = struct.calcsize(fmt[code])
+    return struct.unpack(fmt[code], data[pos:pos + size])[0], pos + size
+  if code == 8:
+    n = struct.unpack('>i', data[pos:pos + 4])[0]
+    pos += 4
+    items = []
+    for i in range(n):
+      item, pos = read_value(data, pos)
+      items.append(item)
+    return items, pos
+  if code == 9:
+    items = []
+    while bytearray(data[pos:pos + 1])[0] != 0xff:
+      item, pos = read_value(data, pos)
+      items.append(item)
+    return items, pos + 1
+  raise ValueError('unknown typed bytes code %d' % code)
+
+def read_pairs(data):
+  pairs = []
+  pos = 0
+  while pos < len(data):
+    key, pos = read_value(data, pos)
+    value, pos = read_value(data, pos)
+    pairs.append((key, value))
+  return pairs
+
+def doubles(value):
+  """A row as a list of doubles, from a list or a byte sequence."""
+  if isinstance(value, tuple):
+    return list(struct.unpack('<%dd' % (len(value[1]) // 8), value[1]))
+  return [float(x) for x in value]
+
+
+# Running tsqr
+
+def run(args, data=b'', ok=True, env=None):
+  """Run tsqr args with data on stdin; returns (stdout, stderr)."""
+  p = subprocess.Popen([tsqr] + args, stdin=subprocess.PIPE,
+                       stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                       env=env)
+  out, err = p.communicate(data)
+  err = err.decode('utf-8', 'replace')
+  if ok and p.returncode != 0:
+    sys.stderr.write(err)
+    raise RuntimeError('tsqr %s failed' % ' '.join(args))
+  return out, err
+
+def check(name, ok):
+  global failures
+  print('%-50s %s' % (name, 'ok' if ok else 'FAIL'))
+  if not ok:
+    failures += 1
+
+
+# Reference computations
+
+def rand_matrix(m, n, seed=1):
+  r = random.Random(seed)
+  return [[r.uniform(-1, 1) for j in range(n)] for i in range(m)]
+
+def transpose(A):
+  return [list(r) for r in zip(*A)]
+
+def matmul(A, B):
+  Bt = transpose(B)
+  return [[sum(a * b for a, b in zip(row, col)) for col in Bt] for row in A]
+
+def gram(A):
+  return matmul(transpose(A), A)
+
+def eye(n):
+  return [[float(i == j) for j in range(n)] for i in range(n)]
+
+def maxabs(A, B):
+  return max(abs(a - b) for ra, rb in zip(A, B) for a, b in zip(ra, rb))
+
+def upper_maxabs(A, B):
+  n = len(B)
+  return max(abs(A[i][j] - B[i][j]) for i in range(n) for j in range(i, n))
+
+def chol_R(G):
+  """The upper triangular R with R^T R = G."""
+  n = len(G)
+  R = [[0.0] * n for i in range(n)]
+  for i in range(n):
+    R[i][i] = (G[i][i] - sum(R[k][i] ** 2 for k in range(i))) ** 0.5
+    for j in range(i + 1, n):
+      R[i][j] = (G[i][j] - sum(R[k][i] * R[k][j] for k in range(i))) / R[i][i]
+  return R
+
+def same_R(R1, R2):
+  """The difference of two R factors, up to the signs of their rows."""
+  err = 0.0
+  for a, b in zip(R1, R2):
+    j = max(range(len(a)), key=lambda j: abs(a[j]))
+    s = 1.0 if a[j] * b[j] >= 0 else -1.0
+    err = max(err, max(abs(x - s * y) for x, y in zip(a, b)))
+  return err
+
+def sym_eigvals(G):
+  """The eigenvalues of the symmetric G by cyclic Jacobi, largest first."""
+  n = len(G)
+  A = [list(row) for row in G]
+  for sweep in range(50):
+    off = sum(A[i][j] ** 2 for i in range(n) for j in range(n) if i != j)
+    if off <= 1e-30 * sum(A[i][i] ** 2 for i in range(n)):
+      break
+    for p in range(n):
+      for q in range(p + 1, n):
+        if A[p][q] == 0.0:
+          continue
+        theta = (A[q][q] - A[p][p]) / (2 * A[p][q])
+        t = (1.0 if theta >= 0 else -1.0) / (abs(theta) + (theta ** 2 + 1) ** 0.5)
+        c = 1 / (t ** 2 + 1) ** 0.5
+        s = t * c
+        for k in range(n):
+          A[k][p], A[k][q] = c * A[k][p] - s * A[k][q], s * A[k][p] + c * A[k][q]
+        for k in range(n):
+          A[p][k], A[q][k] = c * A[p][k] - s * A[q][k], s * A[p][k] + c * A[q][k]
+  return sorted((A[i][i] for i in range(n)), reverse=True)
+
+def keyed_rows(A, enc='list'):
+  return b''.join(tb_int(i) + tb_row(row, enc) for i, row in enumerate(A))
+
+
+# The tests
+
+def test_ata():
+  """AtA, alone and as stage 1 of cholqr2: the upper triangle of the
+  output against A^T A, on both sides of the Gram kernel width and for
+  the specialized kernels of 25, 50 and 100 columns.  Each record of
+  rows_per_record rows counts that many times."""
+  for m, n in ((300, 10), (200, 25), (200, 50), (200, 70), (250, 100)):
+    A = rand_matrix(m, n, 5)
+    G = gram(A)
+    for enc in ('list', 'bytes'):
+      data = keyed_rows(A, enc)
+      for method in (['ata'], ['cholqr2', '1']):
+        for blocksize, rpr in (('3', 1), ('2', 2), ('3', 3)):
+          out, err = run(method + [blocksize, str(rpr)], data)
+          C = dict((k, doubles(v)) for k, v in read_pairs(out))
+          ok = sorted(C) == list(range(n))
+          if ok:
+            R = [[rpr * x for x in row] for row in G]
+            e = upper_maxabs([C[i] for i in range(n)], R) / rpr
+            ok = e < 1e-10
+          check('%s %dx%d %s bs=%s rpr=%d' % (method[0], m, n, enc,
+                                              blocksize, rpr), ok)
+
+def test_pipeline():
+  """indirect and ata from stdin with the decode pipeline against the
+  serial runs, with a number of rows that leaves a partial last block."""
+  for m, n in ((307, 5), (211, 12)):
+    A = rand_matrix(m, n, 6)
+    for enc in ('list', 'vector', 'bytes'):
+      data = keyed_rows(A, enc)
+      for blocksize in ('2', '3', '7'):
+        R0 = [doubles(v) for k, v in read_pairs(
+            run(['indirect', blocksize, '1', '0'], data)[0])]
+        scale = max(abs(x) for row in R0 for x in row)
+        out, err = run(['indirect', blocksize, '1', '2'], data)
+        R = [doubles(v) for k, v in read_pairs(out)]
+        check('pipeline indirect %dx%d %s bs=%s' % (m, n, enc, blocksize),
+              len(R) == n and same_R(R, R0) / scale < 1e-12)
+        C0 = dict((k, doubles(v)) for k, v in read_pairs(
+            run(['ata', blocksize, '1', '0'], data)[0]))
+        out, err = run(['ata', blocksize, '1', '3'], data)
+        C = dict((k, doubles(v)) for k, v in read_pairs(out))
+        ok = sorted(C) == sorted(C0) == list(range(n))
+        if ok:
+          ok = upper_maxabs([C[i] for i in range(n)],
+                            [C0[i] for i in range(n)]) < 1e-10
+        check('pipeline ata %dx%d %s bs=%s' % (m, n, enc, blocksize), ok)
+
+def test_threads():
+  """indirect from stdin with 2 and 3 threads, including more threads
+  than blocks, against the single-thread R."""
+  for m, n, blocksize in ((12, 5, '3'), (25, 5, '3'), (307, 5, '2'),
+                          (211, 12, '7')):
+    A = rand_matrix(m, n, 9)
+    for enc in ('list', 'bytes'):
+      data = keyed_rows(A, enc)
+      R0 = [doubles(v) for k, v in read_pairs(
+          run(['indirect', blocksize, '1', '0', '1'], data)[0])]
+      scale = max(abs(x) for row in R0 for x in row)
+      for pipeline in ('0', '2'):
+        for threads in ('2', '3'):
+          out, err = run(['indirect', blocksize, '1', pipeline, threads], data)
+          R = [doubles(v) for k, v in read_pairs(out)]
+          check('threads indirect %dx%d %s bs=%s pipeline=%s threads=%s' % (
+              m, n, enc, blocksize, pipeline, threads),
+                len(R) == n and same_R(R, R0) / scale < 1e-12)
+
+def test_rowsum():
+  """rowsum adds up the rows with the same key, with several rows per
+  key and keys in any order."""
+  r = random.Random(4)
+  for nkeys, n in ((1, 3), (5, 7), (12, 12)):
+    keys = [r.randrange(nkeys) for i in range(60)]
+    rows = rand_matrix(len(keys), n, 4)
+    sums = dict((k, [0.0] * n) for k in keys)
+    for k, row in zip(keys, rows):
+      sums[k] = [a + b for a, b in zip(sums[k], row)]
+    for sort in (True, False):
+      recs = sorted(zip(keys, rows), key=lambda kv: kv[0]) if sort \
+          else list(zip(keys, rows))
+      data = b''.join(tb_int(k) + tb_row(row) for k, row in recs)
+      C = dict((k, doubles(v)) for k, v in read_pairs(run(['rowsum'], data)[0]))
+      ok = sorted(C) == sorted(sums) and \
+          maxabs([C[k] for k in sorted(C)], [sums[k] for k in sorted(C)]) < 1e-13
+      check('rowsum %d keys %d columns%s' % (nkeys, n, '' if sort else
+                                             ', unsorted'), ok)
+
+def cholqr2_maps(stage, A, nmap, args):
+  """The cholqr2 stage 1 or 3 maps, then the shuffle, sorted by key."""
+  recs = []
+  bounds = [len(A) * i // nmap for i in range(nmap + 1)]
+  for i in range(nmap):
+    data = b''.join(tb_int(j) + tb_row(A[j])
+                    for j in range(bounds[i], bounds[i + 1]))
+    recs += read_pairs(run(['cholqr2', stage] + args, data)[0])
+  recs.sort(key=lambda kv: kv[0])
+  return b''.join(tb_int(k) + tb_row(doubles(v)) for k, v in recs)
+
+def read_int_rows(out, n):
+  R = [None] * n
+  for k, v in read_pairs(out):
+    R[k] = doubles(v)
+  return R
+
+def test_cholqr2():
+  """Both passes of cholqr2, with the stage options of run_cholqr2_cxx.py:
+  R1 and R are upper triangular, and R matches the R of indirect up to
+  the signs of its rows, also for an ill-conditioned A."""
+  tmp = tempfile.mkdtemp()
+  try:
+    for m, n, scale in ((500, 5, 1.0), (600, 10, 1.0), (400, 25, 1e-4)):
+      A = rand_matrix(m, n, 3)
+      # columns close to the first one
+      A = [[row[0] + (x * scale if j else 0.0) for j, x in enumerate(row)]
+           for row in A]
+      R0 = [doubles(v) for k, v in read_pairs(
+          run(['indirect', '3'], keyed_rows(A))[0])]
+      for nmap in (1, 4):
+        for blocksize, pipeline in ((3, 0), (10, 3)):
+          map_opts = ['%d' % blocksize, '1', '%d' % pipeline]
+          data = cholqr2_maps('1', A, nmap, map_opts)
+          R1 = read_int_rows(run(['cholqr2', '2'], data)[0], n)
+          R1_path = os.path.join(tmp, 'R1.txt.out')
+          write_text_dump(R1_path, enumerate(R1))
+          data = cholqr2_maps('3', A, nmap, [str(n), R1_path] + map_opts)
+          R = read_int_rows(run(['cholqr2', '4', str(n), R1_path], data)[0], n)
+          ok = None not in R1 and None not in R
+          if ok:
+            lower = max(abs(M[i][j]) for M in (R1, R) for i in range(n)
+                        for j in range(i))
+            e = same_R(R, R0) / max(abs(x) for row in R0 for x in row)
+            ok = lower == 0.0 and e < 1e-10
+          check('cholqr2 %dx%d %d maps bs=%d pipeline=%d' % (
+              m, n, nmap, blocksize, pipeline), ok)
+  finally:
+    shutil.rmtree(tmp)
+
+def direct_stage1(A, nmap, matrix=None):
+  """Direct TSQR stage 1 on nmap mappers, or on one mapper reading the
+  matrix file.  Returns the R factors as (mapper id, R bytes) and the Q1
+  records as (mapper id, (Q1, keys))."""
+  outs = []
+  if matrix is not None:
+    outs.append(run(['--matrix', matrix, 'direct', '1'])[0])
+  else:
+    bounds = [len(A) * i // nmap for i in range(nmap + 1)]
+    for i in range(nmap):
+      data = b''.join(tb_int(j) + tb_row(A[j])
+                      for j in range(bounds[i], bounds[i + 1]))
+      outs.append(run(['direct', '1'], data)[0])
+  R_recs, Q_recs = [], []
+  for out in outs:
+    for k, v in read_pairs(out):
+      if k[0][1].startswith(b'R_'):
+        R_recs.append((k[1][1], v[1]))
+      else:
+        Q_recs.append((k[1][1], (v[0][1], v[1][1])))
+  return R_recs, Q_recs
+
+def direct_stage3(Q_recs, n, Q2, args=()):
+  """Direct TSQR stage 3; returns the rows of Q in row order."""
+  data = b''.join(tb_string(k) + tb_list([tb_bytes(Q1), tb_bytes(keys)])
+                  for k, (Q1, keys) in Q_recs)
+  out, err = run(['direct', '3', str(n), Q2] + list(args), data)
+  Q = dict((struct.unpack('>i', k[1][1:5])[0], doubles(v))
+           for k, v in read_pairs(out))
+  return [Q.get(i) for i in range(len(Q))]
+
+def write_Q2_text(path, recs):
+  """Write the (key, Q2 block) records as the text dump of stage 2."""
+  f = open(path, 'w')
+  for k, v in recs:
+    f.write('(%s)\t[%s]\n' % (k.decode('latin-1'),
+                              ', '.join(repr(x) for x in doubles(v))))
+  f.close()
+
+def direct_level(R_recs, level, ngroups, n, tmp):
+  """One extra level of stage 2: rgroup, a shuffle to two reducers and
+  rlevel.  Returns the R factors of the groups and the Q2 text dump."""
+  data = b''.join(tb_string(k) + tb_bytes(R) for k, R in R_recs)
+  out, err = run(['direct', 'rgroup', str(level), str(ngroups)], data)
+  pairs = sorted(read_pairs(out), key=lambda kv: kv[0][1])
+  groups = sorted(set(k[1] for k, v in pairs))
+  new_R, Q2 = [], []
+  for r in range(2):
+    data = b''.join(tb_string(k[1]) + tb_list([tb_bytes(v[0][1]),
+                                               tb_bytes(v[1][1])])
+                    for k, v in pairs if groups.index(k[1]) % 2 == r)
+    out, err = run(['direct', 'rlevel', str(n)], data)
+    for k, v in read_pairs(out):
+      if k[0][1] == b'Q2':
+        Q2.append((k[1][1], v))
+      else:
+        new_R.append((k[1][1], v[1]))
+  path = os.path.join(tmp, 'Q2_%d.txt.out' % level)
+  write_Q2_text(path, Q2)
+  ok = len(new_R) == len(groups) and len(Q2) == len(R_recs)
+  return new_R, path, ok
+
+def direct_stage2(R_recs, n, Q2):
+  """Direct TSQR stage 2, with the Q2 blocks in the binary file Q2, or
+  in the output for Q2 '-'.  Returns R and the Q2 records."""
+  data = b''.join(tb_string(k) + tb_bytes(R) for k, R in R_recs)
+  out, err = run(['direct', '2', str(n), Q2], data)
+  R = [None] * n
+  Q2_recs = []
+  for k, v in read_pairs(out):
+    if k[0][1] == b'Q2':
+      Q2_recs.append((k[1][1], v))
+    else:
+      R[k[1]] = doubles(v)
+  return R, Q2_recs
+
+def test_direct_q2file():
+  """Direct TSQR with the binary Q2 file, and truncated or corrupt Q2
+  files, which stage 3 must reject."""
+  tmp = tempfile.mkdtemp()
+  try:
+    m, n = 300, 6
+    A = rand_matrix(m, n, 12)
+    R_recs, Q_recs = direct_stage1(A, 4)
+    Q2 = os.path.join(tmp, 'Q2.bin')
+    R, Q2_recs = direct_stage2(R_recs, n, Q2)
+    Q = direct_stage3(Q_recs, n, Q2)
+    check_QR('direct %dx%d binary Q2' % (m, n), A, Q, R, None not in Q)
+    f = open(Q2, 'rb')
+    good = f.read()
+    f.close()
+    num_keys = struct.unpack('=Q', good[16:24])[0]
+    entry = 24
+    bad_files = [('truncated to %d bytes' % size, good[:size])
+                 for size in (30, 24 + 24 * num_keys, len(good) - 8)]
+    # the first entry: key_offset, key_size, data_offset
+    for name, field, value in (('key past the end', 0, len(good)),
+                               ('data past the end', 2, len(good) - 8),
+                               ('unaligned data', 2, 24 * num_keys + 28),
+                               ('huge index', -1, 1 << 62)):
+      if field < 0:
+        bad = good[:16] + struct.pack('=Q', value) + good[24:]
+      else:
+        pos = entry + 8 * field
+        bad = good[:pos] + struct.pack('=Q', value) + good[pos + 8:]
+      bad_files.append((name, bad))
+    for name, bad in bad_files:
+      path = os.path.join(tmp, 'bad.bin')
+      f = open(path, 'wb')
+      f.write(bad)
+      f.close()
+      data = b''.join(tb_string(k) + tb_list([tb_bytes(Q1), tb_bytes(keys)])
+                      for k, (Q1, keys) in Q_recs)
+      out, err = run(['direct', '3', str(n), path], data, ok=False)
+      check('direct Q2 file %s' % name,
+            out == b'' and 'corrupt Q2 file' in err)
+  finally:
+    shutil.rmtree(tmp)
+
+def test_direct_streaming():
+  """Direct TSQR stage 3 holding at most 1 or 2 Q1 blocks, with binary
+  and text Q2 files, against stage 3 holding all of them.  Q1 blocks
+  without a Q2 block in the text file are an error."""
+  tmp = tempfile.mkdtemp()
+  try:
+    m, n = 400, 5
+    A = rand_matrix(m, n, 13)
+    R_recs, Q_recs = direct_stage1(A, 6)
+    binary = os.path.join(tmp, 'Q2.bin')
+    R, Q2_recs = direct_stage2(R_recs, n, binary)
+    text = os.path.join(tmp, 'Q2.txt.out')
+    R, Q2_recs = direct_stage2(R_recs, n, '-')
+    write_Q2_text(text, Q2_recs)
+    for name, Q2 in (('binary', binary), ('text', text)):
+      Q0 = direct_stage3(Q_recs, n, Q2, ['0'])
+      check_QR('direct %dx%d %s Q2' % (m, n, name), A, Q0, R, None not in Q0)
+      for max_blocks in ('1', '2'):
+        Q = direct_stage3(Q_recs, n, Q2, [max_blocks])
+        check('direct %s Q2, max_blocks %s' % (name, max_blocks),
+              len(Q) == m and None not in Q and maxabs(Q, Q0) == 0.0)
+    # a text Q2 file without the block of the first mapper
+    missing = os.path.join(tmp, 'Q2_missing.txt.out')
+    write_Q2_text(missing, [(k, v) for k, v in Q2_recs
+                            if not k.endswith(Q_recs[0][0])])
+    data = b''.join(tb_string(k) + tb_list([tb_bytes(Q1), tb_bytes(keys)])
+                    for k, (Q1, keys) in Q_recs)
+    out, err = run(['direct', '3', str(n), missing, '2'], data, ok=False)
+    check('direct missing Q2 block', 'have no Q2 block' in err)
+  finally:
+    shutil.rmtree(tmp)
+
+def test_direct_levels():
+  """Direct TSQR with extra stage 2 levels (rgroup and rlevel), and
+  stage 3 along the levels, with text and binary Q2 files: Q R = A and
+  Q^T Q = I."""
+  tmp = tempfile.mkdtemp()
+  try:
+    for m, n in ((600, 5), (800, 10)):
+      A = rand_matrix(m, n, 11)
+      for nmap, schedule in ((12, [3]), (20, [5, 2]), (20, [4, 3, 1])):
+        R_recs, Q_recs = direct_stage1(A, nmap)
+        levels_ok = True
+        texts = []
+        for level, ngroups in enumerate(schedule, 1):
+          R_recs, path, ok = direct_level(R_recs, level, ngroups, n, tmp)
+          levels_ok = levels_ok and ok
+          texts.append(path)
+        top = os.path.join(tmp, 'Q2_top.bin')
+        data = b''.join(tb_string(k) + tb_bytes(R) for k, R in R_recs)
+        out, err = run(['direct', '2', str(n), top], data)
+        R = [None] * n
+        for k, v in read_pairs(out):
+          R[k[1]] = doubles(v)
+        bins = []
+        for path in texts:
+          bins.append(path.replace('.txt.out', '.bin'))
+          run(['direct', 'q2index', str(n), path, bins[-1]])
+        levels = ','.join('%d:%s' % (g, path) for g, path
+                          in zip(schedule, bins[1:] + [top]))
+        for binary in (True, False):
+          bottom = bins[0] if binary else texts[0]
+          Q = direct_stage3(Q_recs, n, bottom, ['0', '-', levels])
+          ok = levels_ok and len(Q) == m and None not in Q
+          if ok:
+            ok = maxabs(matmul(Q, R), A) < 1e-12 and \
+                maxabs(gram(Q), eye(n)) < 1e-12
+          check('direct %dx%d %d maps, levels %s%s' % (
+              m, n, nmap, schedule, '' if binary else ' text'), ok)
+  finally:
+    shutil.rmtree(tmp)
+
+def file_rows(out):
+  """The rows of the output under (name, int) file keys, by name."""
+  parts = {}
+  for k, v in read_pairs(out):
+    if isinstance(k, list) and isinstance(k[1], int):
+      rows = parts.setdefault(k[0][1].decode(), {})
+      rows[k[1]] = doubles(v)
+  return dict((name, [rows.get(i) for i in range(len(rows))])
+              for name, rows in parts.items())
+
+def check_svd(name, A, parts, U=None):
+  """Check Sigma against the singular values of A, that V and U_R are
+  orthogonal, that A V has orthogonal columns of norms Sigma and, given
+  the U of direct TSQR, that U is orthonormal and U Sigma V^T = A."""
+  n = len(A[0])
+  ok = all(len(parts.get(p, [])) == n and None not in parts[p]
+           for p in ('U', 'Sigma', 'V'))
+  if ok:
+    S = [s[0] for s in parts['Sigma']]
+    ref = [x ** 0.5 for x in sym_eigvals(gram(A))]
+    V = parts['V']
+    e = max(abs(s - r) for s, r in zip(S, ref)) / ref[0]
+    e = max(e, maxabs(gram(V), eye(n)), maxabs(gram(parts['U']), eye(n)))
+    S2 = [[S[i] ** 2 if i == j else 0.0 for j in range(n)] for i in range(n)]
+    e = max(e, maxabs(gram(matmul(A, V)), S2) / S[0] ** 2)
+    if U is not None:
+      ok = len(U) == len(A) and None not in U
+      if ok:
+        US = [[u * s for u, s in zip(row, S)] for row in U]
+        e = max(e, maxabs(gram(U), eye(n)),
+                maxabs(matmul(US, transpose(V)), A) / S[0])
+    ok = ok and e < 1e-11
+  check(name, ok)
+
+def test_svd():
+  """svd after indirect TSQR, with each row encoding, and the SVD of
+  direct TSQR: stage 2 outputs U_R, Sigma and V and stage 3 then outputs
+  U = Q U_R."""
+  tmp = tempfile.mkdtemp()
+  try:
+    for m, n in ((300, 5), (400, 10), (500, 25)):
+      A = rand_matrix(m, n, 7)
+      for enc in ('list', 'vector', 'bytes'):
+        for nmap, args in ((1, []), (3, []), (1, ['10', '1', '3', '2']),
+                           (3, ['10', '1', '3', '2'])):
+          if nmap == 1:
+            data = keyed_rows(A, enc)
+          else:
+            bounds = [m * i // nmap for i in range(nmap + 1)]
+            data = b''.join(
+                run(['indirect'] + args,
+                    b''.join(tb_int(j) + tb_row(A[j], enc)
+                             for j in range(bounds[i], bounds[i + 1])))[0]
+                for i in range(nmap))
+          check_svd('svd %dx%d %s %d maps %s' % (m, n, enc, nmap,
+                                                  ' '.join(args)),
+                    A, file_rows(run(['svd'] + args, data)[0]))
+      for nmap in (1, 4):
+        R_recs, Q_recs = direct_stage1(A, nmap)
+        data = b''.join(tb_string(k) + tb_bytes(R) for k, R in R_recs)
+        Q2 = os.path.join(tmp, 'Q2.bin')
+        parts = file_rows(run(['direct', '2', str(n), Q2, '1'], data)[0])
+        U_path = os.path.join(tmp, 'U.txt.out')
+        write_text_dump(U_path, enumerate(parts.get('U', [])))
+        for max_blocks in ('0', '1'):
+          U = direct_stage3(Q_recs, n, Q2, [max_blocks, U_path])
+          check_svd('direct svd %dx%d %d maps max_blocks=%s' % (
+              m, n, nmap, max_blocks), A, parts, U)
+  finally:
+    shutil.rmtree(tmp)
+
+def write_text_dump(path, recs):
+  f = open(path, 'w')
+  for k, v in recs:
+    f.write('(%s)\t[%s]\n' % (k, ', '.join(repr(x) for x in v)))
+  f.close()
+
+def householder(A, nmap, b, tmp):
+  """Blocked Householder QR with panels of b columns on nmap mappers;
+  returns R."""
+  n = len(A[0])
+  rows = [(tb_int(i), row) for i, row in enumerate(A)]
+  R = {}
+  panel = W = '-'
+  p = 0
+  while True:
+    # step 1, map only
+    bounds = [len(rows) * i // nmap for i in range(nmap + 1)]
+    new_rows, reduce_recs = [], []
+    for i in range(nmap):
+      data = b''.join(k + tb_row(row) for k, row in rows[bounds[i]:bounds[i + 1]])
+      out, err = run(['householder', '1', str(n), str(b), panel, W], data)
+      for k, v in read_pairs(out):
+        name = k[0][1]
+        if name == b'A_matrix':
+          new_rows.append((tb_key(k[1]), doubles(v)))
+        elif name == b'R_final':
+          R[k[1]] = doubles(v)
+        else:
+          reduce_recs.append((k[1], v))
+    rows = new_rows
+    if not reduce_recs:
+      break
+    # step 2, reduce
+    reduce_recs.sort(key=lambda kv: kv[0][1])
+    data = b''.join(tb_string(k[1]) + tb_list([tb_double(x) for x in doubles(v)])
+                    for k, v in reduce_recs)
+    out, err = run(['householder', '2'], data)
+    info = [(k[1].decode(), doubles(v)) for k, v in read_pairs(out)]
+    panel = os.path.join(tmp, 'panel%d.txt.out' % p)
+    write_text_dump(panel, info)
+    # the last panel: its rows of R are RH
+    width = len(rows[0][1])
+    nb = len([k for k, v in info if k.startswith('pivot:')])
+    if width == nb:
+      RH = dict(info)['RH']
+      for i in range(nb):
+        R[n - nb + i] = [0.0] * (n - nb + i) + \
+            [RH[i + j * nb] for j in range(i, nb)]
+      break
+    # step 3, W, with rowsum as the reducer
+    W_recs = {}
+    for i in range(nmap):
+      data = b''.join(k + tb_row(row) for k, row in rows[bounds[i]:bounds[i + 1]])
+      out, err = run(['householder', '3', panel], data)
+      for k, v in read_pairs(out):
+        W_recs.setdefault(k, []).append(doubles(v))
+    data = b''.join(tb_int(k) + tb_list([tb_double(x) for x in v])
+                    for k in sorted(W_recs) for v in W_recs[k])
+    out, err = run(['rowsum'], data)
+    W = os.path.join(tmp, 'W%d.txt.out' % p)
+    write_text_dump(W, [(k, doubles(v)) for k, v in read_pairs(out)])
+    p += 1
+  return [R.get(i) for i in range(n)]
+
+def test_householder():
+  """Blocked Householder QR: R is upper triangular and matches the
+  Cholesky factor of A^T A, up to the signs of its rows."""
+  tmp = tempfile.mkdtemp()
+  try:
+    for m, n in ((200, 5), (300, 10), (400, 37)):
+      A = rand_matrix(m, n, 5)
+      Rc = chol_R(gram(A))
+      scale = max(abs(x) for row in Rc for x in row)
+      for nmap in (1, 3):
+        for b in (1, 4, n) if n <= 10 else (8, n):
+          R = householder(A, nmap, b, tmp)
+          ok = None not in R
+          if ok:
+            lower = max(abs(R[i][j]) for i in range(n) for j in range(i))
+            ok = lower == 0.0 and same_R(R, Rc) / scale < 1e-11
+          check('householder %dx%d %d maps, b=%d' % (m, n, nmap, b), ok)
+  finally:
+    shutil.rmtree(tmp)
+
+def read_text_R(path):
+  f = open(path)
+  R = [[float(x) for x in line[line.index('[') + 1:line.rindex(']')].split(',')]
+       for line in f]
+  f.close()
+  return R
+
+def check_QR(name, A, Q, R, keys_ok=True):
+  """Check Q R = A, Q^T Q = I and R against the Cholesky factor of A^T A."""
+  ok = keys_ok and len(Q) == len(A)
+  if ok:
+    Rc = chol_R(gram(A))
+    scale = max(abs(x) for row in Rc for x in row)
+    ok = maxabs(matmul(Q, R), A) < 1e-12 and \
+        maxabs(gram(Q), eye(len(R))) < 1e-12 and same_R(R, Rc) / scale < 1e-11
+  check(name, ok)
+
+def test_local():
+  """Direct TSQR on one node from a typed bytes file or stdin, with
+  several threads and partitions: the keys come back in order with the
+  rows of Q."""
+  tmp = tempfile.mkdtemp()
+  try:
+    for m, n in ((200, 5), (333, 10), (30, 1), (12, 10)):
+      A = rand_matrix(m, n, 7)
+      keys = [i if i % 2 else ('string', b'r%d' % i) for i in range(m)]
+      data = b''.join(tb_key(keys[i]) + tb_row(A[i], ('list', 'bytes')[i % 2])
+                      for i in range(m))
+      path = os.path.join(tmp, 'A.tb')
+      f = open(path, 'wb')
+      f.write(data)
+      f.close()
+      R_path = os.path.join(tmp, 'R.txt.out')
+      for threads, parts, src in (('1', '1', path), ('2', '2', path),
+                                  ('3', '7', '-'), ('4', '100', path)):
+        out, err = run(['local', src, R_path, threads, parts],
+                       data if src == '-' else b'')
+        pairs = read_pairs(out)
+        check_QR('local %dx%d %s threads, %s parts%s' % (
+            m, n, threads, parts, ' stdin' if src == '-' else ''), A,
+                 [doubles(v) for k, v in pairs], read_text_R(R_path),
+                 [k for k, v in pairs] == keys)
+  finally:
+    shutil.rmtree(tmp)
+
+def tsqr_R(args, A, nmap, blocksize, extra=()):
+  """The map args + [blocksize] + extra on nmap mappers, then the indirect
+  TSQR reduce; returns the R records."""
+  bounds = [len(A) * i // nmap for i in range(nmap + 1)]
+  recs = []
+  for i in range(nmap):
+    data = b''.join(tb_int(j) + tb_row(A[j])
+                    for j in range(bounds[i], bounds[i + 1]))
+    recs += read_pairs(run(args + [blocksize] + list(extra), data)[0])
+  data = b''.join(tb_int(k) + tb_row(doubles(v)) for k, v in recs)
+  return [(k, doubles(v))
+          for k, v in read_pairs(run(['indirect', blocksize], data)[0])]
+
+def test_arinv():
+  """Q = A R1^-1 with R1 from indirect, once and refined with R2, the R
+  of A R1^-1 from arinv tsqr: Q is orthonormal and Q R2 R1 = A, with the
+  keys of A.  A singular R is an error."""
+  tmp = tempfile.mkdtemp()
+  try:
+    R1_path = os.path.join(tmp, 'R1.txt.out')
+    R2_path = os.path.join(tmp, 'R2.txt.out')
+    for m, n in ((300, 5), (500, 10), (400, 25)):
+      A = rand_matrix(m, n, 4)
+      # badly scaled columns
+      for row in A:
+        for j in range(n):
+          row[j] *= 10.0 ** (-8 * j / max(n - 1, 1))
+      data = b''.join(tb_string(b'r%d' % i) + tb_row(A[i], 'vector')
+                      for i in range(m))
+      for nmap in (1, 4):
+        for blocksize in ('2', '3', '20'):
+          write_text_dump(R1_path, tsqr_R(['indirect'], A, nmap, blocksize))
+          write_text_dump(R2_path, tsqr_R(
+              ['arinv', 'tsqr', str(n), R1_path], A, nmap, blocksize,
+              # pipelined, with 2 threads
+              ('1', '2', '2') if nmap > 1 else ()))
+          for R2 in ('-', R2_path):
+            out, err = run(['arinv', str(n), R1_path, R2, blocksize], data)
+            pairs = read_pairs(out)
+            ok = [k for k, v in pairs] == [('string', b'r%d' % i)
+                                           for i in range(m)]
+            if ok:
+              Q = [doubles(v) for k, v in pairs]
+              R = read_text_R(R1_path)
+              if R2 != '-':
+                R = matmul(read_text_R(R2), R)
+              QR = matmul(Q, R)
+              colmax = [max(abs(row[j]) for row in A) for j in range(n)]
+              e = max(abs(QR[i][j] - A[i][j]) / colmax[j]
+                      for i in range(m) for j in range(n))
+              # one pass of A R1^-1 loses orthogonality with the
+              # conditioning of A, the refinement recovers it
+              ok = e < 1e-10 and maxabs(gram(Q), eye(n)) < \
+                  (1e-2 if R2 == '-' else 1e-13)
+            check('arinv %dx%d %d maps bs=%s%s' % (
+                m, n, nmap, blocksize, ' refined' if R2 != '-' else ''), ok)
+
+    # a zero on the diagonal of R1 or R2
+    n = 4
+    A = rand_matrix(20, n, 5)
+    data = keyed_rows(A)
+    R = chol_R(gram(A))
+    singular = [list(row) for row in R]
+    singular[2][2] = 0.0
+    write_text_dump(R1_path, enumerate(singular))
+    write_text_dump(R2_path, enumerate(R))
+    for name, args in (('R1', ['arinv', str(n), R1_path]),
+                       ('R1 tsqr', ['arinv', 'tsqr', str(n), R1_path]),
+                       ('R2', ['arinv', str(n), R2_path, R1_path])):
+      out, err = run(args, data, ok=False)
+      check('arinv singular %s' % name, 'R is singular' in err)
+  finally:
+    shutil.rmtree(tmp)
+
+def solve_normal(A, B):
+  """X = (A^T A)^-1 A^T B, with R^T R = A^T A."""
+  R = chol_R(gram(A))
+  n = len(R)
+  AtB = matmul(transpose(A), B)
+  X = []
+  for c in range(len(B[0])):
+    y = [0.0] * n
+    for i in range(n):
+      y[i] = (AtB[i][c] - sum(R[k][i] * y[k] for k in range(i))) / R[i][i]
+    x = [0.0] * n
+    for i in reversed(range(n)):
+      x[i] = (y[i] - sum(R[i][k] * x[k] for k in range(i + 1, n))) / R[i][i]
+    X.append(x)
+  return transpose(X)
+
+def test_lstsq():
+  """lstsq on one task and after indirect maps on [A B]: X and the
+  residual norms match the normal equations of a well-conditioned A.
+  Too many right-hand sides and a rank-deficient A are errors."""
+  for m, n, k in ((200, 5, 1), (300, 10, 3), (500, 25, 2), (100, 1, 4)):
+    A = rand_matrix(m, n, 5)
+    B = rand_matrix(m, k, 6)
+    X0 = solve_normal(A, B)
+    AX = matmul(A, X0)
+    res0 = [sum((B[i][c] - AX[i][c]) ** 2 for i in range(m)) ** 0.5
+            for c in range(k)]
+    AB = [a + b for a, b in zip(A, B)]
+    for nmap in (0, 1, 4):
+      for blocksize, extra in (('2', []), ('3', ['1', '2', '2']), ('20', [])):
+        if nmap == 0:
+          data = keyed_rows(AB, 'vector')
+        else:
+          bounds = [m * i // nmap for i in range(nmap + 1)]
+          recs = []
+          for i in range(nmap):
+            out, err = run(['indirect', blocksize] + extra,
+                           b''.join(tb_int(j) + tb_row(AB[j])
+                                    for j in range(bounds[i], bounds[i + 1])))
+            recs += read_pairs(out)
+          data = b''.join(tb_int(key) + tb_row(doubles(v), 'bytes')
+                          for key, v in recs)
+        parts = file_rows(run(['lstsq', str(k), blocksize] + extra, data)[0])
+        X, res = parts.get('X', []), parts.get('residual', [])
+        ok = len(X) == n and None not in X and len(res) == 1
+        if ok:
+          ok = maxabs(X, X0) < 1e-12 and \
+              max(abs(r - r0) / r0 for r, r0 in zip(res[0], res0)) < 1e-12
+        check('lstsq %dx%d %d rhs %d maps bs=%s %s' % (
+            m, n, k, nmap, blocksize, ' '.join(extra)), ok)
+
+  A = rand_matrix(20, 3, 5)
+  out, err = run(['lstsq', '3'], keyed_rows(A), ok=False)
+  check('lstsq too many right-hand sides', 'right-hand sides' in err)
+  out, err = run(['lstsq', '1'], keyed_rows([[row[0], 2 * row[0], row[1]]
+                                             for row in A]), ok=False)
+  check('lstsq rank-deficient A', 'rank deficient' in err)
+
+def bta(A, B, keys, blocksize):
+  """B^T A with one bta mapper per matrix, a sort by key, one bta
+  reducer and rowsum."""
+  recs = []
+  for name, M in (('hdfs/A_mat', A), ('hdfs/B_mat', B)):
+    env = dict(os.environ, map_input_file=name)
+    data = b''.join(tb_key(k) + tb_row(row) for k, row in zip(keys, M))
+    out, err = run(['bta', '1', 'B_mat'], data, env=env)
+    recs += [(tb_key(k), tb_vector([tb_string(v[0][1]), tb_row(doubles(v[1]))]))
+             for k, v in read_pairs(out)]
+  # a stable sort keeps the rows of A and B of each key in the same order
+  recs.sort(key=lambda kv: kv[0])
+  out, err = run(['bta', '2', blocksize], b''.join(k + v for k, v in recs))
+  out, err = run(['rowsum'], out)
+  C = dict((k, doubles(v)) for k, v in read_pairs(out))
+  return [C.get(i) for i in range(len(B[0]))]
+
+def test_bta():
+  """B^T A, with one and several rows of A and B per key, and blocks
+  that fill up in the middle of a key."""
+  for m, na, nb in ((120, 3, 3), (200, 5, 2)):
+    A = rand_matrix(m, na, 2)
+    B = rand_matrix(m, nb, 3)
+    C0 = matmul(transpose(B), A)
+    for rows_per_key in (1, 2, 3):
+      keys = [i // rows_per_key if (i // rows_per_key) % 3 else
+              ('string', b'k%d' % (i // rows_per_key)) for i in range(m)]
+      for blocksize in ('1', '3'):
+        C = bta(A, B, keys, blocksize)
+        check('bta %dx%d %dx%d %d rows per key bs=%s' % (
+            m, na, m, nb, rows_per_key, blocksize),
+              None not in C and maxabs(C, C0) < 1e-12)
+
+def write_matrix_file(path, A, dtype='d', layout=0):
+  """Write a matrix file (see MatrixFile in tsqr_util.h) of doubles ('d')
+  or floats ('f'), row-major (layout 0) or column-major (1)."""
+  m, n = len(A), len(A[0])
+  if layout == 0:
+    values = [x for row in A for x in row]
+  else:
+    values = [x for col in transpose(A) for x in col]
+  f = open(path, 'wb')
+  f.write(b'MRTSQRMF' + struct.pack('=QQIIQ', m, n, int(dtype == 'f'),
+                                    layout, 64))
+  f.write(b'\0' * 24)
+  f.write(struct.pack('=%d%s' % (len(values), dtype), *values))
+  f.close()
+
+def test_matrix_file():
+  """--matrix on converted and hand-written matrix files (row-major,
+  column-major and float32), for the methods that read them, local on a
+  matrix file and a matrix file as the B of tsmatmul.  The methods that
+  cannot read matrix files fail."""
+  tmp = tempfile.mkdtemp()
+  try:
+    for m, n in ((200, 5), (333, 10)):
+      A = rand_matrix(m, n, 8)
+      data = keyed_rows(A)
+      A32 = [[struct.unpack('f', struct.pack('f', x))[0] for x in row]
+             for row in A]
+      files = []
+      for layout in ('row', 'col'):
+        path = os.path.join(tmp, 'A_%s.mat' % layout)
+        run(['convert', path, layout], data)
+        files.append((path, A))
+      path = os.path.join(tmp, 'A_f32.mat')
+      write_matrix_file(path, A32, 'f', 1)
+      files.append((path, A32))
+      for path, A0 in files:
+        name = '%dx%d %s' % (m, n, os.path.basename(path))
+        Rc = chol_R(gram(A0))
+        scale = max(abs(x) for row in Rc for x in row)
+        for blocksize, threads in (('2', '1'), ('3', '3')):
+          out, err = run(['--matrix', path, 'indirect', blocksize, '1', '0',
+                          threads])
+          R = [doubles(v) for k, v in read_pairs(out)]
+          check('matrix indirect %s bs=%s threads=%s' % (
+              name, blocksize, threads), same_R(R, Rc) / scale < 1e-12)
+        for method in (['ata'], ['cholqr2', '1']):
+          out, err = run(['--matrix', path] + method + ['3'])
+          C = dict((k, doubles(v)) for k, v in read_pairs(out))
+          G = gram(A0)
+          ok = sorted(C) == list(range(n)) and upper_maxabs(
+              [C[i] for i in range(n)], G) < 1e-10
+          check('matrix %s %s' % (method[0], name), ok)
+        R_path = os.path.join(tmp, 'R.txt.out')
+        out, err = run(['local', path, R_path, '3'])
+        pairs = read_pairs(out)
+        check_QR('matrix local %s' % name, A0, [doubles(v) for k, v in pairs],
+                 read_text_R(R_path), [k for k, v in pairs] == list(range(m)))
+        R_recs, Q_recs = direct_stage1(A0, 1, path)
+        Q2 = os.path.join(tmp, 'Q2.bin')
+        data2 = b''.join(tb_string(k) + tb_bytes(R) for k, R in R_recs)
+        out, err = run(['direct', '2', str(n), Q2], data2)
+        R = [None] * n
+        for k, v in read_pairs(out):
+          R[k[1]] = doubles(v)
+        check_QR('matrix direct %s' % name, A0,
+                 direct_stage3(Q_recs, n, Q2), R)
+      # a matrix file as the B of tsmatmul
+      B = rand_matrix(n, 3, 9)
+      B_path = os.path.join(tmp, 'B.mat')
+      write_matrix_file(B_path, B, 'd', 1)
+      out, err = run(['tsmatmul', B_path], data)
+      C = [doubles(v) for k, v in read_pairs(out)]
+      check('matrix tsmatmul B %dx%d' % (m, n),
+            len(C) == m and maxabs(C, matmul(A, B)) < 1e-13)
+    # the methods that cannot read a matrix file
+    for args in (['tsmatmul', B_path], ['rowsum'], ['bta', '2'],
+                 ['direct', '3', str(n)], ['local', '-', '-']):
+      out, err = run(['--matrix', path] + args, ok=False)
+      check('matrix rejected by %s' % args[0],
+            out == b'' and 'error' in err)
+    # a truncated file is not a matrix file
+    bad = os.path.join(tmp, 'bad.mat')
+    write_matrix_file(bad, rand_matrix(10, 3), 'd', 0)
+    f = open(bad, 'r+b')
+    f.truncate(64 + 8 * 29)
+    f.close()
+    out, err = run(['--matrix', bad, 'indirect'], ok=False)
+    check('matrix truncated file', 'not a matrix file' in err)
+  finally:
+    shutil.rmtree(tmp)
+
+tests = [
+  ('ata', test_ata),
+  ('pipeline', test_pipeline),
+  ('threads', test_threads),
+  ('rowsum', test_rowsum),
+  ('cholqr2', test_cholqr2),
+  ('direct_q2file', test_direct_q2file),
+  ('direct_streaming', test_direct_streaming),
+  ('direct_levels', test_direct_levels),
+  ('svd', test_svd),
+  ('householder', test_householder),
+  ('arinv', test_arinv),
+  ('lstsq', test_lstsq),
+  ('bta', test_bta),
+  ('local', test_local),
+  ('matrix_file', test_matrix_file),
+  ]
+
+if __name__ == '__main__':
+  if len(sys.argv) > 1:
+    tsqr = sys.argv[1]
+  names = sys.argv[2:]
+  for name, test in tests:
+    if not names or name in names:
+      try:
+        test()
+      except RuntimeError as e:
+        check('%s: %s' % (name, e), False)
+  if failures:
+    print('%d checks failed' % failures)
+    sys.exit(1)
@@ -0,0 +1,134 @@
+/**
+   Copyright (c) 2012-2014, Austin Benson and David Gleich
+   All rights reserved.
+
+   This file is part of MRTSQR and is under the BSD 2-Clause License,
+   which can be found in the LICENSE file in the root directory, or at
+   http://opensource.org/licenses/BSD-2-Clause
+*/
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <vector>
+
+#include "mrmc.h"
+#include "sparfun_util.h"
+#include "tsqr_util.h"
+#include "typedbytes.h"
+
+void TSMatMul::setup() {
+  if (B_rows_ == 0) {
+    B_rows_ = num_cols_;
+  }
+  if (B_rows_ != num_cols_ || B_.empty() || B_.size() % B_rows_ != 0) {
+    hadoop_error("B is %zu entries in %zu rows, but A has %zu columns\n",
+                 B_.size(), B_rows_, num_cols_);
+  }
+  out_cols_ = B_.size() / B_rows_;
+  hadoop_message("B is %zu x %zu\n", B_rows_, out_cols_);
+}
+
+void TSMatMul::first_row() {
+  typedbytes_opaque key;
+  std::vector<double> row;
+  read_key_val_pair(key, row);
+  num_cols_ = row.size();
+  hadoop_message("matrix size: %zi columns, up to %i localrows\n",
+                 num_cols_, blocksize_ * num_cols_);
+  if (num_cols_ == 0) {
+    hadoop_message("no data received on this task\n");
+    return;
+  }
+  setup();
+  alloc(blocksize_ * num_cols_, num_cols_);
+  keys_.push_back(key.empty() ? NULL : &key[0], key.size());
+  add_row(row);
+  if (num_local_rows_ >= num_rows_) {
+    compress();
+  }
+}
+
+void TSMatMul::mapper() {
+  first_row();
+  typedbytes_opaque key;
+  while (num_cols_ > 0 && !in_.eof()) {
+    key.clear();
+    if (!in_.read_opaque(key)) {
+      if (in_.eof()) {
+        break;
+      } else {
+        hadoop_error("invalid key: row %i\n", num_total_rows_);
+      }
+    }
+    keys_.push_back(key.empty() ? NULL : &key[0], key.size());
+    read_local_row();
+    if (num_local_rows_ >= num_rows_) {
+      compress();
+      hadoop_counter("compressions", 1);
+    }
+  }
+  hadoop_status("final output");
+  output();
+}
+
+void TSMatMul::multiply_block() {
+  // The row-major product is the column-major (A B)^T = B^T A^T, and the
+  // row-major B is the column-major B^T.
+  lapack_gemm(false, true, out_cols_, num_local_rows_, num_cols_, 1.0,
+              &B_[0], out_cols_, &local_matrix_[0], num_rows_, 0.0,
+              &product_[0], out_cols_);
+}
+
+void TSMatMul::compress() {
+  size_t urows = num_local_rows_;
+  if (urows == 0) {
+    return;
+  }
+  product_.resize(urows * out_cols_);
+  double t0 = sf_time();
+  multiply_block();
+  incr_lapack_time(sf_time() - t0);
+  assert(keys_.size() == urows);
+  for (size_t i = 0; i < urows; ++i) {
+    write_key(keys_.key(i), keys_.key_size(i));
+    out_.write_byte_sequence((unsigned char *) &product_[i * out_cols_],
+                             out_cols_ * sizeof(double));
+  }
+  num_local_rows_ = 0;
+  keys_.clear();
+}
+
+void TSMatMul::output() {
+  if (num_cols_ == 0) {
+    // no data was received on this task
+    return;
+  }
+  compress();
+}
+
+void ARInv::setup() {
+  TSMatMul::setup();
+  if (out_cols_ != num_cols_ ||
+      (!R2_.empty() && R2_.size() != num_cols_ * num_cols_)) {
+    hadoop_error("R is not %zu x %zu\n", num_cols_, num_cols_);
+  }
+  for (size_t i = 0; i < num_cols_; ++i) {
+    if (B_[i + i * num_cols_] == 0.0 ||
+        (!R2_.empty() && R2_[i + i * num_cols_] == 0.0)) {
+      hadoop_error("R is singular: zero at diagonal entry %zu\n", i);
+    }
+  }
+}
+
+void ARInv::multiply_block() {
+  lapack_trsm(&local_matrix_[0], num_rows_, num_local_rows_, num_cols_,
+              &B_[0]);
+  if (!R2_.empty()) {
+    lapack_trsm(&local_matrix_[0], num_rows_, num_local_rows_, num_cols_,
+                &R2_[0]);
+  }
+  transpose(&local_matrix_[0], num_rows_, &product_[0], num_cols_,
+            num_local_rows_, num_cols_);
+}
@@ -0,0 +1,347 @@
+/**
+   Copyright (c) 2012-2014, Austin Benson and David Gleich
+   All rights reserved.
+
+   This file is part of MRTSQR and is under the BSD 2-Clause License,
+   which can be found in the LICENSE file in the root directory, or at
+   http://opensource.org/licenses/BSD-2-Clause
+*/
+
+/**
+ * @file tsqr_bench.cc
+ * Microbenchmarks for the typed bytes row decoder and encoder and for the
+ * local LAPACK kernels of the tsqr mappers.
+ *
+ * usage: tsqr_bench [ncols_list [blocksize_list [reps]]]
+ *   ncols_list      comma separated numbers of columns (default 10,50,200)
+ *   blocksize_list  comma separated blocksizes; a block has
+ *                   blocksize * ncols rows, as in the mappers (default 3,50)
+ *   reps            timed samples per benchmark (default 9)
+ *
+ * Each sample runs the benchmark enough times to take about 10 ms, after
+ * one untimed warm up run.  The throughput columns use the median
+ * sample; p10, p50 and p90 are the sample percentiles of the time per run.
+ * The decode and encode benchmarks stream about 32 MB of rows and do not
+ * depend on the blocksize.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "mrmc.h"
+#include "sparfun_util.h"
+#include "tsqr_util.h"
+#include "typedbytes.h"
+
+// bytes of encoded rows for the decode and encode benchmarks
+#define BENCH_STREAM_BYTES (32 << 20)
+// minimum time of one sample, in seconds
+#define BENCH_MIN_SAMPLE_TIME 0.01
+
+enum RowEncoding {
+  ROW_VECTOR,
+  ROW_LIST,
+  ROW_BYTE_SEQUENCE,
+  ROW_STRING,
+};
+
+static const char *encoding_name(RowEncoding enc) {
+  switch (enc) {
+  case ROW_VECTOR:
+    return "vector";
+  case ROW_LIST:
+    return "list";
+  case ROW_BYTE_SEQUENCE:
+    return "bytes";
+  case ROW_STRING:
+    return "string";
+  }
+  return "?";
+}
+
+// A MatrixHandler that only decodes rows.
+class BenchHandler : public MatrixHandler {
+public:
+  BenchHandler(TypedBytesInFile& in, TypedBytesOutFile& out, size_t ncols)
+    : MatrixHandler(in, out, 1, 1) {
+    num_cols_ = ncols;
+  }
+  void collect(typedbytes_opaque& key, std::vector<double>& value) {}
+  void output() {}
+};
+
+class Bench {
+public:
+  Bench(size_t reps) : reps_(reps) {}
+
+  // Time run() and print a line of results.  Per run, the benchmark
+  // handles rows rows and moves bytes bytes with flops flops; pass 0 for
+  // the figures that do not apply.
+  template <typename F>
+  void time(const char *name, size_t ncols, size_t blocksize, size_t rows,
+            double bytes, double flops, F run) {
+    wall_timer t;
+    run();
+    double once = t.dt();
+    size_t iters = 1;
+    if (once < BENCH_MIN_SAMPLE_TIME) {
+      iters = (size_t) (BENCH_MIN_SAMPLE_TIME / std::max(once, 1e-7)) + 1;
+    }
+    std::vector<double> samples(reps_);
+    for (size_t r = 0; r < reps_; ++r) {
+      t.start();
+      for (size_t i = 0; i < iters; ++i) {
+        run();
+      }
+      samples[r] = t.dt() / (double) iters;
+    }
+    std::sort(samples.begin(), samples.end());
+    double p50 = percentile(samples, 0.5);
+
+    char bsize[32] = "-";
+    if (blocksize > 0) {
+      snprintf(bsize, sizeof(bsize), "%zu", blocksize);
+    }
+    printf("%-22s %5zu %6s %8zu %11.4g ", name, ncols, bsize, rows,
+           rows / p50);
+    print_rate(bytes / p50 / 1e9);
+    print_rate(flops / p50 / 1e9);
+    printf("%9.4f %9.4f %9.4f\n", 1e3 * percentile(samples, 0.1),
+           1e3 * p50, 1e3 * percentile(samples, 0.9));
+    fflush(stdout);
+  }
+
+  static void header() {
+    printf("%-22s %5s %6s %8s %11s %8s %8s %9s %9s %9s\n", "benchmark",
+           "ncols", "bsize", "rows", "rows/s", "GB/s", "GFLOP/s", "p10 ms",
+           "p50 ms", "p90 ms");
+  }
+
+private:
+  // the nearest-rank percentile of the sorted samples
+  static double percentile(const std::vector<double>& sorted, double p) {
+    size_t i = (size_t) (p * (double) (sorted.size() - 1) + 0.5);
+    return sorted[i];
+  }
+
+  static void print_rate(double rate) {
+    if (rate > 0) {
+      printf("%8.3f ", rate);
+    } else {
+      printf("%8s ", "-");
+    }
+  }
+
+  size_t reps_;
+};
+
+static void rand_matrix(std::vector<double>& A, size_t size) {
+  A.resize(size);
+  for (size_t i = 0; i < size; ++i) {
+    A[i] = sf_rand(-1.0, 1.0);
+  }
+}
+
+static void write_rows(TypedBytesOutFile& out, RowEncoding enc,
+                       const double *A, size_t nrows, size_t ncols) {
+  for (size_t i = 0; i < nrows; ++i) {
+    const double *row = A + i * ncols;
+    switch (enc) {
+    case ROW_VECTOR:
+      out.write_double_vector(row, ncols);
+      break;
+    case ROW_LIST:
+      out.write_double_list(row, ncols);
+      break;
+    case ROW_BYTE_SEQUENCE:
+      out.write_byte_sequence((unsigned char *) row,
+                              (typedbytes_length) (ncols * sizeof(double)));
+      break;
+    case ROW_STRING:
+      out.write_string((const char *) row,
+                       (typedbytes_length) (ncols * sizeof(double)));
+      break;
+    }
+  }
+}
+
+// Decode and encode nrows rows of each encoding.
+static void bench_stream(Bench& bench, size_t ncols) {
+  size_t nrows = BENCH_STREAM_BYTES / (ncols * sizeof(double));
+  std::vector<double> A;
+  rand_matrix(A, nrows * ncols);
+
+  FILE *null_stream = fopen("/dev/null", "wb");
+  if (!null_stream) {
+    fprintf(stderr, "cannot open /dev/null\n");
+    exit(1);
+  }
+  TypedBytesOutFile null_out(null_stream);
+
+  RowEncoding encodings[] = {ROW_VECTOR, ROW_LIST, ROW_BYTE_SEQUENCE,
+                             ROW_STRING};
+  for (size_t e = 0; e < sizeof(encodings) / sizeof(encodings[0]); ++e) {
+    RowEncoding enc = encodings[e];
+    FILE *f = tmpfile();
+    if (!f) {
+      fprintf(stderr, "cannot open a temporary file\n");
+      exit(1);
+    }
+    TypedBytesOutFile out(f);
+    write_rows(out, enc, &A[0], nrows, ncols);
+    out.flush();
+    double bytes = (double) ftell(f);
+
+    std::string name;
+    std::vector<double> row;
+    std::vector<double> block(ncols);
+    name = std::string("read_full_row/") + encoding_name(enc);
+    bench.time(name.c_str(), ncols, 0, nrows, bytes, 0, [&]() {
+        rewind(f);
+        TypedBytesInFile in(f);
+        BenchHandler handler(in, null_out, ncols);
+        for (size_t i = 0; i < nrows; ++i) {
+          handler.read_full_row(row);
+        }
+      });
+    name = std::string("read_row/") + encoding_name(enc);
+    bench.time(name.c_str(), ncols, 0, nrows, bytes, 0, [&]() {
+        rewind(f);
+        TypedBytesInFile in(f);
+        BenchHandler handler(in, null_out, ncols);
+        for (size_t i = 0; i < nrows; ++i) {
+          handler.read_row(&block[0], 1);
+        }
+      });
+    name = std::string("write/") + encoding_name(enc);
+    bench.time(name.c_str(), ncols, 0, nrows, bytes, 0, [&]() {
+        write_rows(null_out, enc, &A[0], nrows, ncols);
+        null_out.flush();
+      });
+    fclose(f);
+  }
+  fclose(null_stream);
+
+  // the same rows as a matrix file, copied out one block at a time
+  char path[] = "/tmp/tsqr_bench_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    fprintf(stderr, "cannot create a temporary matrix file\n");
+    exit(1);
+  }
+  close(fd);
+  MatrixFile file;
+  if (!write_matrix_file(path, &A[0], nrows, ncols) || !file.open(path)) {
+    fprintf(stderr, "cannot write the matrix file %s\n", path);
+    exit(1);
+  }
+  unlink(path);
+  size_t block_rows = 50 * ncols;
+  std::vector<double> block(block_rows * ncols);
+  bench.time("matrix_file/read_block", ncols, 0, nrows,
+             (double) (nrows * ncols * sizeof(double)), 0, [&]() {
+      for (size_t first = 0; first < nrows; first += block_rows) {
+        size_t rows = std::min(block_rows, nrows - first);
+        file.read_block(first, rows, &block[0], block_rows);
+      }
+    });
+}
+
+// The kernels on one blocksize * ncols x ncols column-major block.
+static void bench_kernels(Bench& bench, size_t ncols, size_t blocksize) {
+  size_t m = blocksize * ncols;
+  double n = (double) ncols;
+  double mn = (double) m * n;
+  double block_bytes = mn * sizeof(double);
+  std::vector<double> A0, A, B, C, R(ncols * ncols);
+  rand_matrix(A0, m * ncols);
+  rand_matrix(B, ncols * ncols);
+  C.resize(m * ncols);
+  LapackContext ctx;
+
+  A = A0;
+  bench.time("lapack_qr", ncols, blocksize, m, block_bytes,
+             2 * mn * n - 2 * n * n * n / 3, [&]() {
+      lapack_qr(&A[0], m, ncols, m, ctx);
+    });
+  A = A0;
+  bench.time("lapack_full_qr", ncols, blocksize, m, block_bytes,
+             4 * mn * n - 4 * n * n * n / 3, [&]() {
+      lapack_full_qr(&A[0], &R[0], m, ncols, m, ctx);
+    });
+  A = A0;
+  bench.time("lapack_syrk", ncols, blocksize, m, block_bytes,
+             mn * (n + 1), [&]() {
+      lapack_syrk(&A[0], &R[0], m, ncols, m);
+    });
+  bench.time("lapack_tsmatmul", ncols, blocksize, m, 2 * block_bytes,
+             2 * mn * n, [&]() {
+      lapack_tsmatmul(&A[0], m, ncols, &B[0], ncols, &C[0]);
+    });
+  bench.time("row_to_col_major", ncols, blocksize, m, 2 * block_bytes, 0,
+             [&]() {
+      row_to_col_major(&A[0], &C[0], m, ncols);
+    });
+  bench.time("col_to_row_major", ncols, blocksize, m, 2 * block_bytes, 0,
+             [&]() {
+      col_to_row_major(&A[0], &C[0], m, ncols);
+    });
+  bench.time("transpose_square", ncols, blocksize, ncols,
+             2 * n * n * sizeof(double), 0, [&]() {
+      transpose_square(&B[0], ncols);
+    });
+}
+
+static bool parse_list(const char *arg, std::vector<size_t>& list) {
+  list.clear();
+  std::string s(arg);
+  size_t pos = 0;
+  while (pos <= s.size()) {
+    size_t end = s.find(',', pos);
+    if (end == std::string::npos) {
+      end = s.size();
+    }
+    int val = atoi(s.substr(pos, end - pos).c_str());
+    if (val <= 0) {
+      return false;
+    }
+    list.push_back((size_t) val);
+    pos = end + 1;
+  }
+  return !list.empty();
+}
+
+int main(int argc, char **argv) {
+  std::vector<size_t> ncols_list, blocksize_list;
+  parse_list("10,50,200", ncols_list);
+  parse_list("3,50", blocksize_list);
+  size_t reps = 9;
+  if ((argc > 1 && !parse_list(argv[1], ncols_list)) ||
+      (argc > 2 && !parse_list(argv[2], blocksize_list)) ||
+      (argc > 3 && atoi(argv[3]) <= 0) || argc > 4) {
+    fprintf(stderr, "usage: tsqr_bench [ncols_list [blocksize_list [reps]]]\n");
+    return 1;
+  }
+  if (argc > 3) {
+    reps = (size_t) atoi(argv[3]);
+  }
+
+  sf_srand(1);
+  Bench bench(reps);
+  Bench::header();
+  for (size_t i = 0; i < ncols_list.size(); ++i) {
+    bench_stream(bench, ncols_list[i]);
+  }
+  for (size_t i = 0; i < ncols_list.size(); ++i) {
+    for (size_t j = 0; j < blocksize_list.size(); ++j) {
+      bench_kernels(bench, ncols_list[i], blocksize_list[j]);
+    }
+  }
+  return 0;
+}
@@ -9,6 +9,8 @@
 
 #include "tsqr_util.h"
 
+#include <string.h>
+
 #include <algorithm>
 #include <vector>
 
@@ -55,18 +57,55 @@ void hadoop_counter(const char* name, int val) {
   fprintf(stderr, "reporter:counter:Program,%s,%i\n", name, val);
 }
 
+// The transposes work on TRANSPOSE_TILE x TRANSPOSE_TILE tiles, so that
+// both the rows read and the columns written stay in cache.
+#define TRANSPOSE_TILE 32
+
+// Copy the column-major m x n matrix A (leading dimension lda) to the
+// column-major n x m matrix B (leading dimension ldb).
+void transpose(const double *A, size_t lda, double *B, size_t ldb,
+               size_t m, size_t n) {
+  for (size_t jj = 0; jj < n; jj += TRANSPOSE_TILE) {
+    size_t jend = std::min(jj + TRANSPOSE_TILE, n);
+    for (size_t ii = 0; ii < m; ii += TRANSPOSE_TILE) {
+      size_t iend = std::min(ii + TRANSPOSE_TILE, m);
+      for (size_t i = ii; i < iend; ++i) {
+        // contiguous writes to row i of A^T; the compiler vectorizes this
+        double *dst = B + jj + i * ldb;
+        const double *src = A + i + jj * lda;
+        for (size_t j = 0; j < jend - jj; ++j) {
+          dst[j] = src[j * lda];
+        }
+      }
+    }
+  }
+}
+
 // Copy A (row-major) to B (col-major)
 void row_to_col_major(double *A, double *B, size_t num_rows, size_t num_cols) {
-  for (size_t i = 0; i < num_rows; ++i)
-    for (size_t j = 0; j < num_cols; ++j)
-      B[i + j * num_rows] = A[i * num_cols + j];
+  // A is the column-major num_cols x num_rows transpose
+  transpose(A, num_cols, B, num_rows, num_cols, num_rows);
 }
 
 // Copy A (col-major) to B (row-major)
 void col_to_row_major(double *A, double *B, size_t num_rows, size_t num_cols) {
-  for (size_t i = 0; i < num_rows; ++i)
-    for (size_t j = 0; j < num_cols; ++j)
-      B[i * num_cols + j] = A[i + j * num_rows];
+  transpose(A, num_rows, B, num_cols, num_rows, num_cols);
+}
+
+// Transpose the n x n matrix A in place
+void transpose_square(double *A, size_t n) {
+  for (size_t jj = 0; jj < n; jj += TRANSPOSE_TILE) {
+    size_t jend = std::min(jj + TRANSPOSE_TILE, n);
+    for (size_t ii = jj; ii < n; ii += TRANSPOSE_TILE) {
+      size_t iend = std::min(ii + TRANSPOSE_TILE, n);
+      for (size_t j = jj; j < jend; ++j) {
+        // swap the tile below the diagonal with the one above
+        for (size_t i = std::max(ii, j + 1); i < iend; ++i) {
+          std::swap(A[i + j * n], A[j + i * n]);
+        }
+      }
+    }
+  }
 }
 
 extern "C" {
@@ -76,6 +115,13 @@ extern "C" {
 	      double *work, int *lwork, int *info);
   void dorgqr_(int *m, int *n, int *k, double *a, int *lda, double *tau,
 	       double *work, int *lwork, int *info);
+  void dgelqf_(int *m, int *n, double *a, int *lda, double *tau,
+               double *work, int *lwork, int *info);
+  void dorglq_(int *m, int *n, int *k, double *a, int *lda, double *tau,
+               double *work, int *lwork, int *info);
+  void dtpqrt_(int *m, int *n, int *l, int *nb, double *a, int *lda,
+               double *b, int *ldb, double *t, int *ldt, double *work,
+               int *info);
   void dsyrk_(char *uplo, char *trans, int *m, int *k, double *alpha,
               double *A, int *lda, double *beta, double *C, int *ldc);
   void daxpy_(int *n, double *alpha, double *x, int *incx, double *y, int *incy);
@@ -83,6 +129,93 @@ extern "C" {
   void dgemm_(char *transa, char *transb, int *m, int *n, int *k, double *alpha,
               double *A, int *lda, double *B, int *ldb, double *beta, double *C,
               int *ldc);
+  void dtrsm_(char *side, char *uplo, char *transa, char *diag, int *m, int *n,
+              double *alpha, double *A, int *lda, double *B, int *ldb);
+  void dtrmm_(char *side, char *uplo, char *transa, char *diag, int *m, int *n,
+              double *alpha, double *A, int *lda, double *B, int *ldb);
+  void dgesdd_(char *jobz, int *m, int *n, double *A, int *lda, double *S,
+               double *U, int *ldu, double *Vt, int *ldvt, double *work,
+               int *lwork, int *iwork, int *info);
+}
+
+double *LapackContext::tau(size_t size) {
+  if (tau_.size() < size) {
+    tau_.resize(size);
+  }
+  return tau_.empty() ? NULL : &tau_[0];
+}
+
+double *LapackContext::work(size_t size) {
+  if (work_.size() < size) {
+    work_.resize(size);
+  }
+  return work_.empty() ? NULL : &work_[0];
+}
+
+// Returns -1 if the workspace query fails.
+int LapackContext::geqrf_lwork(int m, int n, double *A, int lda) {
+  std::pair<int, int> shape(m, n);
+  std::map<std::pair<int, int>, int>::iterator it = geqrf_lwork_.find(shape);
+  if (it != geqrf_lwork_.end()) {
+    return it->second;
+  }
+  double worksize;
+  int lworkq = -1;
+  int info = -1;
+  dgeqrf_(&m, &n, A, &lda, tau(std::min(m, n)), &worksize, &lworkq, &info);
+  int lwork = info == 0 ? std::max((int) worksize, 1) : -1;
+  geqrf_lwork_[shape] = lwork;
+  return lwork;
+}
+
+// Returns -1 if the workspace query fails.
+int LapackContext::orgqr_lwork(int m, int n, int k, double *A, int lda,
+                               double *tau) {
+  std::pair<int, int> shape(m, n);
+  std::map<std::pair<int, int>, int>::iterator it = orgqr_lwork_.find(shape);
+  if (it != orgqr_lwork_.end()) {
+    return it->second;
+  }
+  double worksize;
+  int lworkq = -1;
+  int info = -1;
+  dorgqr_(&m, &n, &k, A, &lda, tau, &worksize, &lworkq, &info);
+  int lwork = info == 0 ? std::max((int) worksize, 1) : -1;
+  orgqr_lwork_[shape] = lwork;
+  return lwork;
+}
+
+// Returns -1 if the workspace query fails.
+int LapackContext::gelqf_lwork(int m, int n, double *A, int lda) {
+  std::pair<int, int> shape(m, n);
+  std::map<std::pair<int, int>, int>::iterator it = gelqf_lwork_.find(shape);
+  if (it != gelqf_lwork_.end()) {
+    return it->second;
+  }
+  double worksize;
+  int lworkq = -1;
+  int info = -1;
+  dgelqf_(&m, &n, A, &lda, tau(std::min(m, n)), &worksize, &lworkq, &info);
+  int lwork = info == 0 ? std::max((int) worksize, 1) : -1;
+  gelqf_lwork_[shape] = lwork;
+  return lwork;
+}
+
+// Returns -1 if the workspace query fails.
+int LapackContext::orglq_lwork(int m, int n, int k, double *A, int lda,
+                               double *tau) {
+  std::pair<int, int> shape(m, n);
+  std::map<std::pair<int, int>, int>::iterator it = orglq_lwork_.find(shape);
+  if (it != orglq_lwork_.end()) {
+    return it->second;
+  }
+  double worksize;
+  int lworkq = -1;
+  int info = -1;
+  dorglq_(&m, &n, &k, A, &lda, tau, &worksize, &lworkq, &info);
+  int lwork = info == 0 ? std::max((int) worksize, 1) : -1;
+  orglq_lwork_[shape] = lwork;
+  return lwork;
 }
 
 /** Run a LAPACK daxpy
@@ -138,24 +271,56 @@ bool lapack_syrk(double* A, double* C, size_t nrows, size_t ncols,
   return true;
 }
 
+/** Add the upper triangle of A^T A to C, without BLAS.  Rows are
+ * taken four at a time so that each column of C is loaded and stored
+ * once per four rows; the inner loops vectorize.  Meant for narrow A.
+ * @param A the row-major matrix
+ * @param nrows the number of rows of A
+ * @param ncols the number of columns of A
+ * @param C the column-major ncols x ncols result
+ */
+void gram_update(const double *A, size_t nrows, size_t ncols, double *C) {
+  size_t r = 0;
+  for (; r + 4 <= nrows; r += 4) {
+    const double *a0 = A + r * ncols;
+    const double *a1 = a0 + ncols;
+    const double *a2 = a1 + ncols;
+    const double *a3 = a2 + ncols;
+    for (size_t j = 0; j < ncols; ++j) {
+      double b0 = a0[j];
+      double b1 = a1[j];
+      double b2 = a2[j];
+      double b3 = a3[j];
+      double *c = C + j * ncols;
+      for (size_t i = 0; i <= j; ++i) {
+        c[i] += a0[i] * b0 + a1[i] * b1 + a2[i] * b2 + a3[i] * b3;
+      }
+    }
+  }
+  for (; r < nrows; ++r) {
+    const double *a = A + r * ncols;
+    for (size_t j = 0; j < ncols; ++j) {
+      double b = a[j];
+      double *c = C + j * ncols;
+      for (size_t i = 0; i <= j; ++i) {
+        c[i] += a[i] * b;
+      }
+    }
+  }
+}
+
 bool _lapack_qr(double *A, size_t nrows, size_t ncols, size_t urows,
-                std::vector<double>& tau) {
+                double *tau, LapackContext& ctx) {
   int info = -1;
   int n = ncols;
   int m = urows;
   int stride = nrows;
 
-  // do a workspace query
-  double worksize;
-  int lworkq = -1;  
-  dgeqrf_(&m, &n, A, &stride, &tau[0], &worksize, &lworkq, &info);
-  if (info != 0) {
+  int lwork = ctx.geqrf_lwork(m, n, A, stride);
+  if (lwork < 0) {
     return false;
   }
-
-  int lwork = (int) worksize;
-  std::vector<double> work(lwork);
-  dgeqrf_(&m, &n, A, &stride, &tau[0], &work[0], &lwork, &info);
+  dgeqrf_(&m, &n, A, &stride, tau, ctx.work(lwork), &lwork, &info);
   if (info != 0) {
     return false;
   }
@@ -180,11 +345,10 @@ void zero_out_lower_triangle(double *A, size_t rsize, size_t nrows) {
  * In LAPACK parlance, nrows is the stride, and urows is
  * the size
  */
-bool lapack_qr(double* A, size_t nrows, size_t ncols, size_t urows) {
-  // allocate space for tau's
+bool lapack_qr(double* A, size_t nrows, size_t ncols, size_t urows,
+               LapackContext& ctx) {
   int minsize = std::min(urows, ncols);
-  std::vector<double> tau(minsize);
-  if (!_lapack_qr(A, nrows, ncols, urows, tau)) {
+  if (!_lapack_qr(A, nrows, ncols, urows, ctx.tau(minsize), ctx)) {
     return false;
   }
   
@@ -192,6 +356,34 @@ bool lapack_qr(double* A, size_t nrows, size_t ncols, size_t urows) {
   return true;
 }
 
+/*
+ * Run a LAPACK triangular-pentagonal qr (dtpqrt) of [R; B], where R is
+ * upper triangular and the last ltri rows of B are upper trapezoidal.
+ * On return, R holds the new R and B the Householder vectors.
+ * @param ldr the leading dimension of R
+ * @param ldb the leading dimension of B
+ * @param ncols the number of columns of R and B
+ * @param urows the number of rows of B used
+ * @param ltri the number of rows of the trapezoidal part of B
+ */
+bool lapack_tpqr(double *R, size_t ldr, double *B, size_t ldb, size_t ncols,
+                 size_t urows, size_t ltri, LapackContext& ctx) {
+  int info = -1;
+  int m = urows;
+  int n = ncols;
+  int l = ltri;
+  int lda = ldr;
+  int stride = ldb;
+  // the block size of the compact WY representation
+  int nb = std::min(n, 16);
+  int ldt = nb;
+  // T and the workspace are both nb x n
+  double *T = ctx.work(2 * nb * n);
+  double *work = T + nb * n;
+  dtpqrt_(&m, &n, &l, &nb, R, &lda, B, &stride, T, &ldt, work, &info);
+  return info == 0;
+}
+
 /*
  * Run a LAPACK qr with explicit Q and R storage.
  * @param A is the matrix on which to perform QR
@@ -202,10 +394,11 @@ bool lapack_qr(double* A, size_t nrows, size_t ncols, size_t urows) {
  * In LAPACK parlance, nrows is the stride, and urows is
  * the size
  */
-bool lapack_full_qr(double *A, double *R, size_t nrows, size_t ncols, size_t urows) {
+bool lapack_full_qr(double *A, double *R, size_t nrows, size_t ncols,
+                    size_t urows, LapackContext& ctx) {
   size_t minsize = std::min(urows, ncols);
-  std::vector<double> tau(minsize);
-  if (!_lapack_qr(A, nrows, ncols, urows, tau)) {
+  double *tau = ctx.tau(minsize);
+  if (!_lapack_qr(A, nrows, ncols, urows, tau, ctx)) {
     return false;
   }
 
@@ -225,27 +418,62 @@ bool lapack_full_qr(double *A, double *R, size_t nrows, size_t ncols, size_t uro
   int k = ncols;
   int stride = nrows;
 
-  // do a workspace query
-  double worksize;
-  int lworkq = -1;  
-  dorgqr_(&m, &n, &k, A, &stride, &tau[0], &worksize, &lworkq, &info);
+  int lwork = ctx.orgqr_lwork(m, n, k, A, stride, tau);
+  if (lwork < 0) {
+    return false;
+  }
+  dorgqr_(&m, &n, &k, A, &stride, tau, ctx.work(lwork), &lwork, &info);
   if (info != 0) {
     return false;
   }
 
-  int lwork = (int) worksize;
-  std::vector<double> work(lwork);
-  dorgqr_(&m, &n, &k, A, &stride, &tau[0], &work[0], &lwork, &info);
+  return true;
+}
+
+/*
+ * Run a LAPACK qr of a row-major matrix, with explicit Q and R storage.
+ * The row-major A is the column-major transpose of A, so this is the LQ
+ * factorization of A^T = L Q^T and R = L^T, without transposing A.
+ * @param A is the row-major matrix; Q (row-major) is stored in A
+ * @param R is storage for the row-major R matrix
+ * @param nrows the number of rows of A
+ * @param ncols the number of columns of A
+ */
+bool lapack_row_major_qr(double *A, double *R, size_t nrows, size_t ncols,
+                         LapackContext& ctx) {
+  int info = -1;
+  int m = ncols;
+  int n = nrows;
+  int k = std::min(nrows, ncols);
+  int lda = ncols;
+  double *tau = ctx.tau(k);
+
+  int lwork = ctx.gelqf_lwork(m, n, A, lda);
+  if (lwork < 0) {
+    return false;
+  }
+  dgelqf_(&m, &n, A, &lda, tau, ctx.work(lwork), &lwork, &info);
   if (info != 0) {
     return false;
   }
 
-  return true;
+  // The row-major R = L^T is the column-major L.
+  for (int j = 0; j < k; ++j) {
+    for (int i = 0; i < k; ++i) {
+      R[i + j * k] = i < j ? 0. : A[i + j * lda];
+    }
+  }
+
+  lwork = ctx.orglq_lwork(m, n, k, A, lda, tau);
+  if (lwork < 0) {
+    return false;
+  }
+  dorglq_(&m, &n, &k, A, &lda, tau, ctx.work(lwork), &lwork, &info);
+  return info == 0;
 }
 
 bool lapack_tsmatmul(double *A, size_t nrows_A, size_t ncols_A,
 		     double *B, size_t ncols_B, double *C) {
-  hadoop_message("TSMATMUL\n");
   char transa = 'n';
   char transb = 'n';
   int m = (int) nrows_A;
@@ -260,7 +488,274 @@ bool lapack_tsmatmul(double *A, size_t nrows_A, size_t ncols_A,
   // Store result in A, since we are assuming B is square
   dgemm_(&transa, &transb, &m, &n, &k, &alpha, A,
          &lda, B, &ldb, &beta, C, &ldc);
+  return true;
+}
+
+/*
+ * Multiply a row-major A by a column-major B and store the row-major
+ * product in C, as the column-major product C^T = B^T A^T.
+ * @param nrows_A the number of rows of A
+ * @param ncols_A the number of columns of A and rows of B
+ * @param ncols_B the number of columns of B
+ */
+bool lapack_row_major_matmul(const double *A, size_t nrows_A, size_t ncols_A,
+                             const double *B, size_t ncols_B, double *C) {
+  char transa = 't';
+  char transb = 'n';
+  int m = (int) ncols_B;
+  int n = (int) nrows_A;
+  int k = (int) ncols_A;
+  double alpha = 1;
+  int lda = k;
+  int ldb = k;
+  double beta = 0;
+  int ldc = m;
+  dgemm_(&transa, &transb, &m, &n, &k, &alpha, const_cast<double *>(B),
+         &lda, const_cast<double *>(A), &ldb, &beta, C, &ldc);
+  return true;
+}
+
+bool lapack_gemm(bool transa, bool transb, size_t m, size_t n, size_t k,
+                 double alpha, const double *A, size_t lda, const double *B,
+                 size_t ldb, double beta, double *C, size_t ldc) {
+  if (m == 0 || n == 0) {
+    return true;
+  }
+  char ta = transa ? 't' : 'n';
+  char tb = transb ? 't' : 'n';
+  int im = (int) m;
+  int in = (int) n;
+  int ik = (int) k;
+  int ilda = (int) std::max(lda, (size_t) 1);
+  int ildb = (int) std::max(ldb, (size_t) 1);
+  int ildc = (int) ldc;
+  dgemm_(&ta, &tb, &im, &in, &ik, &alpha, const_cast<double *>(A), &ilda,
+         const_cast<double *>(B), &ildb, &beta, C, &ildc);
+  return true;
+}
+
+/*
+ * Overwrite A with A R^{-1}, where R is upper triangular.
+ * @param A the column-major matrix
+ * @param lda the leading dimension of A
+ * @param urows the number of rows of A used
+ * @param ncols the number of columns of A, and the order of R
+ * @param R the column-major R
+ */
+bool lapack_trsm(double *A, size_t lda, size_t urows, size_t ncols,
+                 const double *R) {
+  char side = 'R';
+  char uplo = 'U';
+  char transa = 'N';
+  char diag = 'N';
+  int m = (int) urows;
+  int n = (int) ncols;
+  double alpha = 1;
+  int ldr = n;
+  int ldb = (int) lda;
+  dtrsm_(&side, &uplo, &transa, &diag, &m, &n, &alpha,
+         const_cast<double *>(R), &ldr, A, &ldb);
+  return true;
+}
+
+/*
+ * Overwrite the row-major A with A R^{-1}, as the column-major
+ * A^T := R^{-T} A^T.
+ * @param nrows the number of rows of A
+ * @param ncols the number of columns of A, and the order of R
+ */
+bool lapack_row_major_trsm(double *A, size_t nrows, size_t ncols,
+                           const double *R) {
+  char side = 'L';
+  char uplo = 'U';
+  char transa = 'T';
+  char diag = 'N';
+  int m = (int) ncols;
+  int n = (int) nrows;
+  double alpha = 1;
+  int ldr = m;
+  int ldb = m;
+  dtrsm_(&side, &uplo, &transa, &diag, &m, &n, &alpha,
+         const_cast<double *>(R), &ldr, A, &ldb);
+  return true;
+}
+
+/*
+ * Overwrite B with R^{-1} B, the solution of R X = B.
+ * @param R the upper triangular n x n matrix (leading dimension ldr)
+ * @param B the column-major n x nrhs right-hand sides (leading dimension
+ *   ldb)
+ */
+bool lapack_tri_solve(const double *R, size_t ldr, size_t n, double *B,
+                      size_t ldb, size_t nrhs) {
+  char side = 'L';
+  char uplo = 'U';
+  char transa = 'N';
+  char diag = 'N';
+  int m = (int) n;
+  int nb = (int) nrhs;
+  double alpha = 1;
+  int lda = (int) ldr;
+  int ldx = (int) ldb;
+  if (m == 0 || nb == 0) {
+    return true;
+  }
+  dtrsm_(&side, &uplo, &transa, &diag, &m, &nb, &alpha,
+         const_cast<double *>(R), &lda, B, &ldx);
+  return true;
+}
 
-  hadoop_message("TSMATMUL success!\n");
+/*
+ * Overwrite R with L^T R, where L is the lower triangular factor left by
+ * lapack_chol.  Both are column-major ncols x ncols.
+ */
+bool lapack_chol_mult(const double *L, double *R, size_t ncols) {
+  char side = 'L';
+  char uplo = 'L';
+  char transa = 'T';
+  char diag = 'N';
+  int n = (int) ncols;
+  double alpha = 1;
+  dtrmm_(&side, &uplo, &transa, &diag, &n, &n, &alpha,
+         const_cast<double *>(L), &n, R, &n);
+  return true;
+}
+
+/*
+ * Run a LAPACK divide-and-conquer SVD (dgesdd) of the square A = U S V^T.
+ * @param A the column-major ncols x ncols matrix, destroyed on return
+ * @param S storage for the ncols singular values, in decreasing order
+ * @param U storage for the column-major U
+ * @param Vt storage for the column-major V^T
+ */
+bool lapack_svd(double *A, size_t ncols, double *S, double *U, double *Vt,
+                LapackContext& ctx) {
+  char jobz = 'A';
+  int n = (int) ncols;
+  int info;
+  std::vector<int> iwork(8 * ncols);
+
+  // workspace query
+  int lwork = -1;
+  double query;
+  dgesdd_(&jobz, &n, &n, A, &n, S, U, &n, Vt, &n, &query, &lwork, &iwork[0],
+          &info);
+  if (info != 0) {
+    return false;
+  }
+  lwork = (int) query;
+  dgesdd_(&jobz, &n, &n, A, &n, S, U, &n, Vt, &n, ctx.work(lwork), &lwork,
+          &iwork[0], &info);
+  return info == 0;
+}
+
+// Parse the key of a "(key) [v1, v2, ...]" line of a text dump of a
+// sequence file.  On return, buf points just past the key.
+void parse_text_dump_key(char *&buf, std::string& key) {
+  size_t i;
+  while (*buf != '\0' && *buf++ != '(') ;
+  if (*buf == '\0')
+    hadoop_error("could not find key while parsing matrix\n");
+
+  for (i = 0; buf[i] != '\0' && buf[i] != ')'; ++i) ;
+  if (buf[i] == '\0')
+    hadoop_error("could not find key while parsing matrix\n");
+
+  key.assign((const char *) buf, i);
+  buf += i + 1;
+}
+
+// Parse the values of a line of a text dump and append them to value.
+void parse_text_dump_values(char *buf, std::vector<double>& value) {
+  size_t i;
+  while (*buf != '\0' && *buf++ != '[') ;
+  if (*buf == '\0')
+    hadoop_error("could not find value while parsing matrix\n");
+
+  double val;
+  while (true) {
+    for (i = 0; buf[i] != '\0' && buf[i] != ',' && buf[i] != ']'; ++i) ;
+    if (buf[i] == '\0') {
+      hadoop_error("could not find value\n");
+    } else if (buf[i] == ',') {
+      if (sscanf(buf, "%lg,", &val) != 1)
+        hadoop_error("non-double in value\n");
+      value.push_back(val);
+      buf += i + 1;
+      // skip whitespace
+      ++buf;
+    } else {
+      if (sscanf(buf, "%lg]", &val) != 1)
+        hadoop_error("non-double in value\n");
+      value.push_back(val);
+      break;
+    }
+  }
+}
+
+bool read_small_matrix(const std::string& path, std::vector<double>& A,
+                       size_t& num_rows) {
+  A.clear();
+  num_rows = 0;
+  MatrixFile matrix;
+  if (matrix.open(path)) {
+    num_rows = matrix.num_rows();
+    A.resize(num_rows * matrix.num_cols());
+    if (!A.empty()) {
+      matrix.read_rows(0, num_rows, &A[0]);
+    }
+    return true;
+  }
+  FILE *f = fopen(path.c_str(), "rb");
+  if (!f) {
+    return false;
+  }
+  const std::string suffix = ".bin";
+  if (path.size() >= suffix.size() &&
+      path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0) {
+    double buf[4096];
+    size_t n;
+    while ((n = fread(buf, sizeof(double), 4096, f)) > 0) {
+      A.insert(A.end(), buf, buf + n);
+    }
+    fclose(f);
+    return true;
+  }
+
+  size_t num_cols = 0;
+  char b[262144];
+  while (fgets(b, sizeof(b), f)) {
+    // skip the key of a text dump
+    char *buf = strrchr(b, ')');
+    buf = buf == NULL ? b : buf + 1;
+    size_t row_start = A.size();
+    while (true) {
+      while (*buf != '\0' && strchr(" \t\r\n,[]", *buf) != NULL) {
+        ++buf;
+      }
+      if (*buf == '\0') {
+        break;
+      }
+      char *end;
+      double val = strtod(buf, &end);
+      if (end == buf) {
+        hadoop_error("non-double in row %zu of %s\n", num_rows, path.c_str());
+      }
+      A.push_back(val);
+      buf = end;
+    }
+    size_t row_size = A.size() - row_start;
+    if (row_size == 0) {
+      continue;
+    }
+    if (num_rows == 0) {
+      num_cols = row_size;
+    } else if (row_size != num_cols) {
+      hadoop_error("row %zu of %s has %zu columns, expected %zu\n", num_rows,
+                   path.c_str(), row_size, num_cols);
+    }
+    ++num_rows;
+  }
+  fclose(f);
   return true;
 }
@@ -13,8 +13,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <map>
 #include <string>
-
+#include <utility>
 #include <vector>
 
 // Write a message to stderr
@@ -28,12 +30,49 @@ void hadoop_error(const char* format, ...);
 
 void hadoop_counter(const char* name, int val);
 
+// Copy the column-major m x n matrix A (leading dimension lda) to the
+// column-major n x m matrix B (leading dimension ldb).
+void transpose(const double *A, size_t lda, double *B, size_t ldb,
+               size_t m, size_t n);
+
 // Copy A (row-major) to B (col-major)
 void row_to_col_major(double *A, double *B, size_t num_rows, size_t num_cols);
 
 // Copy A (col-major) to B (row-major)
 void col_to_row_major(double *A, double *B, size_t num_rows, size_t num_cols);
 
+// Transpose the n x n matrix A in place
+void transpose_square(double *A, size_t n);
+
+// Reusable LAPACK workspace and tau storage.  The optimal workspace
+// sizes are queried once for each (m, n) shape and the buffers only
+// grow, so repeated factorizations of the same shape do not allocate.
+// A context must not be shared between threads.
+class LapackContext {
+public:
+  // storage for at least size Householder scalars
+  double *tau(size_t size);
+  // workspace of at least size doubles
+  double *work(size_t size);
+
+  // the optimal lwork of dgeqrf for an m x n matrix
+  int geqrf_lwork(int m, int n, double *A, int lda);
+  // the optimal lwork of dorgqr for an m x n matrix with k reflectors
+  int orgqr_lwork(int m, int n, int k, double *A, int lda, double *tau);
+  // the optimal lwork of dgelqf for an m x n matrix
+  int gelqf_lwork(int m, int n, double *A, int lda);
+  // the optimal lwork of dorglq for an m x n matrix with k reflectors
+  int orglq_lwork(int m, int n, int k, double *A, int lda, double *tau);
+
+private:
+  std::vector<double> tau_;
+  std::vector<double> work_;
+  std::map<std::pair<int, int>, int> geqrf_lwork_;
+  std::map<std::pair<int, int>, int> orgqr_lwork_;
+  std::map<std::pair<int, int>, int> gelqf_lwork_;
+  std::map<std::pair<int, int>, int> orglq_lwork_;
+};
+
 /** Run a LAPACK daxpy
  * @param nrows the number of rows of A allocated
  * @param ncols the number of columns of A allocated
@@ -57,8 +96,18 @@ bool lapack_chol(double *A, int ncols);
 bool lapack_syrk(double* A, double* C, size_t nrows, size_t ncols,
                  size_t urows);
 
+/** Add the upper triangle of A^T A to C, without BLAS.  Rows are
+ * taken four at a time so that each column of C is loaded and stored
+ * once per four rows; the inner loops vectorize.  Meant for narrow A.
+ * @param A the row-major matrix
+ * @param nrows the number of rows of A
+ * @param ncols the number of columns of A
+ * @param C the column-major ncols x ncols result
+ */
+void gram_update(const double *A, size_t nrows, size_t ncols, double *C);
+
 bool _lapack_qr(double *A, size_t nrows, size_t ncols, size_t urows,
-                std::vector<double>& tau);
+                double *tau, LapackContext& ctx);
 
 // zero out the lower triangle of A
 void zero_out_lower_triangle(double *A, size_t rsize, size_t nrows);
@@ -71,7 +120,21 @@ void zero_out_lower_triangle(double *A, size_t rsize, size_t nrows);
  * In LAPACK parlance, nrows is the stride, and urows is
  * the size
  */
-bool lapack_qr(double* A, size_t nrows, size_t ncols, size_t urows);
+bool lapack_qr(double* A, size_t nrows, size_t ncols, size_t urows,
+               LapackContext& ctx);
+
+/*
+ * Run a LAPACK triangular-pentagonal qr (dtpqrt) of [R; B], where R is
+ * upper triangular and the last ltri rows of B are upper trapezoidal.
+ * On return, R holds the new R and B the Householder vectors.
+ * @param ldr the leading dimension of R
+ * @param ldb the leading dimension of B
+ * @param ncols the number of columns of R and B
+ * @param urows the number of rows of B used
+ * @param ltri the number of rows of the trapezoidal part of B
+ */
+bool lapack_tpqr(double *R, size_t ldr, double *B, size_t ldb, size_t ncols,
+                 size_t urows, size_t ltri, LapackContext& ctx);
 
 /*
  * Run a LAPACK qr with explicit Q and R storage.
@@ -84,9 +147,157 @@ bool lapack_qr(double* A, size_t nrows, size_t ncols, size_t urows);
  * the size
  */
 bool lapack_full_qr(double *A, double *R, size_t nrows, size_t ncols,
-                    size_t urows);
+                    size_t urows, LapackContext& ctx);
+
+/*
+ * Run a LAPACK qr of a row-major matrix, with explicit Q and R storage.
+ * The row-major A is the column-major transpose of A, so this is the LQ
+ * factorization of A^T = L Q^T and R = L^T, without transposing A.
+ * @param A is the row-major matrix; Q (row-major) is stored in A
+ * @param R is storage for the row-major R matrix
+ * @param nrows the number of rows of A
+ * @param ncols the number of columns of A
+ */
+bool lapack_row_major_qr(double *A, double *R, size_t nrows, size_t ncols,
+                         LapackContext& ctx);
 
 bool lapack_tsmatmul(double *A, size_t nrows_A, size_t ncols_A,
 		     double *B, size_t ncols_B, double *C);
 
+/*
+ * Multiply a row-major A by a column-major B and store the row-major
+ * product in C, as the column-major product C^T = B^T A^T.
+ * @param nrows_A the number of rows of A
+ * @param ncols_A the number of columns of A and rows of B
+ * @param ncols_B the number of columns of B
+ */
+bool lapack_row_major_matmul(const double *A, size_t nrows_A, size_t ncols_A,
+                             const double *B, size_t ncols_B, double *C);
+
+/*
+ * Run a LAPACK dgemm, C = alpha op(A) op(B) + beta C, on column-major
+ * matrices, where op(X) is X^T if the trans flag is set.
+ * @param m the number of rows of op(A) and C
+ * @param n the number of columns of op(B) and C
+ * @param k the number of columns of op(A) and rows of op(B)
+ */
+bool lapack_gemm(bool transa, bool transb, size_t m, size_t n, size_t k,
+                 double alpha, const double *A, size_t lda, const double *B,
+                 size_t ldb, double beta, double *C, size_t ldc);
+
+/*
+ * Overwrite A with A R^{-1}, where R is upper triangular (column-major).
+ * @param A the column-major matrix
+ * @param lda the leading dimension of A
+ * @param urows the number of rows of A used
+ * @param ncols the number of columns of A, and the order of R
+ */
+bool lapack_trsm(double *A, size_t lda, size_t urows, size_t ncols,
+                 const double *R);
+
+// lapack_trsm for a row-major A with nrows rows
+bool lapack_row_major_trsm(double *A, size_t nrows, size_t ncols,
+                           const double *R);
+
+// Overwrite the column-major n x nrhs B (leading dimension ldb) with the
+// solution X of R X = B, for the upper triangular R (leading dimension ldr).
+bool lapack_tri_solve(const double *R, size_t ldr, size_t n, double *B,
+                      size_t ldb, size_t nrhs);
+
+// Overwrite R with L^T R, where L is the lower triangular factor left by
+// lapack_chol.  Both are column-major ncols x ncols.
+bool lapack_chol_mult(const double *L, double *R, size_t ncols);
+
+/*
+ * Run a LAPACK divide-and-conquer SVD (dgesdd) of the square A = U S V^T.
+ * @param A the column-major ncols x ncols matrix, destroyed on return
+ * @param S storage for the ncols singular values, in decreasing order
+ * @param U storage for the column-major U
+ * @param Vt storage for the column-major V^T
+ */
+bool lapack_svd(double *A, size_t ncols, double *S, double *U, double *Vt,
+                LapackContext& ctx);
+
+// Parse the key of a "(key) [v1, v2, ...]" line of a text dump of a
+// sequence file, as written by dumbo's parse_seq_file.  On return, buf
+// points just past the key.
+void parse_text_dump_key(char *&buf, std::string& key);
+
+// Parse the values of a line of a text dump and append them to value.
+void parse_text_dump_values(char *buf, std::vector<double>& value);
+
+// Read a small matrix, such as the B of A * B, into the row-major A.
+// Text files have one row per line, either as in a text dump or as
+// values separated by commas or whitespace, and the keys of a text dump
+// are ignored (dumbo's util.parse_matrix_txt reads the same files).
+// Files ending in .bin hold the row-major doubles, and then num_rows is
+// 0, since only the caller knows the shape.  Matrix files (see
+// MatrixFile) are read with their shape.  Returns false if the file
+// cannot be read.
+bool read_small_matrix(const std::string& path, std::vector<double>& A,
+                       size_t& num_rows);
+
+// A flat binary matrix file for single-node runs:
+//   MatrixFileHeader
+//   the entries, from data_offset, in the layout and type of the header
+// The numbers are in native byte order.  There are no row keys; the
+// rows are numbered from 0.
+#define MATRIX_FILE_MAGIC "MRTSQRMF"
+
+enum MatrixFileType {
+  MATRIX_FILE_FLOAT64 = 0,
+  MATRIX_FILE_FLOAT32 = 1,
+};
+
+enum MatrixFileLayout {
+  MATRIX_FILE_ROW_MAJOR = 0,
+  MATRIX_FILE_COL_MAJOR = 1,
+};
+
+struct MatrixFileHeader {
+  char magic[8];
+  uint64_t num_rows;
+  uint64_t num_cols;
+  uint32_t dtype;
+  uint32_t layout;
+  uint64_t data_offset;
+};
+
+// Write the row-major nrows x ncols A to a matrix file of doubles.
+bool write_matrix_file(const std::string& path, const double *A,
+                       size_t nrows, size_t ncols,
+                       MatrixFileLayout layout=MATRIX_FILE_ROW_MAJOR);
+
+// Read-only, memory-mapped view of a matrix file.  Blocks of rows are
+// copied out of the page cache without any decoding, and the mapping is
+// marked sequential, with a readahead hint for the rows after each block,
+// so that files larger than memory stream through.
+class MatrixFile {
+public:
+  MatrixFile() : data_(NULL), size_(0), header_(NULL) {}
+  ~MatrixFile();
+
+  // Returns false if path is not a matrix file.
+  bool open(const std::string& path);
+
+  size_t num_rows() const { return (size_t) header_->num_rows; }
+  size_t num_cols() const { return (size_t) header_->num_cols; }
+
+  // Copy rows first, ..., first + nrows - 1 to the column-major dst with
+  // leading dimension ld.
+  void read_block(size_t first, size_t nrows, double *dst, size_t ld) const;
+  // Copy the same rows to the row-major dst.
+  void read_rows(size_t first, size_t nrows, double *dst) const;
+
+private:
+  // the address of entry (i, j)
+  const unsigned char *entry(size_t i, size_t j) const;
+  // madvise(MADV_WILLNEED) for rows first, ..., first + nrows - 1
+  void will_need(size_t first, size_t nrows) const;
+
+  unsigned char *data_;
+  size_t size_;
+  const MatrixFileHeader *header_;
+};
+
 #endif  // MRTSQR_CXX_TSQR_UTIL_H_
@@ -10,6 +10,7 @@
 #include "typedbytes.h"
 #include "stdio.h"
 
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -37,11 +38,11 @@ static inline void push_opaque_length(typedbytes_opaque& buffer,
 
 bool TypedBytesInFile::_read_opaque_primitive(typedbytes_opaque& buffer, 
                                               TypedBytesType type) {
-  // TODO check the fread commands in this function
   unsigned char bytebuf = 0;
   int32_t intbuf = 0;
   int64_t longbuf = 0;
   typedbytes_length len = 0;
+  size_t offset = 0;
     
   // NOTE the typecode has already been pushed
     
@@ -52,36 +53,31 @@ bool TypedBytesInFile::_read_opaque_primitive(typedbytes_opaque& buffer,
   switch (type) {
   case TypedBytesByte:
   case TypedBytesBoolean:
-    fread(&bytebuf, sizeof(unsigned char), 1, stream_);
+    _read_bytes(&bytebuf, sizeof(unsigned char), 1);
     push_opaque_bytes(buffer, &bytebuf, sizeof(unsigned char));
     break;
             
   case TypedBytesInteger:
   case TypedBytesFloat:
-    fread(&intbuf, sizeof(int32_t), 1, stream_);
+    _read_bytes(&intbuf, sizeof(int32_t), 1);
     push_opaque_bytes(buffer, (unsigned char*) &intbuf, sizeof(int32_t));
     break;
             
   case TypedBytesLong:
   case TypedBytesDouble:
-    fread(&longbuf, sizeof(int64_t), 1, stream_);
+    _read_bytes(&longbuf, sizeof(int64_t), 1);
     push_opaque_bytes(buffer, (unsigned char*) &longbuf, sizeof(int64_t));
     break;
             
   case TypedBytesString:
   case TypedBytesByteSequence:
     len = _read_length();
-    while (len > 0) {
-      // stream_ to buffer in longbuf bytes at a time.
-      if (len >= 8) {
-        fread(&longbuf, sizeof(int64_t), 1, stream_);
-        push_opaque_bytes(buffer, (unsigned char*) &longbuf, sizeof(int64_t));
-        len -= sizeof(int64_t);
-      } else {
-        fread(&longbuf, len, 1, stream_);
-        push_opaque_bytes(buffer, (unsigned char*) &longbuf, len);
-        break;
-      }
+    assert(len >= 0);
+    // read the data straight into the end of the buffer
+    offset = buffer.size();
+    buffer.resize(offset + (size_t) len);
+    if (len > 0) {
+      _read_bytes(&buffer[offset], sizeof(unsigned char), (size_t) len);
     }
     break;
 
@@ -137,10 +133,88 @@ bool TypedBytesInFile::read_opaque(typedbytes_opaque& buffer) {
 }
 
 
+bool TypedBytesInFile::_skip_bytes(size_t nbytes) {
+  // reset last_length_
+  last_length_ = -1;
+  size_t avail = buffer_end_ - buffer_pos_;
+  if (nbytes <= avail) {
+    buffer_pos_ += nbytes;
+    return true;
+  }
+  nbytes -= avail;
+  buffer_pos_ = buffer_end_;
+  // seek past large blocks when the stream allows it
+  if (nbytes >= buffer_.size() &&
+      fseek(stream_, (long) nbytes, SEEK_CUR) == 0) {
+    return true;
+  }
+  // otherwise (e.g., pipes), read and discard the data
+  unsigned char scratch[4096];
+  while (nbytes > 0) {
+    size_t chunk = 0;
+    if (buffer_.empty()) {
+      chunk = fread(scratch, 1, std::min(nbytes, sizeof(scratch)), stream_);
+    } else if (_fill(1)) {
+      chunk = std::min(nbytes, buffer_end_);
+      buffer_pos_ = chunk;
+    }
+    if (chunk == 0) {
+      return false;
+    }
+    nbytes -= chunk;
+  }
+  return true;
+}
+
+bool TypedBytesInFile::_skip_entry(TypedBytesType type) {
+  typedbytes_length len;
+  TypedBytesType nexttype;
+  switch (type) {
+  case TypedBytesByte:
+  case TypedBytesBoolean:
+    return _skip_bytes(sizeof(unsigned char));
+  case TypedBytesInteger:
+  case TypedBytesFloat:
+    return _skip_bytes(sizeof(int32_t));
+  case TypedBytesLong:
+  case TypedBytesDouble:
+    return _skip_bytes(sizeof(int64_t));
+  case TypedBytesString:
+  case TypedBytesByteSequence:
+    len = _read_length();
+    return len >= 0 && _skip_bytes((size_t) len);
+  case TypedBytesVector:
+    len = _read_length();
+    for (typedbytes_length i = 0; i < len; ++i) {
+      if (!_skip_entry(next_type())) {
+        return false;
+      }
+    }
+    return true;
+  case TypedBytesMap:
+    len = _read_length();
+    for (typedbytes_length i = 0; i < len; ++i) {
+      if (!_skip_entry(next_type()) || !_skip_entry(next_type())) {
+        return false;
+      }
+    }
+    return true;
+  case TypedBytesList:
+    nexttype = next_type();
+    while (nexttype != TypedBytesListEnd) {
+      if (!_skip_entry(nexttype)) {
+        return false;
+      }
+      nexttype = next_type();
+    }
+    return true;
+  default:
+    return false;
+  }
+}
+
 bool TypedBytesInFile::skip_next() {
-  // TODO, rewrite these functions to avoid loading into memory
-  typedbytes_opaque value;
-  return read_opaque(value);
+  return _skip_entry(next_type());
 }
 
 TypedBytesType TypedBytesInFile::next_type() {
@@ -159,7 +233,12 @@ TypedBytesType TypedBytesInFile::next_type() {
 }
     
 unsigned char TypedBytesInFile::next_type_code() {
-  int ch = fgetc(stream_);
+  int ch = EOF;
+  if (buffer_.empty()) {
+    ch = fgetc(stream_);
+  } else if (buffer_pos_ < buffer_end_ || _fill(1)) {
+    ch = buffer_[buffer_pos_++];
+  }
   // reset last_length_
   last_length_ = -1;
   if (ch == EOF) {
@@ -172,8 +251,58 @@ unsigned char TypedBytesInFile::next_type_code() {
   }
 }
     
+bool TypedBytesInFile::_fill(size_t nbytes) {
+  assert(nbytes <= buffer_.size());
+  // move the data we have not decoded yet to the front
+  size_t remaining = buffer_end_ - buffer_pos_;
+  if (buffer_pos_ > 0 && remaining > 0) {
+    memmove(&buffer_[0], &buffer_[buffer_pos_], remaining);
+  }
+  buffer_pos_ = 0;
+  buffer_end_ = remaining;
+  while (buffer_end_ < nbytes) {
+    size_t nread = fread(&buffer_[buffer_end_], 1,
+                         buffer_.size() - buffer_end_, stream_);
+    if (nread == 0) {
+      return false;
+    }
+    buffer_end_ += nread;
+  }
+  return true;
+}
+
 size_t TypedBytesInFile::_read_bytes(void *ptr, size_t nbytes, size_t nelem) {
-  size_t nread = fread(ptr, nbytes, nelem, stream_);
+  size_t nread = 0;
+  size_t total = nbytes * nelem;
+  if (buffer_.empty()) {
+    nread = fread(ptr, nbytes, nelem, stream_);
+  } else if (total <= buffer_end_ - buffer_pos_) {
+    // common case: everything is already in the buffer
+    memcpy(ptr, &buffer_[buffer_pos_], total);
+    buffer_pos_ += total;
+    nread = nelem;
+  } else {
+    // drain the buffer, then refill until we have enough
+    unsigned char *dst = (unsigned char *) ptr;
+    size_t copied = 0;
+    while (copied < total) {
+      if (buffer_pos_ == buffer_end_) {
+        if (total - copied >= buffer_.size()) {
+          // large reads bypass the buffer
+          copied += fread(dst + copied, 1, total - copied, stream_);
+          break;
+        }
+        if (!_fill(1)) {
+          break;
+        }
+      }
+      size_t chunk = std::min(total - copied, buffer_end_ - buffer_pos_);
+      memcpy(dst + copied, &buffer_[buffer_pos_], chunk);
+      buffer_pos_ += chunk;
+      copied += chunk;
+    }
+    nread = copied / nbytes;
+  }
   // TODO set error flag and determine more intelligent action.
   assert(nread == nelem);
   // reset last_length_
@@ -334,6 +463,76 @@ bool TypedBytesInFile::read_byte_sequence(unsigned char* data, size_t size) {
   return _read_data_block(data, size);
 }
 
+size_t TypedBytesInFile::read_double_run(double* data, size_t stride,
+                                         size_t max) {
+  const size_t entry_size = 1 + sizeof(int64_t);
+  size_t nread = 0;
+  while (nread < max) {
+    if (buffer_.empty()) {
+      int ch = fgetc(stream_);
+      if (ch != TypedBytesDouble) {
+        if (ch != EOF) {
+          ungetc(ch, stream_);
+        }
+        break;
+      }
+      int64_t val = 0;
+      _read_bytes(&val, sizeof(int64_t), 1);
+      val = bswap64(val);
+      memcpy(&data[nread * stride], &val, sizeof(int64_t));
+      ++nread;
+      continue;
+    }
+    if (buffer_end_ - buffer_pos_ < entry_size && !_fill(entry_size)) {
+      break;
+    }
+    // validate the type codes of every entry in the buffer first, then
+    // decode the whole run without any branches on the type.
+    const unsigned char *entry = &buffer_[buffer_pos_];
+    size_t avail = std::min(max - nread,
+                            (buffer_end_ - buffer_pos_) / entry_size);
+    size_t count = 0;
+    while (count < avail && entry[count * entry_size] == TypedBytesDouble) {
+      ++count;
+    }
+    for (size_t i = 0; i < count; ++i) {
+      int64_t val;
+      memcpy(&val, entry + i * entry_size + 1, sizeof(int64_t));
+      val = bswap64(val);
+      memcpy(&data[(nread + i) * stride], &val, sizeof(int64_t));
+    }
+    buffer_pos_ += count * entry_size;
+    nread += count;
+    if (count < avail) {
+      break;
+    }
+  }
+  if (nread > 0) {
+    last_code_ = TypedBytesDouble;
+    last_length_ = -1;
+  }
+  return nread;
+}
+
+bool TypedBytesInFile::read_data_doubles(double* data, size_t n,
+                                         size_t stride) {
+  assert(last_length_ >= 0);
+  if (n * sizeof(double) > (size_t) last_length_) {
+    return false;
+  }
+  for (size_t i = 0; i < n; ++i) {
+    if (buffer_end_ - buffer_pos_ >= sizeof(double)) {
+      memcpy(&data[i * stride], &buffer_[buffer_pos_], sizeof(double));
+      buffer_pos_ += sizeof(double);
+      last_length_ -= sizeof(double);
+    } else if (!_read_data_block((unsigned char *) &data[i * stride],
+                                 sizeof(double))) {
+      return false;
+    }
+  }
+  return true;
+}
+
 typedbytes_length TypedBytesInFile::read_typedbytes_sequence_length() {
 #ifdef TYPEDBYTES_STRICT_TYPE        
   if (last_code_ != TypedBytesVector && last_code_ != TypedBytesMap)
@@ -342,9 +541,42 @@ typedbytes_length TypedBytesInFile::read_typedbytes_sequence_length() {
   return _read_length();
 }
 
+bool TypedBytesOutFile::flush() {
+  if (buffer_pos_ == 0) {
+    return true;
+  }
+  size_t nwritten = fwrite(&buffer_[0], 1, buffer_pos_, stream_);
+  bool success = (nwritten == buffer_pos_);
+  buffer_pos_ = 0;
+  return success;
+}
+
+bool TypedBytesOutFile::_write_bytes(const void* ptr, size_t nbytes,
+                                     size_t nelem) {
+  size_t total = nbytes * nelem;
+  if (total <= buffer_.size() - buffer_pos_) {
+    // common case: there is room in the buffer
+    if (total > 0) {
+      memcpy(&buffer_[buffer_pos_], ptr, total);
+    }
+    buffer_pos_ += total;
+    return true;
+  }
+  if (!flush()) {
+    return false;
+  }
+  if (total > buffer_.size()) {
+    // large writes bypass the buffer
+    return fwrite(ptr, nbytes, nelem, stream_) == nelem;
+  }
+  memcpy(&buffer_[0], ptr, total);
+  buffer_pos_ = total;
+  return true;
+}
+
 bool TypedBytesOutFile::_write_length(typedbytes_length len) {
   len = bswap32(len);
-  return fwrite(&len, sizeof(typedbytes_length), 1, stream_) == 1;
+  return _write_bytes(&len, sizeof(typedbytes_length), 1);
 }
 
 bool TypedBytesOutFile::_write_code(TypedBytesType t) {
@@ -385,3 +617,36 @@ bool TypedBytesOutFile::write_double(double val) {
   return _write_code(TypedBytesDouble) &&
     _write_bytes(&sval, sizeof(int64_t), 1);
 }
+
+bool TypedBytesOutFile::write_double_array(const double* vals, size_t n,
+                                           size_t stride) {
+  const size_t entry_size = 1 + sizeof(int64_t);
+  if (buffer_.size() < entry_size) {
+    // unbuffered output
+    for (size_t i = 0; i < n; ++i) {
+      if (!write_double(vals[i * stride])) {
+        return false;
+      }
+    }
+    return true;
+  }
+  size_t nwritten = 0;
+  while (nwritten < n) {
+    if (buffer_.size() - buffer_pos_ < entry_size && !flush()) {
+      return false;
+    }
+    size_t count = std::min(n - nwritten,
+                            (buffer_.size() - buffer_pos_) / entry_size);
+    unsigned char *entry = &buffer_[buffer_pos_];
+    for (size_t i = 0; i < count; ++i) {
+      int64_t sval;
+      memcpy(&sval, &vals[(nwritten + i) * stride], sizeof(int64_t));
+      sval = bswap64(sval);
+      entry[i * entry_size] = (unsigned char) TypedBytesDouble;
+      memcpy(entry + i * entry_size + 1, &sval, sizeof(int64_t));
+    }
+    buffer_pos_ += count * entry_size;
+    nwritten += count;
+  }
+  return true;
+}
@@ -49,11 +49,27 @@ typedef std::vector<unsigned char> typedbytes_opaque;
 // define this type for asserts on the primitive read operations
 #define TYPEDBYTES_STRICT_TYPE
 
+// Size of the input and output buffers used by TypedBytesInFile and
+// TypedBytesOutFile.  Pass a buffer_size of 0 to the constructors to
+// read or write straight through the FILE stream instead.
+#ifndef TYPEDBYTES_DEFAULT_BUFFER_SIZE
+# define TYPEDBYTES_DEFAULT_BUFFER_SIZE (4 << 20)
+#endif
+
 class TypedBytesInFile {
  public:    
- TypedBytesInFile(FILE* stream) 
-   : stream_(stream), last_code_(TypedBytesTypeError), last_length_(-1)
+ TypedBytesInFile(FILE* stream,
+                  size_t buffer_size=TYPEDBYTES_DEFAULT_BUFFER_SIZE) 
+   : stream_(stream), last_code_(TypedBytesTypeError), last_length_(-1),
+    buffer_(buffer_size), buffer_pos_(0), buffer_end_(0)
     {}
+
+  // True once every byte of the stream has been decoded.  Use this
+  // instead of feof(get_stream()), since the stream runs ahead of the
+  // decoder when the input is buffered.
+  bool eof() {
+    return buffer_pos_ == buffer_end_ && feof(stream_);
+  }
     
   // Get the next type code as a supported type.
   TypedBytesType next_type();
@@ -103,6 +119,8 @@ class TypedBytesInFile {
   bool read_opaque(typedbytes_opaque& buffer);
     
   // Skip the next entry in the TypedBytes file.
+  // Nothing is allocated; the data is consumed from the buffer or
+  // skipped with fseek when the stream supports it.
   bool skip_next();
         
   int read_int();
@@ -126,6 +144,17 @@ class TypedBytesInFile {
   // If size < read_byte_sequence_length(), then you can call
   // this function multiple times sequentially.
   bool read_byte_sequence(unsigned char* data, size_t size);
+
+  // Read a run of TypedBytesDouble entries from inside a list or vector
+  // and store them at data[0], data[stride], data[2*stride], ...
+  // Stops after max entries or at the first entry that is not a double,
+  // which is left unread.  Returns the number of entries read.
+  size_t read_double_run(double* data, size_t stride, size_t max);
+
+  // Must be called after read_byte_sequence_length or read_string_length.
+  // Copy n native doubles from the data to data[0], data[stride], ...
+  bool read_data_doubles(double* data, size_t n, size_t stride);
+
   FILE *get_stream() { return stream_; }
   TypedBytesType get_last_code() { return last_code_; }
   typedbytes_length get_last_length() { return last_length_; }
@@ -137,10 +166,26 @@ class TypedBytesInFile {
   // the string/byte-seq length read (decremented by any reading)
   typedbytes_length last_length_;
 
+  // input buffer, valid data is buffer_[buffer_pos_, buffer_end_)
+  std::vector<unsigned char> buffer_;
+  size_t buffer_pos_;
+  size_t buffer_end_;
+
+  // Refill the input buffer from the stream until at least nbytes are
+  // buffered, keeping any data not yet decoded.
+  // Returns false if the stream ends first.
+  bool _fill(size_t nbytes);
+
   bool _read_opaque_primitive(typedbytes_opaque& buffer, 
                               TypedBytesType typecode);
   bool _read_opaque(typedbytes_opaque& buffer, bool list);
 
+  // Skip the rest of an entry whose type code has already been read.
+  bool _skip_entry(TypedBytesType type);
+
+  // Skip over nbytes of raw data.
+  bool _skip_bytes(size_t nbytes);
+
 
   // Read bytes and handle errors.
   // DO NOT call this function directly.
@@ -152,9 +197,17 @@ class TypedBytesInFile {
 
 class TypedBytesOutFile {
  public:
- TypedBytesOutFile(FILE *stream)
-   : stream_(stream)
+ TypedBytesOutFile(FILE *stream,
+                   size_t buffer_size=TYPEDBYTES_DEFAULT_BUFFER_SIZE)
+   : stream_(stream), buffer_(buffer_size), buffer_pos_(0)
   {}
+
+  ~TypedBytesOutFile() {
+    flush();
+  }
+
+  // Write any buffered output to the stream.
+  bool flush();
         
   bool write_byte_sequence(unsigned char* bytes, typedbytes_length size) {
     return _write_code(TypedBytesByteSequence) && _write_length(size) &&
@@ -169,11 +222,27 @@ class TypedBytesOutFile {
   bool write_long(typedbytes_long val);
   bool write_float(float val);
   bool write_double(double val);
+
+  // Write n doubles stored at vals[0], vals[stride], vals[2*stride], ...
+  // as a sequence of TypedBytesDouble entries with no enclosing
+  // container.  The values are byte-swapped straight into the buffer.
+  bool write_double_array(const double* vals, size_t n, size_t stride=1);
+
+  // Same as write_double_array, but wrapped in a list or a vector.
+  bool write_double_list(const double* vals, size_t n, size_t stride=1) {
+    return write_list_start() && write_double_array(vals, n, stride) &&
+      write_list_end();
+  }
+  bool write_double_vector(const double* vals, size_t n, size_t stride=1) {
+    return write_vector_start((typedbytes_length) n) &&
+      write_double_array(vals, n, stride);
+  }
+
   bool write_string(const char* str, typedbytes_length size) {
     return _write_code(TypedBytesString) && _write_length(size) &&
       _write_bytes(str, sizeof(unsigned char), (size_t) size);
   }
-  bool write_string_stl(std::string& str) {
+  bool write_string_stl(const std::string& str) {
     return write_string(str.c_str(), str.size());
   }
     
@@ -196,7 +265,7 @@ class TypedBytesOutFile {
   }
         
   // Write out opaque typedbytes data direct to the stream. 
-  // This is just a high level wrapper around fwrite to the stream.
+  // This is just a high level wrapper around _write_bytes.
   bool write_opaque_type(unsigned char* bytes, size_t size) {
     return _write_bytes(bytes, 1, size);
   }
@@ -204,13 +273,15 @@ class TypedBytesOutFile {
  private:
   bool _write_length(typedbytes_length len);
     
-  bool _write_bytes(const void* ptr, size_t nbytes, size_t nelem) {
-    return fwrite(ptr, nbytes, nelem, stream_) == nelem;
-  }
+  bool _write_bytes(const void* ptr, size_t nbytes, size_t nelem);
     
   bool _write_code(TypedBytesType t);
 
   FILE* stream_;
+
+  // output buffer, pending data is buffer_[0, buffer_pos_)
+  std::vector<unsigned char> buffer_;
+  size_t buffer_pos_;
 };
         
 #endif  // MRTSQR_CXX_TYPEDBYTES_H
@@ -52,11 +52,11 @@ std::vector<std::string>& split(
 void mapper(TypedBytesInFile& in, TypedBytesOutFile& out) {
     fprintf(stderr, "starting mapper...\n");
     std::string value;
-    while (!feof(in.get_stream())) {
+    while (!in.eof()) {
         // read the key
         TypedBytesType keycode = in.next_type();
         if (keycode == TypedBytesTypeError) {
-            if (feof(in.get_stream())) {
+            if (in.eof()) {
                 return;
             }
             else {
@@ -90,7 +90,7 @@ void mapper(TypedBytesInFile& in, TypedBytesOutFile& out) {
 void reducer(TypedBytesInFile& in, TypedBytesOutFile& out) {
     std::string curkey;
     std::string nextkey;
-    if (feof(in.get_stream())) {
+    if (in.eof()) {
         return;
     }
     
@@ -102,10 +102,10 @@ void reducer(TypedBytesInFile& in, TypedBytesOutFile& out) {
     
     int64_t reduce_val = value;
     
-    while (!feof(in.get_stream())) {
+    while (!in.eof()) {
         TypedBytesType keytype = in.next_type();
         if (keytype==TypedBytesTypeError) {
-            if (feof(in.get_stream())) {
+            if (in.eof()) {
                 return;
             }
             else {
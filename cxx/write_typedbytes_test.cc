@@ -96,5 +96,8 @@ int main(int argc, char **argv) {
     tbf.write_bool(false);
     tbf.write_int(5);
     tbf.write_double(M_PI);
-    
+
+    double vals[4] = {1., -2., 0.25, M_PI};
+    tbf.write_double_list(vals, 4);
+    tbf.write_double_vector(vals, 2, 2);
 }